@@ -21,9 +21,10 @@ Client::Client(uint32_t trackerIP, uint16_t trackerPort) {
     myLoggingOut = false;
     autoSave = false;
      autoSaveDone = false;
+    myAutosaveInterval = 0;
     firstTimeLoggedIn = true;
     
-    myBuffer = new std::vector<unsigned char>();
+    myBuffer = new ReceiveBuffer(RECEIVE_BUFFER_SIZE);
 
     myTrackerIP = trackerIP;
     myTrackerPort = trackerPort;
@@ -42,6 +43,10 @@ Client::Client(uint32_t trackerIP, uint16_t trackerPort) {
     debug("initial msgID: %d", myMsgID);
 }
 
+void Client::setAutosaveInterval(unsigned int seconds) {
+    myAutosaveInterval = seconds;
+}
+
 void Client::runGame() {
     char commandBuffer[MAX_CMD_LENGTH + 1] = {0};
 
@@ -93,7 +98,7 @@ void Client::doTCP() {
         FD_SET(fileno(stdin), &readfds);
         FD_SET(mySocket, &readfds);
 
-        if (difftime(time(NULL), lastTimeSavedState) >= 60.0) {
+        if (myAutosaveInterval && difftime(time(NULL), lastTimeSavedState) >= myAutosaveInterval) {
           lastTimeSavedState = time(NULL);
           autoSave = true;
           myGameState = FINDING_STATE;
@@ -289,7 +294,8 @@ bool Client::updateGame(unsigned char *bufferClient, size_t bytesRead) {
     Packet *packet;
 
     try {
-        packetsParsed = myTww->parsePackets(bufferClient, bytesRead, myBuffer);
+        myBuffer->append(bufferClient, bytesRead);
+        packetsParsed = myTww->parsePackets(myBuffer);
         debug("number of packets: %u", packetsParsed->size());
 
         for (unsigned int i = 0; i < packetsParsed->size(); i++) {
@@ -307,6 +313,15 @@ bool Client::updateGame(unsigned char *bufferClient, size_t bytesRead) {
                 debug("MOVE_NOTIFY");
                 processMoveNotify(packet);
                 break;
+            case VISION_ENTER:
+                /* Laid out like a MOVE_NOTIFY, of somebody we couldn't see. */
+                debug("VISION_ENTER");
+                processMoveNotify(packet);
+                break;
+            case VISION_LEAVE:
+                debug("VISION_LEAVE");
+                processVisionLeave(packet);
+                break;
             case ATTACK_NOTIFY:
                 debug("ATTACK_NOTIFY");
                 processAttackNotify(packet);
@@ -356,7 +371,7 @@ void Client::sendLoginRequest(char *playerName) {
     Packet *packet = myTww->makeLoginPacket(myPlayer->myName, myPlayer->myHp, myPlayer->myExp,
                         myPlayer->myLocation.x, myPlayer->myLocation.y);
     sendAll(packet->packet, packet->length);
-    delete packet;
+    packet->release();
 }
 
 void Client::sendMove(char *direction) {
@@ -385,7 +400,7 @@ void Client::sendMove(char *direction) {
     }
     Packet *packet = myTww->makeMovePacket((uint8_t) dir);
     sendAll(packet->packet, packet->length);
-    delete packet;
+    packet->release();
 }
 
 void Client::sendAttack(char *playerName) {
@@ -409,7 +424,7 @@ void Client::sendAttack(char *playerName) {
 
     sendAll(packet->packet, packet->length);
     debug("madeAttackPacket! packet length: %d", packet->length);
-    delete packet;
+    packet->release();
 }
 
 void Client::sendSpeak(char *msg) {
@@ -433,13 +448,13 @@ void Client::sendSpeak(char *msg) {
     Packet *packet = myTww->makeSpeakPacket(msg);
     sendAll(packet->packet, packet->length);
     debug("madeSpeakPacket! packet length: %d", packet->length);
-    delete packet;
+    packet->release();
 }
 
 void Client::sendLogout() {
     Packet *packet = myTww->makeLogoutPacket();
     sendAll(packet->packet, packet->length);
-    delete packet;
+    packet->release();
 }
 
 void Client::sendAll(unsigned char *buffer, size_t length) {
@@ -521,8 +536,8 @@ void Client::processLoginReply(Packet *packet) {
         struct tww_login_reply *loginReply;
         loginReply = (struct tww_login_reply *) (packet->packet + sizeof(tww_packet_header));
         struct location loc;
-        loc.x = loginReply->x;
-        loc.y = loginReply->y;
+        loc.x = ntoh_coord(loginReply->x);
+        loc.y = ntoh_coord(loginReply->y);
         if (loc.x > DUNGEON_SIZE_X || loc.y > DUNGEON_SIZE_Y) {
             debug("Location size out of bounds");
             throw -1;
@@ -534,7 +549,7 @@ void Client::processLoginReply(Packet *packet) {
             throw -1;
         }
         
-        myDungeon->addPlayer(myPlayer);
+        myDungeon->addPlayer(myPlayer, NO_OWNER);
         myGameState = LOGGED_IN;
     } else if (errorCode != 1) {
         throw -1;
@@ -550,6 +565,8 @@ void Client::processMoveNotify(Packet *packet) {
     moveReply = (struct tww_move_notify *) (packet->packet + sizeof(tww_packet_header));
     moveReply->hp = ntohl(moveReply->hp);
     moveReply->exp = ntohl(moveReply->exp);
+    moveReply->x = ntoh_coord(moveReply->x);
+    moveReply->y = ntoh_coord(moveReply->y);
 
     debug("RECEIVED x:%d Y:%d", moveReply->x, moveReply->y);
     if (!check_player_name(moveReply->name) ||
@@ -561,54 +578,19 @@ void Client::processMoveNotify(Packet *packet) {
     }
 
     Player *movedPlayer = myDungeon->findPlayer(moveReply->name);
+    struct location loc;
+    loc.x = moveReply->x;
+    loc.y = moveReply->y;
 
-    PlayerList playersInRangeBefore;
-    PlayerList playersInRangeAfter;
-
+    /* The server sends VISION_ENTER and VISION_LEAVE as players come and go,
+       so there is nothing to work out about anybody else. */
     if (movedPlayer) {
-        if (myPlayer == movedPlayer) {
-            myDungeon->playersInRangeOf(myPlayer, playersInRangeBefore);
-        }
-        movedPlayer->myLocation.x = moveReply->x;
-        movedPlayer->myLocation.y = moveReply->y;
+        myDungeon->placePlayer(movedPlayer, loc);
         movedPlayer->myHp = moveReply->hp;
         movedPlayer->myExp = moveReply->exp;
-        
     } else {
-        struct location loc;
-        loc.x = moveReply->x;
-        loc.y = moveReply->y;
         movedPlayer = new Player(moveReply->name, moveReply->hp, moveReply->exp, loc);
-        myDungeon->addPlayer(movedPlayer);
-    
-    }
-
-    /* Print locations of newly seen players. */
-    if (myPlayer == movedPlayer) {
-        myDungeon->playersInRangeOf(myPlayer, playersInRangeAfter);
-
-        Player *newlySeenPlayer;
-        unsigned int i, j;
-        bool newlySeen;
-        
-        for (i = 0; i < playersInRangeAfter.size(); i++) {
-            newlySeenPlayer = playersInRangeAfter[i];
-
-            /* Assume newly seen until proven not. */
-            newlySeen = true;
-            for (j = 0; j < playersInRangeBefore.size(); j++) {
-                if (playersInRangeBefore[j] == newlySeenPlayer) {
-                    newlySeen = false;
-                    break;
-                }
-            }
-
-            if (newlySeen) {
-                on_move_notify(newlySeenPlayer->myName,
-                        newlySeenPlayer->myLocation.x, newlySeenPlayer->myLocation.y,
-                        newlySeenPlayer->myHp, newlySeenPlayer->myExp);
-            }
-        }
+        myDungeon->addPlayer(movedPlayer, NO_OWNER);
     }
 
     if (myPlayer == movedPlayer || myDungeon->inVision(myPlayer, movedPlayer)) {
@@ -622,6 +604,25 @@ void Client::processMoveNotify(Packet *packet) {
     }
 }
 
+void Client::processVisionLeave(Packet *packet) {
+    if (packet->length != sizeof(tww_packet_header) + sizeof(tww_vision_leave)) {
+        throw -1;
+    }
+
+    struct tww_vision_leave *leave;
+    leave = (struct tww_vision_leave *) (packet->packet + sizeof(tww_packet_header));
+    if (!check_player_name(leave->name)) {
+        throw -1;
+    }
+
+    Player *player = myDungeon->findPlayer(leave->name);
+    if (player == NULL || player == myPlayer) {
+        return;
+    }
+    myDungeon->removePlayer(player);
+    delete player;
+}
+
 void Client::processAttackNotify(Packet *packet) {
     if (packet->length != sizeof(tww_packet_header) + sizeof(tww_attack_notify)) {
         debug("processAttackNotify: packet length not equal");
@@ -638,18 +639,23 @@ void Client::processAttackNotify(Packet *packet) {
                 attackReply->attacker,attackReply->victim, attackReply->damage, attackReply->hp);
         throw -1;
     }
+    /* We only hear about attacks near us, but one side may be out of sight. */
     Player *attacker = myDungeon->findPlayer(attackReply->attacker);
     Player *victim = myDungeon->findPlayer(attackReply->victim);
+    if (attacker) {
+        attacker->myExp += attackReply->damage;
+    }
+    if (victim) {
+        if ((victim->myHp - attackReply->damage) > attackReply->hp) {
+            debug("processAttacNotify: attackReply's Victim HP <  Victim's HP - attackReply's damage.");
+            throw -1;
+        }
+        victim->myHp = attackReply->hp;
+    }
     if (attacker == NULL || victim == NULL) {
         debug("processAttackNotify: either for the players are not found in myPlayers");
-        throw -1;
-    }
-    attacker->myExp += attackReply->damage;
-    if ((victim->myHp - attackReply->damage) > attackReply->hp) {
-        debug("processAttacNotify: attackReply's Victim HP <  Victim's HP - attackReply's damage.");
-        throw -1;
+        return;
     }
-    victim->myHp = attackReply->hp;
 
     if (myDungeon->inVision(myPlayer, attacker) && myDungeon->inVision(myPlayer, victim)) {
         on_attack_notify(attacker->myName, victim->myName, attackReply->damage, victim->myHp);
@@ -667,8 +673,9 @@ void Client::processSpeakNotify(Packet *packet) {
 
     Player *player = myDungeon->findPlayer(speakReply->name);
     if (player == NULL) {
-        debug("Player who wants to speak does not exist.\n");
-        throw -1;
+        /* It walked out of sight while the message was on its way. */
+        debug("Player who wants to speak is not in sight.\n");
+        return;
     }
     const char *speakMsg = (const char *) packet->packet + sizeof(tww_packet_header) + MAX_LOGIN_LENGTH + 1;
     if (strlen(speakMsg) > MAX_MSG_LENGTH || strlen(speakMsg) == 0) {
@@ -691,8 +698,8 @@ void Client::processLogoutNotify(Packet *packet) {
     logoutReply = (struct tww_logout_notify *) (packet->packet + sizeof(tww_packet_header));
     Player *player = myDungeon->findPlayer(logoutReply->name);
     if (player == NULL) {
-        debug("Player who wants to leave does not even exist!\n");
-        throw -1;
+        debug("Player who wants to leave is not in sight.\n");
+        return;
     }
     
     if (player == myPlayer) {
@@ -766,7 +773,7 @@ void Client::processPlayerStateResponse(UDPPacket *packet) {
     int hp = ntohl(playerStateReply->hp);
     int exp = ntohl(playerStateReply->exp);
 
-    struct location loc = {playerStateReply->x, playerStateReply->y};
+    struct location loc = {ntoh_coord(playerStateReply->x), ntoh_coord(playerStateReply->y)};
     if (strcmp(myPlayerName, playerStateReply->name) || hp < 0 || exp < 0 ||
         loc.x >= DUNGEON_SIZE_X || loc.y >= DUNGEON_SIZE_Y) {
         throw -1;
@@ -793,6 +800,10 @@ void Client::processServerAreaResponse(UDPPacket *packet) {
                         (packet->packet + sizeof(udp_packet_header));
     myLocationServerIP = ntohl(serverAreaReply->server_ip_address);
     myLocationServerPort = ntohs(serverAreaReply->server_tcp_port);
+    serverAreaReply->min_x = ntoh_coord(serverAreaReply->min_x);
+    serverAreaReply->max_x = ntoh_coord(serverAreaReply->max_x);
+    serverAreaReply->min_y = ntoh_coord(serverAreaReply->min_y);
+    serverAreaReply->max_y = ntoh_coord(serverAreaReply->max_y);
     
     if (serverAreaReply->max_x > DUNGEON_SIZE_X || serverAreaReply->max_y > DUNGEON_SIZE_Y) {
         throw -1;
@@ -835,6 +846,7 @@ static void deletePackets(PacketList *packets) {
 int main(int argc, char **argv) {
     uint32_t server = 0;
     uint16_t port = 0;
+    unsigned int autosaveInterval = 0;
 
     /* If no arguments, we assume defaults. */
     if (argc == 1) {
@@ -851,6 +863,9 @@ int main(int argc, char **argv) {
         } else if (opt == "-p") {
             port = atoi(argv[i+1]);
             i += 2;
+        } else if (opt == "-a") {
+            autosaveInterval = atoi(argv[i+1]);
+            i += 2;
         } else {
             i++;
         }
@@ -868,6 +883,7 @@ int main(int argc, char **argv) {
     }
 
     client = Client(server, port);
+    client.setAutosaveInterval(autosaveInterval);
     try {
         client.runGame();
         client.closeClient();
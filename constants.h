@@ -12,16 +12,70 @@
 
 #define VALID_VERSION 4
 #define MAX_LOGIN_LENGTH 9
+/* make LARGE_WORLD=1 builds a 10000x10000 world. Its coordinates take 
+   16 bits on the wire, in network byte order. */
+#ifdef LARGE_WORLD
+#define DUNGEON_SIZE_X 10000
+#define DUNGEON_SIZE_Y 10000
+typedef uint16_t coord_t;
+#define hton_coord(c) htons(c)
+#define ntoh_coord(c) ntohs(c)
+#else
 #define DUNGEON_SIZE_X 100
 #define DUNGEON_SIZE_Y 100
+typedef uint8_t coord_t;
+#define hton_coord(c) (c)
+#define ntoh_coord(c) (c)
+#endif
 #define VISION_RANGE 5
 #define MAX_MSG_LENGTH 255
 #define MAX_CMD_NAME_LENGTH 7
 #define MAX_CMD_LENGTH MAX_MSG_LENGTH + MAX_CMD_NAME_LENGTH
 #define MAX_PACKET_LENGTH 300
+#define RECEIVE_BUFFER_SIZE 4096
 #define MAX_NUM_CLIENTS 20
 #define MAX_NUM_SENT_HISTORY 50
+#define MAX_EPOLL_EVENTS 256
+#define MAX_NUM_SHARDS 64
+#define MAX_OUTPUT_QUEUE_BYTES 65536
+/* Players regain a point of HP this often. */
+#define HP_REGEN_INTERVAL_MS 5000
+#define HP_REGEN_MAX 120
+#define SNAPSHOT_INTERVAL_MS 100
+#define AUTOSAVE_INTERVAL_S 60
+#define SHUTDOWN_SAVE_MS 5000
+#define MAX_SNAPSHOT_READERS 8
+#define MAX_WRITEV_PACKETS 64
+#define MAX_TICK_RATE 1000
+#define PACKET_POOL_SMALL 32
+#define PACKET_POOL_MAX_FREE 4096
+#define URING_ENTRIES 1024
+#define URING_NUM_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define PLAYER_INDEX_SIZE 64
+#define PLAYER_RECORD_MAGIC 0x5457
+#define PLAYER_RECORD_VERSION 1
+#define USERS_DIRECTORY "users"
+#define USERS_LOG "users.log"
+#define LOG_READ_RECORDS 256
+#define LOG_COMPACT_MIN_RECORDS 4096
+#define USERS_TABLE "users.table"
+#define TABLE_INITIAL_SLOTS 1024
+#define STORE_COMMIT_DELAY_MS 0
+#define STORE_MAX_DIRTY 1024
+#define STORE_MAX_CACHED 65536
+#define STORE_RETRY_MS 1000
+#define STORE_MAX_ATTEMPTS 5
+#define PLAYER_SLAB_CHUNK_SIZE 1024
+#define PLAYER_SLAB_MAX_CHUNKS 1024
+#define GRID_CELL_SIZE VISION_RANGE
+#define GRID_CHUNK_SIZE 8
 #define NO_PLAYER NULL
+#define NO_OWNER -1
+/* A PlayerSlab slot's generation in the high half and its index in the low half. */
+typedef uint64_t player_handle_t;
+#define NO_PLAYER_HANDLE 0
 
 enum messages {
   LOGIN_REQUEST = 1,
@@ -36,8 +90,8 @@ enum messages {
   LOGOUT_NOTIFY,
   INVALID_STATE,
   
-  BLANK1,
-  BLANK2,
+  VISION_ENTER,
+  VISION_LEAVE,
   BLANK3,
   BLANK4,
   
@@ -83,6 +137,53 @@ enum p2p_states {
     P2P_ACTIVE
 };
 
+/* What to do when a client's output queue is full. */
+enum slow_consumer_policies {
+    SLOW_CONSUMER_DROP = 0,
+    SLOW_CONSUMER_COALESCE,
+    SLOW_CONSUMER_DISCONNECT
+};
+
+enum player_formats {
+    PLAYERS_LOG = 0,
+    PLAYERS_TABLE
+};
+
+/* What PlayerFile::read found. */
+enum record_results {
+    RECORD_FOUND = 0,
+    RECORD_MISSING,
+    RECORD_DAMAGED
+};
+
+enum network_backends {
+    BACKEND_EPOLL = 0,
+    BACKEND_URING
+};
+
+/* What an io_uring completion is for; kept in the top byte of user_data. */
+enum uring_operations {
+    URING_ACCEPT = 1,
+    URING_POLL,
+    URING_RECEIVE,
+    URING_SEND,
+    URING_CANCEL
+};
+
+enum shard_messages {
+    SHARD_HANDOFF = 0,
+    SHARD_BROADCAST,
+    SHARD_SEND,
+    SHARD_ROSTER_REQUEST,
+    SHARD_ENTER_REQUEST,
+    SHARD_ATTACK,
+    SHARD_CREDIT_EXP,
+    SHARD_AUTOSAVE,
+    SHARD_UNSAVED,
+    SHARD_FINAL_SAVE,
+    SHARD_FINAL_BATCH
+};
+
 enum peer_types {
     NOBODY = 0,
     PREDECESSOR,
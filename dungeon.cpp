@@ -1,4 +1,92 @@
 #include "tww.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/* FNV-1a over the zero padded name. */
+static unsigned int hashName(char *key) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_LOGIN_LENGTH + 1; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Where the cell at column and row sits in its chunk. */
+static unsigned int slotOf(unsigned int column, unsigned int row) {
+    return (row % GRID_CHUNK_SIZE) * GRID_CHUNK_SIZE + column % GRID_CHUNK_SIZE;
+}
+
+/* Appends the indexes of the players in cell inside either bounds. */
+static void collectWithin(struct grid_cell *cell, struct bounds *first, struct bounds *second,
+                          vector<int> &found) {
+    unsigned int numPlayers = cell->players.size();
+    const int *xs = cell->xs.data();
+    const int *ys = cell->ys.data();
+    unsigned int i = 0;
+
+    /* Inside is strictly between the bounds widened by one, which is what
+       the signed greater-than compares give us. */
+#if defined(__AVX2__)
+    __m256i firstMinX = _mm256_set1_epi32(first->minX - 1), firstMaxX = _mm256_set1_epi32(first->maxX + 1);
+    __m256i firstMinY = _mm256_set1_epi32(first->minY - 1), firstMaxY = _mm256_set1_epi32(first->maxY + 1);
+    __m256i secondMinX = _mm256_set1_epi32(second->minX - 1), secondMaxX = _mm256_set1_epi32(second->maxX + 1);
+    __m256i secondMinY = _mm256_set1_epi32(second->minY - 1), secondMaxY = _mm256_set1_epi32(second->maxY + 1);
+    __m256i x, y, inFirst, inSecond;
+    unsigned int mask;
+    for (; i + 8 <= numPlayers; i += 8) {
+        x = _mm256_loadu_si256((const __m256i *) (xs + i));
+        y = _mm256_loadu_si256((const __m256i *) (ys + i));
+        inFirst = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(x, firstMinX), _mm256_cmpgt_epi32(firstMaxX, x)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(y, firstMinY), _mm256_cmpgt_epi32(firstMaxY, y)));
+        inSecond = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(x, secondMinX), _mm256_cmpgt_epi32(secondMaxX, x)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(y, secondMinY), _mm256_cmpgt_epi32(secondMaxY, y)));
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(inFirst, inSecond)));
+        while (mask) {
+            found.push_back(cell->indexes[i + __builtin_ctz(mask)]);
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i firstMinX = _mm_set1_epi32(first->minX - 1), firstMaxX = _mm_set1_epi32(first->maxX + 1);
+    __m128i firstMinY = _mm_set1_epi32(first->minY - 1), firstMaxY = _mm_set1_epi32(first->maxY + 1);
+    __m128i secondMinX = _mm_set1_epi32(second->minX - 1), secondMaxX = _mm_set1_epi32(second->maxX + 1);
+    __m128i secondMinY = _mm_set1_epi32(second->minY - 1), secondMaxY = _mm_set1_epi32(second->maxY + 1);
+    __m128i x, y, inFirst, inSecond;
+    unsigned int mask;
+    for (; i + 4 <= numPlayers; i += 4) {
+        x = _mm_loadu_si128((const __m128i *) (xs + i));
+        y = _mm_loadu_si128((const __m128i *) (ys + i));
+        inFirst = _mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(x, firstMinX), _mm_cmpgt_epi32(firstMaxX, x)),
+            _mm_and_si128(_mm_cmpgt_epi32(y, firstMinY), _mm_cmpgt_epi32(firstMaxY, y)));
+        inSecond = _mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(x, secondMinX), _mm_cmpgt_epi32(secondMaxX, x)),
+            _mm_and_si128(_mm_cmpgt_epi32(y, secondMinY), _mm_cmpgt_epi32(secondMaxY, y)));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(inFirst, inSecond)));
+        while (mask) {
+            found.push_back(cell->indexes[i + __builtin_ctz(mask)]);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    /* Whatever is left over, or everything without vector instructions. */
+    for (; i < numPlayers; i++) {
+        if ((xs[i] >= first->minX && xs[i] <= first->maxX &&
+             ys[i] >= first->minY && ys[i] <= first->maxY) ||
+            (xs[i] >= second->minX && xs[i] <= second->maxX &&
+             ys[i] >= second->minY && ys[i] <= second->maxY)) {
+            found.push_back(cell->indexes[i]);
+        }
+    }
+}
 
 Dungeon::Dungeon(unsigned int width, unsigned int height) {
     myWidth = width;
@@ -8,10 +96,24 @@ Dungeon::Dungeon(unsigned int width, unsigned int height) {
     myMaxX = 0;
     myMaxY = 0;
     myPlayers = new PlayerList();
-
+    myIndexSize = PLAYER_INDEX_SIZE;
+    myIndex = (struct player_slot *) malloc(myIndexSize * sizeof(struct player_slot));
+    for (unsigned int i = 0; i < myIndexSize; i++) {
+        myIndex[i].index = -1;
+    }
+    myGridWidth = (width + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    myGridHeight = (height + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    myChunksWide = (myGridWidth + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+    myChunksHigh = (myGridHeight + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+    myChunks = (struct grid_chunk **) calloc(myChunksWide * myChunksHigh, sizeof(struct grid_chunk *));
+    mySnapshot = NULL;
+    /* Epoch 0 marks a reader slot as idle. */
+    myEpoch = 1;
+    memset(myReaderEpochs, 0, sizeof(myReaderEpochs));
+    myNumReaders = 0;
 }
 
-void Dungeon::setBoundary(uint8_t min_x, uint8_t min_y, uint8_t max_x, uint8_t max_y) {
+void Dungeon::setBoundary(coord_t min_x, coord_t min_y, coord_t max_x, coord_t max_y) {
     myMinX = min_x;
     myMinY = min_y;
     myMaxX = max_x;
@@ -26,8 +128,14 @@ Player * Dungeon::findPlayer(char *name) {
     return myPlayers->at(i);
 }
 
-void Dungeon::addPlayer(Player *player) {
+void Dungeon::addPlayer(Player *player, int owner) {
+    if ((myPlayers->size() + 1) * 2 > myIndexSize) {
+        growIndex();
+    }
     myPlayers->push_back(player);
+    myOwners.push_back(owner);
+    indexPlayer(myPlayers->size() - 1);
+    addToCell(myPlayers->size() - 1);
 }
 
 void Dungeon::removePlayer(Player *player) {    
@@ -35,7 +143,29 @@ void Dungeon::removePlayer(Player *player) {
     if (i == -1) {
         assert(0);
     }
-    myPlayers->erase(myPlayers->begin() + i);
+    removePlayerAt(i);
+}
+
+void Dungeon::removePlayerAt(int i) {
+    removeFromCell(myPlayers->at(i));
+    unindexSlot(findSlot(myPlayers->at(i)->myName));
+    int last = myPlayers->size() - 1;
+    if (i != last) {
+        Player *moved = myPlayers->at(last);
+        myPlayers->at(i) = moved;
+        myOwners[i] = myOwners[last];
+        myIndex[findSlot(moved->myName)].index = i;
+
+        struct grid_cell *cell = cellAt(columnOf(moved->myLocation.x), rowOf(moved->myLocation.y));
+        for (unsigned int j = 0; j < cell->players.size(); j++) {
+            if (cell->players[j] == moved) {
+                cell->indexes[j] = i;
+                break;
+            }
+        }
+    }
+    myPlayers->pop_back();
+    myOwners.pop_back();
 }
 
 void Dungeon::clear(Player *mainPlayer) {
@@ -49,13 +179,144 @@ void Dungeon::clear(Player *mainPlayer) {
     delete myPlayers;
     
     myPlayers = new PlayerList();
+    myOwners.clear();
+    for (unsigned int i = 0; i < myIndexSize; i++) {
+        myIndex[i].index = -1;
+    }
+    for (unsigned int i = 0; i < myChunksWide * myChunksHigh; i++) {
+        if (myChunks[i]) {
+            for (unsigned int j = 0; j < GRID_CHUNK_SIZE * GRID_CHUNK_SIZE; j++) {
+                delete myChunks[i]->cells[j];
+            }
+            delete myChunks[i];
+            myChunks[i] = NULL;
+        }
+    }
+}
+
+void Dungeon::takeUnsavedPlayers(UserDataList &users) {
+    struct p2p_user_data user;
+    Player *player;
+    uint64_t now = monotonicMillis();
+    memset(&user, 0, sizeof(user));
+    for (unsigned int i = 0; i < myPlayers->size(); i++) {
+        player = myPlayers->at(i);
+        if (!player->myUnsaved) {
+            continue;
+        }
+        strncpy(user.name, player->myName, MAX_LOGIN_LENGTH + 1);
+        user.hp = player->hpAt(now);
+        user.exp = player->myExp;
+        user.x = player->myLocation.x;
+        user.y = player->myLocation.y;
+        users.push_back(user);
+        player->myUnsaved = false;
+    }
 }
 
 void Dungeon::movePlayer(Player *player, int direction) {
     struct location newLocation;
     computeMovePlayer(player->myLocation, direction, &newLocation);
-    player->myLocation.x = newLocation.x;
-    player->myLocation.y = newLocation.y;
+    placePlayer(player, newLocation);
+}
+
+void Dungeon::placePlayer(Player *player, struct location loc) {
+    player->myUnsaved = true;
+    unsigned int column = columnOf(player->myLocation.x);
+    unsigned int row = rowOf(player->myLocation.y);
+    struct grid_cell *cell = cellAt(column, row);
+    if (cell && column == columnOf(loc.x) && row == rowOf(loc.y)) {
+        player->myLocation = loc;
+        for (unsigned int j = 0; j < cell->players.size(); j++) {
+            if (cell->players[j] == player) {
+                cell->xs[j] = loc.x;
+                cell->ys[j] = loc.y;
+                break;
+            }
+        }
+        return;
+    }
+
+    int i = removeFromCell(player);
+    player->myLocation = loc;
+    if (i != -1) {
+        addToCell(i);
+    }
+}
+
+unsigned int Dungeon::columnOf(int x) {
+    return min((unsigned int) max(x, 0) / GRID_CELL_SIZE, myGridWidth - 1);
+}
+
+unsigned int Dungeon::rowOf(int y) {
+    return min((unsigned int) max(y, 0) / GRID_CELL_SIZE, myGridHeight - 1);
+}
+
+struct grid_chunk ** Dungeon::chunkAt(unsigned int column, unsigned int row) {
+    return &myChunks[(row / GRID_CHUNK_SIZE) * myChunksWide + column / GRID_CHUNK_SIZE];
+}
+
+struct grid_cell * Dungeon::cellAt(unsigned int column, unsigned int row) {
+    struct grid_chunk *chunk = *chunkAt(column, row);
+    if (!chunk) {
+        return NULL;
+    }
+    return chunk->cells[slotOf(column, row)];
+}
+
+void Dungeon::addToCell(int i) {
+    Player *player = myPlayers->at(i);
+    unsigned int column = columnOf(player->myLocation.x);
+    unsigned int row = rowOf(player->myLocation.y);
+    struct grid_chunk **chunk = chunkAt(column, row);
+    if (!*chunk) {
+        *chunk = new struct grid_chunk();
+    }
+    (*chunk)->numPlayers++;
+
+    struct grid_cell *cell = (*chunk)->cells[slotOf(column, row)];
+    if (!cell) {
+        cell = (*chunk)->cells[slotOf(column, row)] = new struct grid_cell();
+    }
+    cell->players.push_back(player);
+    cell->xs.push_back(player->myLocation.x);
+    cell->ys.push_back(player->myLocation.y);
+    cell->indexes.push_back(i);
+}
+
+int Dungeon::removeFromCell(Player *player) {
+    unsigned int column = columnOf(player->myLocation.x);
+    unsigned int row = rowOf(player->myLocation.y);
+    struct grid_cell *cell = cellAt(column, row);
+    if (!cell) {
+        return -1;
+    }
+    int index;
+    for (unsigned int j = 0; j < cell->players.size(); j++) {
+        if (cell->players[j] == player) {
+            index = cell->indexes[j];
+            cell->players[j] = cell->players.back();
+            cell->xs[j] = cell->xs.back();
+            cell->ys[j] = cell->ys.back();
+            cell->indexes[j] = cell->indexes.back();
+            cell->players.pop_back();
+            cell->xs.pop_back();
+            cell->ys.pop_back();
+            cell->indexes.pop_back();
+
+            struct grid_chunk **chunk = chunkAt(column, row);
+            if (cell->players.empty()) {
+                delete cell;
+                (*chunk)->cells[slotOf(column, row)] = NULL;
+            }
+            if (--(*chunk)->numPlayers == 0) {
+                delete *chunk;
+                *chunk = NULL;
+            }
+            return index;
+        }
+    }
+    return -1;
 }
 
 void Dungeon::computeMovePlayer(struct location oldLocation, int direction, struct location *newLocation) {
@@ -103,37 +364,85 @@ void Dungeon::printBoundary(struct location loc) {
 }
 
 bool Dungeon::inVision(Player *player, Player *otherPlayer) {
-    unsigned int x, y, otherX, otherY;
-    x = player->myLocation.x;
-    y = player->myLocation.y;
-    otherX = otherPlayer->myLocation.x;
-    otherY = otherPlayer->myLocation.y;
-
-    if (!Dungeon::withinBoundary(player->myLocation) ||
-        !Dungeon::withinBoundary(otherPlayer->myLocation)) {
+    if (!withinBoundary(player->myLocation)) {
         return false;
     }
 
-    return (otherX >= x - VISION_RANGE) &&
-           (otherX <= x + VISION_RANGE) &&
-           (otherY >= y - VISION_RANGE) &&
-           (otherY <= y + VISION_RANGE);
+    /* The clipped vision already keeps otherPlayer inside the boundary. */
+    struct bounds vision = clippedVisionOf(player->myLocation);
+    struct location loc = otherPlayer->myLocation;
+    return loc.x >= vision.minX && loc.x <= vision.maxX &&
+           loc.y >= vision.minY && loc.y <= vision.maxY;
+}
+
+bool Dungeon::inRange(struct location loc, struct location otherLoc) {
+    return abs(otherLoc.x - loc.x) <= VISION_RANGE &&
+           abs(otherLoc.y - loc.y) <= VISION_RANGE;
 }
 
 int Dungeon::findPlayerIndex(char *name) {
-    for (int i = 0; i < myPlayers->size(); i++) {
-        if (!strcmp(myPlayers->at(i)->myName, name)) {
-            return i;
+    return myIndex[findSlot(name)].index;
+}
+
+unsigned int Dungeon::findSlot(char *name) {
+    char key[MAX_LOGIN_LENGTH + 1];
+    strncpy(key, name, sizeof(key));
+
+    unsigned int mask = myIndexSize - 1;
+    unsigned int slot = hashName(key) & mask;
+    while (myIndex[slot].index != -1 && memcmp(myIndex[slot].name, key, sizeof(key))) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void Dungeon::indexPlayer(int i) {
+    char *name = myPlayers->at(i)->myName;
+    unsigned int slot = findSlot(name);
+    strncpy(myIndex[slot].name, name, sizeof(myIndex[slot].name));
+    myIndex[slot].index = i;
+}
+
+void Dungeon::unindexSlot(unsigned int slot) {
+    unsigned int mask = myIndexSize - 1;
+    unsigned int hole = slot;
+    unsigned int next = slot;
+    unsigned int home;
+    myIndex[hole].index = -1;
+    while (true) {
+        next = (next + 1) & mask;
+        if (myIndex[next].index == -1) {
+            return;
+        }
+        /* An entry can fill the hole unless it would land before its home. */
+        home = hashName(myIndex[next].name) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            myIndex[hole] = myIndex[next];
+            myIndex[next].index = -1;
+            hole = next;
         }
     }
-    return -1;
+}
+
+void Dungeon::growIndex() {
+    free(myIndex);
+    myIndexSize *= 2;
+    myIndex = (struct player_slot *) malloc(myIndexSize * sizeof(struct player_slot));
+    for (unsigned int i = 0; i < myIndexSize; i++) {
+        myIndex[i].index = -1;
+    }
+    for (unsigned int i = 0; i < myPlayers->size(); i++) {
+        indexPlayer(i);
+    }
 }
 
 bool Dungeon::locationOccupied(int x, int y) {
-    Player *player;
-    for (int i = 0; i < myPlayers->size(); i++) {
-        player = myPlayers->at(i);
-        if (player->myLocation.x == x && player->myLocation.y == y) {
+    struct grid_cell *cell = cellAt(columnOf(x), rowOf(y));
+    if (!cell) {
+        return false;
+    }
+    for (unsigned int j = 0; j < cell->players.size(); j++) {
+        if (cell->xs[j] == x && cell->ys[j] == y) {
             return true;
         }
     }
@@ -141,20 +450,65 @@ bool Dungeon::locationOccupied(int x, int y) {
 }
 
 void Dungeon::playersInRangeOf(Player *player, PlayerList &players) {
-    Player *otherPlayer;
-    for (int i = 0; i < myPlayers->size(); i++) {
-        otherPlayer = myPlayers->at(i);
-        if (otherPlayer != player && inVision(player, otherPlayer)) {
-            players.push_back(otherPlayer);
+    if (!withinBoundary(player->myLocation)) {
+        return;
+    }
+
+    struct bounds vision = clippedVisionOf(player->myLocation);
+    vector<int> found;
+    playersWithin(&vision, &vision, found);
+    for (unsigned int i = 0; i < found.size(); i++) {
+        if (myPlayers->at(found[i]) != player) {
+            players.push_back(myPlayers->at(found[i]));
         }
     }
 }
 
-void Dungeon::incrementHPForAllPlayers() {
-    Player *player;
-    for (int i = 0; i < myPlayers->size(); i++) {
-        player = myPlayers->at(i);
-        player->myHp++;
+struct bounds Dungeon::visionOf(struct location loc) {
+    struct bounds vision;
+    vision.minX = loc.x - VISION_RANGE;
+    vision.maxX = loc.x + VISION_RANGE;
+    vision.minY = loc.y - VISION_RANGE;
+    vision.maxY = loc.y + VISION_RANGE;
+    return vision;
+}
+
+struct bounds Dungeon::clippedVisionOf(struct location loc) {
+    /* Clipping once stands in for checking both players' boundaries for
+       every pair. */
+    struct bounds vision = visionOf(loc);
+    vision.minX = max(vision.minX, (int) myMinX);
+    vision.maxX = min(vision.maxX, (int) myMaxX);
+    vision.minY = max(vision.minY, (int) myMinY);
+    vision.maxY = min(vision.maxY, (int) myMaxY);
+    return vision;
+}
+
+void Dungeon::playersWithin(struct bounds *first, struct bounds *second, vector<int> &found) {
+    found.clear();
+    unsigned int firstLeft = columnOf(first->minX), firstRight = columnOf(first->maxX);
+    unsigned int firstTop = rowOf(first->minY), firstBottom = rowOf(first->maxY);
+    unsigned int row, column;
+    struct grid_cell *cell;
+    for (row = firstTop; row <= firstBottom; row++) {
+        for (column = firstLeft; column <= firstRight; column++) {
+            cell = cellAt(column, row);
+            if (cell) {
+                collectWithin(cell, first, second, found);
+            }
+        }
+    }
+    for (row = rowOf(second->minY); row <= rowOf(second->maxY); row++) {
+        for (column = columnOf(second->minX); column <= columnOf(second->maxX); column++) {
+            /* Cells under both bounds were already done. */
+            if (row >= firstTop && row <= firstBottom && column >= firstLeft && column <= firstRight) {
+                continue;
+            }
+            cell = cellAt(column, row);
+            if (cell) {
+                collectWithin(cell, first, second, found);
+            }
+        }
     }
 }
 
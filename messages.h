@@ -56,12 +56,12 @@ static inline void on_loc_resp(unsigned char type, unsigned int ipaddr, unsigned
   fflush(stdout);
 }
 
-static inline void on_state_resp(unsigned char type, char* name, int hp, int exp, unsigned char x, unsigned char y) {
+static inline void on_state_resp(unsigned char type, char* name, int hp, int exp, unsigned int x, unsigned int y) {
   fprintf(stdout, "**State Resp - TYPE: %d NAME: %s HP: %d EXP: %d XLOC: %d YLOC: %d.\n", type, name, hp, exp, x, y);
   fflush(stdout);
 }
 
-static inline void on_area_resp (unsigned char type, unsigned int ipaddr, unsigned short port, unsigned char minx, unsigned char maxx, unsigned char miny, unsigned char maxy) {
+static inline void on_area_resp (unsigned char type, unsigned int ipaddr, unsigned short port, unsigned int minx, unsigned int maxx, unsigned int miny, unsigned int maxy) {
   fprintf(stdout, "**Area Resp - TYPE: %d IPADDR: %x PORT: %x MINX: %d MAXX: %d MINY: %d MAXY: %d\n",type, ipaddr, port, minx, maxx, miny, maxy);
   fflush(stdout);
 }
@@ -138,8 +138,8 @@ static inline void on_login_reply(const int error_code)
 }
 
 static inline void on_move_notify(const char *player_name,
-                                  const uint8_t x,
-                                  const uint8_t y,
+                                  const unsigned int x,
+                                  const unsigned int y,
                                   const uint32_t hp,
                                   const uint32_t exp)
 {
@@ -0,0 +1,49 @@
+#include "tww.h"
+
+using namespace std;
+
+#define NUM_SIZE_CLASSES 2
+
+/* Every fixed size message fits the small class; speaks fit the large one. */
+static const size_t sizeClasses[NUM_SIZE_CLASSES] = {PACKET_POOL_SMALL, MAX_PACKET_LENGTH};
+
+/* A free block's first word links it to the next one. */
+static __thread void *freeBlocks[NUM_SIZE_CLASSES];
+static __thread unsigned int numFreeBlocks[NUM_SIZE_CLASSES];
+
+Packet * PacketPool::allocate(size_t length) {
+    int sizeClass = 0;
+    while (sizeClass < NUM_SIZE_CLASSES && length > sizeClasses[sizeClass]) {
+        sizeClass++;
+    }
+    if (sizeClass == NUM_SIZE_CLASSES) {
+        /* Join responses and the like are rare and can be any size. */
+        return new Packet((unsigned char *) malloc(length), length);
+    }
+
+    void *block = freeBlocks[sizeClass];
+    if (block) {
+        freeBlocks[sizeClass] = *(void **) block;
+        numFreeBlocks[sizeClass]--;
+    } else {
+        block = malloc(sizeof(Packet) + sizeClasses[sizeClass]);
+    }
+
+    Packet *packet = new (block) Packet((unsigned char *) block + sizeof(Packet), length);
+    packet->sizeClass = sizeClass;
+    return packet;
+}
+
+void PacketPool::recycle(Packet *packet) {
+    /* The bytes live in the block, so there is nothing to destroy. */
+    int sizeClass = packet->sizeClass;
+    void *block = packet;
+    if (numFreeBlocks[sizeClass] >= PACKET_POOL_MAX_FREE) {
+        /* Threads that mostly release other threads' packets don't hoard them. */
+        free(block);
+        return;
+    }
+    *(void **) block = freeBlocks[sizeClass];
+    freeBlocks[sizeClass] = block;
+    numFreeBlocks[sizeClass]++;
+}
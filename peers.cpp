@@ -1,15 +1,13 @@
 #include "tww.h"
-#include <dirent.h>
 
 using namespace std;
 
-#define USERS_DIRECTORY "users"
-
 static bool p2pIDSort(ServerEntry *i, ServerEntry *j);
 
-Peers::Peers(std::string filename, ServerEntry *thisServer) {
+Peers::Peers(std::string filename, ServerEntry *thisServer, PlayerStore *store) {
     myPeers = new ServerEntryList();
     myServer = thisServer;
+    myStore = store;
     myFileName = filename;
     myFirstTimeRead = true;
 }
@@ -149,6 +147,19 @@ ServerEntry *Peers::findPredecessor(ServerEntry *server) {
     return findPeer(server, -1);
 }
 
+ServerEntry *Peers::ownerOf(uint32_t p2pID) {
+    struct range *range;
+    for (unsigned int i = 0; i < myPeers->size(); i++) {
+        range = &myPeers->at(i)->primaryRange;
+        /* The first server's range wraps around. */
+        if (range->low <= range->high ? (p2pID >= range->low && p2pID <= range->high) :
+                                        (p2pID >= range->low || p2pID <= range->high)) {
+            return myPeers->at(i);
+        }
+    }
+    return NULL;
+}
+
 ServerEntry *Peers::findPeer(ServerEntry *server, int incrementBy) {
     assert(myPeers->size() != 0);
     if (myPeers->size() <= 1) {
@@ -196,74 +207,16 @@ UserDataList *Peers::findUsersInRange(uint16_t min, uint16_t max) {
     debug("findUsersInRange");
     
     UserDataList *users = new UserDataList();
-    
-    struct dirent *entry;
-    DIR *dir = opendir(USERS_DIRECTORY);
-    if (!dir) {
-        debug("FAIL: can't open users directory!");
-        throw -1;
-    }
-    
-    char *userName;
-    struct p2p_user_data userData;
-    uint32_t p2pID;
-    while (entry = readdir(dir)) {
-        userName = entry->d_name;
-        if (strcmp(userName, ".") && strcmp(userName, "..")) {
-            userData = loadUser(userName);
-            p2pID = calc_p2p_id((unsigned char *) userName);
-            if ((p2pID >= min && p2pID <= max) || (min > max && p2pID >= min)) {
-                users->push_back(userData);
-                debug("chose user: %s, id: %u", userData.name, p2pID);
-            }
-        }
+    myStore->loadInRange(min, max, *users);
+    for (unsigned int i = 0; i < users->size(); i++) {
+        debug("chose user: %s, id: %u", users->at(i).name, calc_p2p_id((unsigned char *) users->at(i).name));
     }
     
-    closedir(dir);
-    
     return users;
 }
 
-bool Peers::writeUserDataToDisk(struct p2p_user_data user) {
-    string fileName = string(USERS_DIRECTORY) + string("/") + string(user.name);
-    FILE *openFile = fopen(fileName.c_str(), "w+");
-    if (!openFile) {
-        return false;
-    }
-    assert(openFile);
-    
-    char playerData[80];
-    sprintf(playerData, "%d %d %u %u\n", user.hp, user.exp, user.x, user.y);
-    fputs(playerData, openFile);
-    fclose(openFile);
-    
-    return true;
-}
-
-struct p2p_user_data Peers::loadUser(char *name) {
-    struct p2p_user_data user;
-    memset(&user, 0, sizeof(user));
-    
-    string fileName = string(USERS_DIRECTORY) + string("/") + string(name);
-    char userData[80];
-    FILE *openFile = fopen(fileName.c_str(), "r");
-    if (!openFile) {
-        debug("FAIL: cannot open user data");
-        throw -1;
-    }
-
-    unsigned int x, y;
-    if (fscanf(openFile, "%d %d %u %u", &user.hp, &user.exp, &x, &y) == EOF) {
-        debug("fscanf fails");
-        throw -1;
-    }
-    strncpy(user.name, name, MAX_LOGIN_LENGTH + 1);
-    user.x = x;
-    user.y = y;
-    
-    fclose(openFile);
-    
-    return user;
+uint64_t Peers::writeUserDataToDisk(struct p2p_user_data user) {
+    return myStore->save(&user);
 }
 
 static bool p2pIDSort(ServerEntry *i, ServerEntry *j) {
@@ -1,87 +1,69 @@
 #include "tww.h"
-#include <ctime>
-#include <sys/stat.h>
-#include <sys/types.h>
 
 using namespace std;
 
-#define USERS_DIRECTORY "users"
-
 PlayerFactory::PlayerFactory() {
-    srand(time(NULL));
-    mkdir(USERS_DIRECTORY, 0777);
+    myStore = NULL;
 }
 
-Player * PlayerFactory::newPlayerFromFile(char *playerName) {
-    FILE *openFile;
-    string fileName = string(USERS_DIRECTORY) + string("/") + string(playerName);
-    char playerData[80];
-    
-    int hp, exp, x, y = 0;
-    Player *player;
-    debug("Opening file: %s", fileName.c_str());
-
-    openFile = fopen(fileName.c_str(), "r");
+void PlayerFactory::useStore(PlayerStore *store) {
+    myStore = store;
+}
 
-    if (openFile == NULL) {
-        openFile = fopen(fileName.c_str(), "w");
-        struct location loc = randomLocation();
-        sprintf(playerData, "%d %d %u %u\n", randomHP(100, 120), 0, loc.x, loc.y);
-        fputs(playerData, openFile);
-        openFile = freopen(fileName.c_str(), "r", openFile);
+Player * PlayerFactory::newPlayerFromFile(char *playerName) {
+    struct p2p_user_data user;
+    int result = myStore->load(playerName, &user);
+    if (result == RECORD_DAMAGED) {
+        /* A fresh player saved now would replace the record for good. */
+        debug("FAIL: refusing %s, whose record is damaged", playerName);
+        return NULL;
     }
-
-    assert(openFile != NULL);
-
-    if (fscanf(openFile, "%d %d %u %u", &hp, &exp, &x, &y) == EOF) {
-        debug("fscanf fails");
-        throw -1;
+    if (result == RECORD_MISSING) {
+        struct location loc = randomLocation();
+        memset(&user, 0, sizeof(user));
+        strncpy(user.name, playerName, MAX_LOGIN_LENGTH + 1);
+        user.hp = randomHP(100, 120);
+        user.exp = 0;
+        user.x = loc.x;
+        user.y = loc.y;
+        myStore->save(&user);
     }
-    fclose(openFile);
 
-    struct location loc = {x, y};
-    player = new Player(playerName, hp, exp, loc);
+    struct location loc = {user.x, user.y};
+    Player *player = PlayerSlab::allocate(playerName, user.hp, user.exp, loc);
     debug("PlayerFactory created player: ");
     player->print();
     return player;
 }
 
-Player * PlayerFactory::newPlayer(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
+Player * PlayerFactory::newPlayer(char *playerName, int hp, int exp, coord_t x, coord_t y) {
     Player *player;
     struct location loc = {x, y};
-    player = new Player(playerName, hp, exp, loc);
+    player = PlayerSlab::allocate(playerName, hp, exp, loc);
     return player;
 }
 
 void PlayerFactory::resurrectPlayer(Player *deadPlayer) {
-    deadPlayer->myHp = randomHP(30, 50);
+    deadPlayer->setHp(randomHP(30, 50));
     debug("PlayerFactory resurrected a dead player");
 }
 
-bool PlayerFactory::savePlayer(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
-    char playerData[80];
-    sprintf(playerData, "%d %d %u %u\n", hp, exp, x, y);
-    
-    FILE *openFile;
-    string fileName = string(USERS_DIRECTORY) + string("/") + string(playerName);
-    openFile = fopen(fileName.c_str(), "w+");
-    if (!openFile) {
-        return false;
-    }
-    assert(openFile != NULL);
-    fputs(playerData, openFile);
-    fclose(openFile);
-    
-    debug("Saved player %s - wrote %s to %s", playerName, playerData, fileName.c_str());
-    
-    return true;
+uint64_t PlayerFactory::savePlayer(char *playerName, int hp, int exp, coord_t x, coord_t y) {
+    struct p2p_user_data user;
+    memset(&user, 0, sizeof(user));
+    strncpy(user.name, playerName, MAX_LOGIN_LENGTH + 1);
+    user.hp = hp;
+    user.exp = exp;
+    user.x = x;
+    user.y = y;
+    return myStore->save(&user);
 }
 
 void PlayerFactory::destroyPlayer(Player *player) {
-    delete player;
-    
     debug("PlayerFactory deleted player: ");
     player->print();
+    
+    PlayerSlab::release(player);
 }
 
 int PlayerFactory::randomHP(int low, int high) {
@@ -90,7 +72,7 @@ int PlayerFactory::randomHP(int low, int high) {
 
 struct location PlayerFactory::randomLocation() {
     struct location loc;
-    loc.x = random(0, 99);
-    loc.y = random(0, 99);
+    loc.x = random(0, DUNGEON_SIZE_X - 1);
+    loc.y = random(0, DUNGEON_SIZE_Y - 1);
     return loc;
 }
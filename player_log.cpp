@@ -0,0 +1,268 @@
+#include "tww.h"
+
+using namespace std;
+
+#define LOG_MAGIC 0x5457574cu
+
+static void * runCompactionFnc(void *log);
+
+static void makeHeader(struct log_header *header) {
+    memset(header, 0, sizeof(*header));
+    header->magic = htonl(LOG_MAGIC);
+    header->version = PLAYER_RECORD_VERSION;
+}
+
+PlayerLog::PlayerLog(const char *fileName) {
+    myFileName = string(fileName);
+    myFile = open(fileName, O_RDWR | O_CREAT, 0666);
+    if (myFile < 0) {
+        on_server_failure();
+    }
+    myCompacting = false;
+    myCompactionDone = 0;
+    myDirectoryUnsynced = false;
+
+    /* A header cut short can only be a new log torn by a crash, as nothing
+       is appended until the whole header is there. */
+    struct log_header header, expected;
+    makeHeader(&expected);
+    ssize_t length = pread(myFile, &header, sizeof(header), 0);
+    if (length < 0) {
+        on_server_failure();
+    }
+    if (memcmp(&header, &expected, length)) {
+        debug("FAIL: %s is not a player log this build can read", fileName);
+        on_server_failure();
+    }
+    if (length < (ssize_t) sizeof(header) &&
+        (pwrite(myFile, &expected, sizeof(expected), 0) != sizeof(expected) ||
+         ftruncate(myFile, sizeof(expected)) < 0 || fdatasync(myFile) < 0)) {
+        on_server_failure();
+    }
+    myEnd = sizeof(struct log_header);
+
+    /* Index every record, later ones replacing earlier ones. Each has its own
+       checksum, so a damaged one is skipped without losing those after it.
+       A crash can only tear the end: damaged records there, and any partial
+       record, go. */
+    struct player_record records[LOG_READ_RECORDS];
+    struct p2p_user_data user;
+    vector<pair<string, off_t> > damaged;
+    off_t offset = myEnd;
+    unsigned int numRecords, numDamaged = 0;
+    while ((length = pread(myFile, records, sizeof(records), offset)) > 0) {
+        numRecords = length / sizeof(struct player_record);
+        for (unsigned int i = 0; i < numRecords; i++) {
+            if (decodePlayerRecord(&records[i], &user)) {
+                myIndex[string(user.name)] = offset;
+                myEnd = offset + sizeof(struct player_record);
+            } else {
+                numDamaged++;
+                if (records[i].name[0] && memchr(records[i].name, '\0', MAX_LOGIN_LENGTH + 1)) {
+                    damaged.push_back(pair<string, off_t>(string(records[i].name), offset));
+                }
+            }
+            offset += sizeof(struct player_record);
+        }
+        if (numRecords * sizeof(struct player_record) < (size_t) length) {
+            offset += length % sizeof(struct player_record);
+            break;
+        }
+    }
+    if (numDamaged) {
+        debug("PlayerLog: skipped %u damaged records", numDamaged);
+    }
+    /* A damaged record short of the end was acknowledged once, so it, not
+       an older one, stays its player's record: read reports it damaged,
+       and compaction keeps its bytes, until a newer save replaces it. */
+    map<string, off_t>::iterator entry;
+    for (unsigned int i = 0; i < damaged.size(); i++) {
+        entry = myIndex.find(damaged[i].first);
+        if (damaged[i].second < myEnd && (entry == myIndex.end() || entry->second < damaged[i].second)) {
+            myIndex[damaged[i].first] = damaged[i].second;
+        }
+    }
+    if (offset > myEnd) {
+        debug("PlayerLog: dropping a torn end of %ld bytes", (long) (offset - myEnd));
+        if (ftruncate(myFile, myEnd) < 0) {
+            on_server_failure();
+        }
+    }
+    debug("PlayerLog: %lu players in %ld bytes", myIndex.size(), (long) myEnd);
+}
+
+int PlayerLog::read(char *name, struct p2p_user_data *user) {
+    map<string, off_t>::iterator entry = myIndex.find(string(name));
+    if (entry == myIndex.end()) {
+        return RECORD_MISSING;
+    }
+
+    struct player_record record;
+    if (pread(myFile, &record, sizeof(record), entry->second) != sizeof(record) ||
+        !decodePlayerRecord(&record, user)) {
+        debug("FAIL: the log record for %s is damaged", name);
+        return RECORD_DAMAGED;
+    }
+    return RECORD_FOUND;
+}
+
+bool PlayerLog::write(struct p2p_user_data *users, unsigned int count) {
+    vector<struct player_record> records(count);
+    for (unsigned int i = 0; i < count; i++) {
+        encodePlayerRecord(&users[i], &records[i]);
+    }
+
+    size_t length = count * sizeof(struct player_record);
+    if (pwrite(myFile, records.data(), length, myEnd) != (ssize_t) length) {
+        debug("FAIL: cannot append to %s", myFileName.c_str());
+        /* Whatever did make it is overwritten by the next append. */
+        return false;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        myIndex[string(records[i].name)] = myEnd + i * sizeof(struct player_record);
+    }
+    myEnd += length;
+    return true;
+}
+
+void PlayerLog::names(vector<string> &names) {
+    map<string, off_t>::iterator entry;
+    for (entry = myIndex.begin(); entry != myIndex.end(); entry++) {
+        names.push_back(entry->first);
+    }
+}
+
+void PlayerLog::maintain() {
+    if (myCompacting) {
+        if (__atomic_load_n(&myCompactionDone, __ATOMIC_ACQUIRE)) {
+            finishCompaction();
+        }
+        return;
+    }
+
+    off_t logBytes = myEnd - sizeof(struct log_header);
+    off_t liveBytes = myIndex.size() * sizeof(struct player_record);
+    if (logBytes < LOG_COMPACT_MIN_RECORDS * (off_t) sizeof(struct player_record) ||
+        logBytes - liveBytes < liveBytes) {
+        return;
+    }
+
+    /* The thread copies the records live right now. Appends carry on at
+       the end of the old file, and finishCompaction copies them over. */
+    string compactedName = myFileName + string(".compact");
+    myCompactedFile = open(compactedName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    struct log_header header;
+    makeHeader(&header);
+    if (myCompactedFile < 0 || pwrite(myCompactedFile, &header, sizeof(header), 0) != sizeof(header)) {
+        debug("FAIL: cannot create %s", compactedName.c_str());
+        if (myCompactedFile >= 0) {
+            close(myCompactedFile);
+        }
+        return;
+    }
+    myCompactionSources.clear();
+    map<string, off_t>::iterator entry;
+    for (entry = myIndex.begin(); entry != myIndex.end(); entry++) {
+        myCompactionSources.push_back(entry->second);
+    }
+    sort(myCompactionSources.begin(), myCompactionSources.end());
+    myCompactionStart = myEnd;
+    myCompactedIndex.clear();
+    myCompactedEnd = sizeof(struct log_header);
+    myCompactionDone = 0;
+
+    if (pthread_create(&myCompactor, NULL, runCompactionFnc, this)) {
+        close(myCompactedFile);
+        return;
+    }
+    myCompacting = true;
+    debug("PlayerLog: compacting %ld bytes down to %ld", (long) myEnd, (long) liveBytes);
+}
+
+bool PlayerLog::sync() {
+    if (myDirectoryUnsynced) {
+        if (!syncDirectoryOf(myFileName)) {
+            debug("FAIL: cannot sync the directory of %s", myFileName.c_str());
+            return false;
+        }
+        myDirectoryUnsynced = false;
+    }
+    if (fdatasync(myFile) < 0) {
+        debug("FAIL: cannot sync %s", myFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void * runCompactionFnc(void *log) {
+    ((PlayerLog *) log)->runCompaction();
+    return NULL;
+}
+
+void PlayerLog::runCompaction() {
+    struct player_record records[LOG_READ_RECORDS];
+    unsigned int numRecords = 0;
+    myCompactionFailed = false;
+    for (unsigned int i = 0; i < myCompactionSources.size() && !myCompactionFailed; i++) {
+        if (pread(myFile, &records[numRecords], sizeof(struct player_record), myCompactionSources[i]) !=
+            sizeof(struct player_record)) {
+            myCompactionFailed = true;
+            break;
+        }
+        myCompactedIndex[string(records[numRecords].name)] =
+            myCompactedEnd + numRecords * sizeof(struct player_record);
+        numRecords++;
+        if (numRecords == LOG_READ_RECORDS || i + 1 == myCompactionSources.size()) {
+            size_t length = numRecords * sizeof(struct player_record);
+            if (pwrite(myCompactedFile, records, length, myCompactedEnd) != (ssize_t) length) {
+                myCompactionFailed = true;
+            }
+            myCompactedEnd += length;
+            numRecords = 0;
+        }
+    }
+    __atomic_store_n(&myCompactionDone, 1, __ATOMIC_RELEASE);
+}
+
+void PlayerLog::finishCompaction() {
+    pthread_join(myCompactor, NULL);
+    myCompacting = false;
+    string compactedName = myFileName + string(".compact");
+
+    /* Bring over what was appended while the thread was copying. */
+    struct player_record record;
+    for (off_t offset = myCompactionStart; !myCompactionFailed && offset < myEnd;
+         offset += sizeof(record)) {
+        if (pread(myFile, &record, sizeof(record), offset) != sizeof(record) ||
+            pwrite(myCompactedFile, &record, sizeof(record), myCompactedEnd) != sizeof(record)) {
+            myCompactionFailed = true;
+            break;
+        }
+        myCompactedIndex[string(record.name)] = myCompactedEnd;
+        myCompactedEnd += sizeof(record);
+    }
+
+    /* Saves already acknowledged must not be lost to the rename, so the
+       compacted file is on disk before it, and its name after it. */
+    if (myCompactionFailed || fdatasync(myCompactedFile) < 0 ||
+        rename(compactedName.c_str(), myFileName.c_str()) < 0) {
+        debug("FAIL: compacting %s", myFileName.c_str());
+        close(myCompactedFile);
+        unlink(compactedName.c_str());
+        return;
+    }
+
+    /* From here on the name is the compacted file's, and appends must go
+       there, even if its entry is not on disk yet; sync reports failure
+       until it is. */
+    if (!syncDirectoryOf(myFileName)) {
+        debug("FAIL: compacting %s: cannot sync its directory", myFileName.c_str());
+        myDirectoryUnsynced = true;
+    }
+    close(myFile);
+    myFile = myCompactedFile;
+    myIndex.swap(myCompactedIndex);
+    myCompactedIndex.clear();
+    myEnd = myCompactedEnd;
+    debug("PlayerLog: compacted to %ld bytes", (long) myEnd);
+}
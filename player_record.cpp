@@ -0,0 +1,38 @@
+#include "tww.h"
+
+using namespace std;
+
+/* Everything after the checksum. */
+static uint32_t recordChecksum(struct player_record *record) {
+    size_t start = offsetof(struct player_record, name);
+    return calc_crc32((unsigned char *) record + start, sizeof(*record) - start);
+}
+
+void encodePlayerRecord(struct p2p_user_data *user, struct player_record *record) {
+    memset(record, 0, sizeof(*record));
+    record->magic = htons(PLAYER_RECORD_MAGIC);
+    record->version = PLAYER_RECORD_VERSION;
+    strncpy(record->name, user->name, MAX_LOGIN_LENGTH + 1);
+    record->name[MAX_LOGIN_LENGTH] = '\0';
+    record->hp = htonl(user->hp);
+    record->exp = htonl(user->exp);
+    record->x = htons(user->x);
+    record->y = htons(user->y);
+    record->checksum = htonl(recordChecksum(record));
+}
+
+bool decodePlayerRecord(struct player_record *record, struct p2p_user_data *user) {
+    if (ntohs(record->magic) != PLAYER_RECORD_MAGIC ||
+        record->version != PLAYER_RECORD_VERSION ||
+        ntohl(record->checksum) != recordChecksum(record) ||
+        !record->name[0] || memchr(record->name, '\0', MAX_LOGIN_LENGTH + 1) == NULL) {
+        return false;
+    }
+    memset(user, 0, sizeof(*user));
+    memcpy(user->name, record->name, MAX_LOGIN_LENGTH + 1);
+    user->hp = ntohl(record->hp);
+    user->exp = ntohl(record->exp);
+    user->x = ntohs(record->x);
+    user->y = ntohs(record->y);
+    return true;
+}
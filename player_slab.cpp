@@ -0,0 +1,80 @@
+#include "tww.h"
+
+using namespace std;
+
+struct slab_slot {
+    /* Holds a Player while the slot is in use. */
+    unsigned char storage[sizeof(Player)] __attribute__((aligned(8)));
+    uint32_t generation;
+    /* The next free slot, while this one is free. */
+    uint32_t nextFree;
+};
+
+#define NO_FREE_SLOT 0xffffffffu
+
+static struct slab_slot *chunks[PLAYER_SLAB_MAX_CHUNKS];
+/* lookup reads numSlots and generations without slabLock, so they are
+   written with release stores and read with acquire loads. */
+static uint32_t numSlots = 0;
+static uint32_t firstFree = NO_FREE_SLOT;
+static pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct slab_slot * slotAt(uint32_t index) {
+    return &chunks[index / PLAYER_SLAB_CHUNK_SIZE][index % PLAYER_SLAB_CHUNK_SIZE];
+}
+
+Player * PlayerSlab::allocate(char *playerName, int hp, int exp, struct location loc) {
+    pthread_mutex_lock(&slabLock);
+    uint32_t index = firstFree;
+    if (index != NO_FREE_SLOT) {
+        firstFree = slotAt(index)->nextFree;
+    } else {
+        if (numSlots == PLAYER_SLAB_CHUNK_SIZE * PLAYER_SLAB_MAX_CHUNKS) {
+            pthread_mutex_unlock(&slabLock);
+            debug("FAIL: the player slab is full");
+            throw -1;
+        }
+        if (numSlots % PLAYER_SLAB_CHUNK_SIZE == 0) {
+            chunks[numSlots / PLAYER_SLAB_CHUNK_SIZE] = 
+                (struct slab_slot *) calloc(PLAYER_SLAB_CHUNK_SIZE, sizeof(struct slab_slot));
+        }
+        index = numSlots;
+        /* Generation 0 would let a slot's first handle equal NO_PLAYER_HANDLE. */
+        __atomic_store_n(&slotAt(index)->generation, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&numSlots, index + 1, __ATOMIC_RELEASE);
+    }
+    struct slab_slot *slot = slotAt(index);
+    pthread_mutex_unlock(&slabLock);
+
+    Player *player = new (slot->storage) Player(playerName, hp, exp, loc);
+    player->myHandle = ((player_handle_t) slot->generation << 32) | index;
+    return player;
+}
+
+void PlayerSlab::release(Player *player) {
+    uint32_t index = (uint32_t) player->myHandle;
+    struct slab_slot *slot = slotAt(index);
+    player->~Player();
+
+    pthread_mutex_lock(&slabLock);
+    uint32_t generation = slot->generation + 1;
+    if (generation == 0) {
+        generation = 1;
+    }
+    __atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+    slot->nextFree = firstFree;
+    firstFree = index;
+    pthread_mutex_unlock(&slabLock);
+}
+
+Player * PlayerSlab::lookup(player_handle_t handle) {
+    uint32_t index = (uint32_t) handle;
+    if (handle == NO_PLAYER_HANDLE || index >= __atomic_load_n(&numSlots, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    struct slab_slot *slot = slotAt(index);
+    if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != (uint32_t) (handle >> 32)) {
+        return NULL;
+    }
+    return (Player *) slot->storage;
+}
@@ -0,0 +1,346 @@
+#include "tww.h"
+#include <dirent.h>
+
+using namespace std;
+
+static void * runWriterFnc(void *store);
+
+PlayerStore::PlayerStore(int format, unsigned int commitDelay) {
+    if (format == PLAYERS_TABLE) {
+        myFile = new PlayerTable(USERS_TABLE);
+    } else {
+        myFile = new PlayerLog(USERS_LOG);
+    }
+    importUserFiles();
+    myCommitDelay = commitDelay;
+    mySaved = 0;
+    myClosing = false;
+    pthread_mutex_init(&myLock, NULL);
+    pthread_mutex_init(&myFileLock, NULL);
+    pthread_cond_init(&myWork, NULL);
+
+    myCommitEvent = eventfd(0, EFD_NONBLOCK);
+    if (myCommitEvent < 0) {
+        on_server_failure();
+    }
+    if (pthread_create(&myWriter, NULL, runWriterFnc, this)) {
+        on_server_failure();
+    }
+}
+
+int PlayerStore::load(char *name, struct p2p_user_data *user) {
+    pthread_mutex_lock(&myLock);
+    map<string, struct store_record>::iterator record = myRecords.find(string(name));
+    if (record != myRecords.end()) {
+        *user = touch(string(name))->user;
+        pthread_mutex_unlock(&myLock);
+        return RECORD_FOUND;
+    }
+    pthread_mutex_unlock(&myLock);
+
+    pthread_mutex_lock(&myFileLock);
+    int result = myFile->read(name, user);
+    pthread_mutex_unlock(&myFileLock);
+    if (result != RECORD_FOUND) {
+        return result;
+    }
+
+    /* A save while the file was being read wins over what was read. */
+    pthread_mutex_lock(&myLock);
+    bool saved = myRecords.count(string(name));
+    struct store_record *cached = touch(string(name));
+    if (saved) {
+        *user = cached->user;
+    } else {
+        cached->user = *user;
+    }
+    evict();
+    pthread_mutex_unlock(&myLock);
+    return RECORD_FOUND;
+}
+
+uint64_t PlayerStore::save(struct p2p_user_data *user) {
+    pthread_mutex_lock(&myLock);
+    struct store_record *record = touch(string(user->name));
+    record->user = *user;
+    if (!record->dirty) {
+        record->dirty = true;
+        myDirtyNames.push_back(string(user->name));
+    }
+    uint64_t commit = ++mySaved;
+    evict();
+    pthread_cond_signal(&myWork);
+    pthread_mutex_unlock(&myLock);
+    return commit;
+}
+
+uint64_t PlayerStore::saveAll(UserDataList &users) {
+    pthread_mutex_lock(&myLock);
+    struct store_record *record;
+    for (unsigned int i = 0; i < users.size(); i++) {
+        record = touch(string(users[i].name));
+        record->user = users[i];
+        if (!record->dirty) {
+            record->dirty = true;
+            myDirtyNames.push_back(string(users[i].name));
+        }
+        mySaved++;
+    }
+    uint64_t commit = mySaved;
+    evict();
+    pthread_cond_signal(&myWork);
+    pthread_mutex_unlock(&myLock);
+    return commit;
+}
+
+void PlayerStore::loadInRange(uint16_t min, uint16_t max, UserDataList &users) {
+    vector<string> names;
+    pthread_mutex_lock(&myFileLock);
+    myFile->names(names);
+    pthread_mutex_unlock(&myFileLock);
+
+    /* Cached records first, as they may be newer than the file's or not
+       in it yet. The rest are read from the file without caching them. */
+    set<string> cachedNames;
+    pthread_mutex_lock(&myLock);
+    map<string, struct store_record>::iterator record;
+    for (record = myRecords.begin(); record != myRecords.end(); record++) {
+        if (inP2PRange(record->second.user.name, min, max)) {
+            users.push_back(record->second.user);
+            cachedNames.insert(record->first);
+        }
+    }
+    pthread_mutex_unlock(&myLock);
+
+    struct p2p_user_data user;
+    for (unsigned int i = 0; i < names.size(); i++) {
+        if (!inP2PRange((char *) names[i].c_str(), min, max) || cachedNames.count(names[i])) {
+            continue;
+        }
+        pthread_mutex_lock(&myFileLock);
+        int result = myFile->read((char *) names[i].c_str(), &user);
+        pthread_mutex_unlock(&myFileLock);
+        if (result == RECORD_FOUND) {
+            users.push_back(user);
+        }
+    }
+}
+
+bool PlayerStore::inP2PRange(char *name, uint16_t min, uint16_t max) {
+    uint32_t p2pID = calc_p2p_id((unsigned char *) name);
+    return (p2pID >= min && p2pID <= max) || (min > max && p2pID >= min);
+}
+
+struct store_record * PlayerStore::touch(const string &name) {
+    map<string, struct store_record>::iterator record = myRecords.find(name);
+    if (record == myRecords.end()) {
+        struct store_record created;
+        memset(&created.user, 0, sizeof(created.user));
+        created.dirty = false;
+        created.writing = false;
+        record = myRecords.insert(pair<string, struct store_record>(name, created)).first;
+        myRecent.push_front(name);
+        record->second.recent = myRecent.begin();
+    } else {
+        myRecent.splice(myRecent.begin(), myRecent, record->second.recent);
+    }
+    return &record->second;
+}
+
+void PlayerStore::evict() {
+    /* Dirty records, and those being written, have to stay. */
+    list<string>::iterator name = myRecent.end();
+    map<string, struct store_record>::iterator record;
+    while (myRecords.size() > STORE_MAX_CACHED && name != myRecent.begin()) {
+        name--;
+        record = myRecords.find(*name);
+        if (!record->second.dirty && !record->second.writing) {
+            myRecords.erase(record);
+            name = myRecent.erase(name);
+        }
+    }
+}
+
+void PlayerStore::takeResults(CommitResultList &results) {
+    pthread_mutex_lock(&myLock);
+    results.insert(results.end(), myResults.begin(), myResults.end());
+    myResults.clear();
+    pthread_mutex_unlock(&myLock);
+}
+
+int PlayerStore::commitEvent() {
+    return myCommitEvent;
+}
+
+bool PlayerStore::close() {
+    pthread_mutex_lock(&myLock);
+    myClosing = true;
+    pthread_cond_signal(&myWork);
+    pthread_mutex_unlock(&myLock);
+    pthread_join(myWriter, NULL);
+
+    pthread_mutex_lock(&myLock);
+    bool written = myDirtyNames.empty();
+    pthread_mutex_unlock(&myLock);
+    return written;
+}
+
+void PlayerStore::importUserFiles() {
+    vector<string> names;
+    myFile->names(names);
+    DIR *directory = opendir(USERS_DIRECTORY);
+    if (!names.empty() || directory == NULL) {
+        if (directory) {
+            closedir(directory);
+        }
+        return;
+    }
+
+    vector<struct p2p_user_data> users;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || length > MAX_LOGIN_LENGTH) {
+            continue;
+        }
+        string fileName = string(USERS_DIRECTORY) + string("/") + string(entry->d_name);
+        FILE *openFile = fopen(fileName.c_str(), "r");
+        if (openFile == NULL) {
+            continue;
+        }
+        int hp, exp;
+        unsigned int x, y;
+        int fields = fscanf(openFile, "%d %d %u %u", &hp, &exp, &x, &y);
+        fclose(openFile);
+        if (fields != 4) {
+            debug("PlayerStore skipping unreadable %s", fileName.c_str());
+            continue;
+        }
+
+        struct p2p_user_data user;
+        memset(&user, 0, sizeof(user));
+        memcpy(user.name, entry->d_name, length);
+        user.hp = hp;
+        user.exp = exp;
+        user.x = x;
+        user.y = y;
+        users.push_back(user);
+    }
+    closedir(directory);
+
+    if (users.empty()) {
+        return;
+    }
+    debug("PlayerStore importing %lu players from %s", users.size(), USERS_DIRECTORY);
+    if (!myFile->write(users.data(), users.size()) || !myFile->sync()) {
+        on_server_failure();
+    }
+}
+
+static void * runWriterFnc(void *store) {
+    ((PlayerStore *) store)->runWriter();
+    return NULL;
+}
+
+void PlayerStore::runWriter() {
+    vector<string> names;
+    vector<struct p2p_user_data> batch;
+    uint64_t commit;
+    struct timespec deadline;
+    bool written;
+    unsigned int attempts = 0;
+    struct commit_result result;
+
+    pthread_mutex_lock(&myLock);
+    while (true) {
+        while (myDirtyNames.empty() && !myClosing) {
+            pthread_cond_wait(&myWork, &myLock);
+        }
+        if (myDirtyNames.empty()) {
+            break;
+        }
+
+        /* Let more saves join the batch, unless plenty already have. */
+        if (myCommitDelay && !myClosing) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += myCommitDelay / 1000;
+            deadline.tv_nsec += (myCommitDelay % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (myDirtyNames.size() < STORE_MAX_DIRTY && !myClosing &&
+                   pthread_cond_timedwait(&myWork, &myLock, &deadline) == 0);
+        }
+
+        /* Records saved from here on are dirty again and wait for the next
+           batch; every save numbered up to commit is in this one. */
+        names.swap(myDirtyNames);
+        batch.clear();
+        for (unsigned int i = 0; i < names.size(); i++) {
+            struct store_record &record = myRecords.find(names[i])->second;
+            record.dirty = false;
+            record.writing = true;
+            batch.push_back(record.user);
+        }
+        commit = mySaved;
+        pthread_mutex_unlock(&myLock);
+
+        debug("PlayerStore committing %lu records", batch.size());
+        pthread_mutex_lock(&myFileLock);
+        written = myFile->write(batch.data(), batch.size()) && myFile->sync();
+        if (written) {
+            myFile->maintain();
+        }
+        pthread_mutex_unlock(&myFileLock);
+
+        pthread_mutex_lock(&myLock);
+        for (unsigned int i = 0; i < names.size(); i++) {
+            myRecords.find(names[i])->second.writing = false;
+        }
+        attempts = written ? 0 : attempts + 1;
+        if (!written && (attempts < STORE_MAX_ATTEMPTS || myClosing)) {
+            /* Try the whole batch again later, less whatever has been
+               saved since; or, when closing, leave it for close to report. */
+            for (unsigned int i = 0; i < names.size(); i++) {
+                struct store_record &record = myRecords.find(names[i])->second;
+                if (!record.dirty) {
+                    record.dirty = true;
+                    myDirtyNames.push_back(names[i]);
+                }
+            }
+            if (myClosing) {
+                break;
+            }
+            pthread_mutex_unlock(&myLock);
+            usleep(STORE_RETRY_MS * 1000);
+            pthread_mutex_lock(&myLock);
+            names.clear();
+            continue;
+        }
+        if (!written) {
+            /* The saves are reported lost, so the cache goes back to
+               what the file holds; those saved again since stay. */
+            debug("FAIL: PlayerStore giving up on %lu records", names.size());
+            map<string, struct store_record>::iterator record;
+            for (unsigned int i = 0; i < names.size(); i++) {
+                record = myRecords.find(names[i]);
+                if (!record->second.dirty) {
+                    myRecent.erase(record->second.recent);
+                    myRecords.erase(record);
+                }
+            }
+            attempts = 0;
+        }
+        evict();
+        result.through = commit;
+        result.durable = written;
+        myResults.push_back(result);
+        uint64_t one = 1;
+        if (write(myCommitEvent, &one, sizeof(one)) < 0) {
+            debug("FAIL: cannot signal a commit");
+        }
+        names.clear();
+    }
+    pthread_mutex_unlock(&myLock);
+}
@@ -0,0 +1,199 @@
+#include "tww.h"
+#include <sys/stat.h>
+
+using namespace std;
+
+#define TABLE_MAGIC 0x54575755u
+
+/* FNV-1a over the name, up to its terminator. */
+static uint32_t hashPlayerName(char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_LOGIN_LENGTH + 1 && name[i]; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+PlayerTable::PlayerTable(const char *fileName) {
+    myFileName = string(fileName);
+    myUnsynced = false;
+
+    myFile = open(fileName, O_RDWR);
+    if (myFile < 0 && errno == ENOENT) {
+        createTable();
+        myFile = open(fileName, O_RDWR);
+    }
+    if (myFile < 0) {
+        on_server_failure();
+    }
+
+    /* Mapping past the end of a short file would fault on first access. */
+    struct table_header header;
+    struct stat fileStat;
+    if (pread(myFile, &header, sizeof(header), 0) != sizeof(header) || fstat(myFile, &fileStat) < 0 ||
+        ntohl(header.magic) != TABLE_MAGIC) {
+        debug("FAIL: %s is not a player table", fileName);
+        on_server_failure();
+    }
+    myNumSlots = ntohl(header.numSlots);
+    myNumUsed = ntohl(header.numUsed);
+    if (myNumSlots == 0 || (myNumSlots & (myNumSlots - 1)) != 0 || myNumUsed > myNumSlots ||
+        (off_t) tableLength(myNumSlots) != fileStat.st_size) {
+        debug("FAIL: %s is not a whole player table", fileName);
+        on_server_failure();
+    }
+    mapTable(myNumSlots);
+    debug("PlayerTable: %u players in %u slots", myNumUsed, myNumSlots);
+}
+
+size_t PlayerTable::tableLength(uint32_t numSlots) {
+    return sizeof(struct table_header) + (size_t) numSlots * sizeof(struct player_record);
+}
+
+void PlayerTable::createTable() {
+    /* Built aside and renamed into place, so that a crash part way leaves
+       no table rather than one with no header. */
+    string newName = myFileName + string(".new");
+    int file = open(newName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (file < 0) {
+        on_server_failure();
+    }
+    makeTable(file, TABLE_INITIAL_SLOTS);
+    if (fdatasync(file) < 0 || rename(newName.c_str(), myFileName.c_str()) < 0 ||
+        !syncDirectoryOf(myFileName)) {
+        on_server_failure();
+    }
+    close(file);
+}
+
+void PlayerTable::makeTable(int file, uint32_t numSlots) {
+    /* The file starts out as zeros, which is every slot empty. */
+    if (ftruncate(file, tableLength(numSlots)) < 0) {
+        on_server_failure();
+    }
+    struct table_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = htonl(TABLE_MAGIC);
+    header.numSlots = htonl(numSlots);
+    if (pwrite(file, &header, sizeof(header), 0) != sizeof(header)) {
+        on_server_failure();
+    }
+}
+
+void PlayerTable::mapTable(uint32_t numSlots) {
+    myLength = tableLength(numSlots);
+    void *table = mmap(NULL, myLength, PROT_READ | PROT_WRITE, MAP_SHARED, myFile, 0);
+    if (table == MAP_FAILED) {
+        on_server_failure();
+    }
+    myHeader = (struct table_header *) table;
+    mySlots = (struct player_record *) (myHeader + 1);
+}
+
+struct player_record * PlayerTable::findSlot(struct player_record *slots, uint32_t numSlots, char *name) {
+    /* Linear probing; the table is never more than half full, and players
+       are never removed, so the first empty slot ends the search. */
+    uint32_t i = hashPlayerName(name) & (numSlots - 1);
+    while (slots[i].name[0] && strncmp(slots[i].name, name, MAX_LOGIN_LENGTH + 1)) {
+        i = (i + 1) & (numSlots - 1);
+    }
+    return &slots[i];
+}
+
+int PlayerTable::read(char *name, struct p2p_user_data *user) {
+    struct player_record *slot = findSlot(mySlots, myNumSlots, name);
+    if (!slot->name[0]) {
+        return RECORD_MISSING;
+    }
+    if (!decodePlayerRecord(slot, user)) {
+        debug("FAIL: the table slot for %s is damaged", name);
+        return RECORD_DAMAGED;
+    }
+    return RECORD_FOUND;
+}
+
+bool PlayerTable::write(struct p2p_user_data *users, unsigned int count) {
+    struct player_record *slot;
+    for (unsigned int i = 0; i < count; i++) {
+        if ((myNumUsed + 1) * 2 > myNumSlots && !grow()) {
+            return false;
+        }
+        slot = findSlot(mySlots, myNumSlots, users[i].name);
+        if (!slot->name[0]) {
+            myHeader->numUsed = htonl(++myNumUsed);
+        }
+        encodePlayerRecord(&users[i], slot);
+    }
+    myUnsynced = true;
+    return true;
+}
+
+bool PlayerTable::grow() {
+    /* Rehash into a new file twice the size, then swap it in. */
+    string grownName = myFileName + string(".grow");
+    int grown = open(grownName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (grown < 0) {
+        return false;
+    }
+    uint32_t numSlots = myNumSlots * 2;
+    makeTable(grown, numSlots);
+    size_t length = tableLength(numSlots);
+    void *table = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, grown, 0);
+    if (table == MAP_FAILED) {
+        close(grown);
+        return false;
+    }
+    struct table_header *header = (struct table_header *) table;
+    struct player_record *slots = (struct player_record *) (header + 1);
+    for (uint32_t i = 0; i < myNumSlots; i++) {
+        if (mySlots[i].name[0]) {
+            *findSlot(slots, numSlots, mySlots[i].name) = mySlots[i];
+        }
+    }
+    header->numUsed = htonl(myNumUsed);
+
+    /* The old table stays whole until the new one, and its name, are on
+       disk. Failing after the rename is safe too: the name holds one table
+       or the other, and each has every acknowledged save. The next write
+       grows it again. */
+    if (msync(table, length, MS_SYNC) < 0 || rename(grownName.c_str(), myFileName.c_str()) < 0 ||
+        !syncDirectoryOf(myFileName)) {
+        debug("FAIL: cannot grow %s", myFileName.c_str());
+        munmap(table, length);
+        close(grown);
+        return false;
+    }
+    munmap(myHeader, myLength);
+    close(myFile);
+    myFile = grown;
+    myHeader = header;
+    mySlots = slots;
+    myLength = length;
+    myNumSlots = numSlots;
+    debug("PlayerTable: grew to %u slots", numSlots);
+    return true;
+}
+
+void PlayerTable::names(vector<string> &names) {
+    for (uint32_t i = 0; i < myNumSlots; i++) {
+        if (mySlots[i].name[0]) {
+            names.push_back(string(mySlots[i].name));
+        }
+    }
+}
+
+void PlayerTable::maintain() {
+}
+
+bool PlayerTable::sync() {
+    if (!myUnsynced) {
+        return true;
+    }
+    if (msync(myHeader, myLength, MS_SYNC) < 0) {
+        debug("FAIL: cannot sync %s", myFileName.c_str());
+        return false;
+    }
+    myUnsynced = false;
+    return true;
+}
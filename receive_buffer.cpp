@@ -0,0 +1,81 @@
+#include "tww.h"
+
+using namespace std;
+
+ReceiveBuffer::ReceiveBuffer(size_t capacity) {
+    myCapacity = 1;
+    while (myCapacity < capacity) {
+        myCapacity <<= 1;
+    }
+    myBytes = (unsigned char *) malloc(myCapacity * 2);
+    myHead = myTail = 0;
+}
+
+ReceiveBuffer::~ReceiveBuffer() {
+    free(myBytes);
+}
+
+unsigned char * ReceiveBuffer::writeSpace(size_t *space) {
+    if (size() == myCapacity) {
+        reserve(myCapacity + 1);
+    }
+    size_t head = myHead & (myCapacity - 1);
+    size_t tail = myTail & (myCapacity - 1);
+    *space = (tail < head) ? head - tail : myCapacity - tail;
+    return myBytes + tail;
+}
+
+void ReceiveBuffer::commit(size_t length) {
+    myTail += length;
+}
+
+void ReceiveBuffer::append(unsigned char *bytes, size_t length) {
+    reserve(size() + length);
+    unsigned char *to;
+    size_t space;
+    while (length > 0) {
+        to = writeSpace(&space);
+        space = min(space, length);
+        memcpy(to, bytes, space);
+        commit(space);
+        bytes += space;
+        length -= space;
+    }
+}
+
+unsigned char * ReceiveBuffer::front(size_t length) {
+    size_t head = myHead & (myCapacity - 1);
+    if (head + length > myCapacity) {
+        /* Only the frame straddling the end of the ring pays for a copy. */
+        memcpy(myBytes + myCapacity, myBytes, head + length - myCapacity);
+    }
+    return myBytes + head;
+}
+
+void ReceiveBuffer::drop(size_t length) {
+    myHead += length;
+
+    /* Start over at the front, so the next recv gets the whole buffer. */
+    if (myHead == myTail) {
+        myHead = myTail = 0;
+    }
+}
+
+void ReceiveBuffer::reserve(size_t capacity) {
+    if (capacity <= myCapacity) {
+        return;
+    }
+    size_t newCapacity = myCapacity;
+    while (newCapacity < capacity) {
+        newCapacity <<= 1;
+    }
+    unsigned char *bytes = (unsigned char *) malloc(newCapacity * 2);
+
+    size_t length = size();
+    memcpy(bytes, front(length), length);
+    free(myBytes);
+    myBytes = bytes;
+    myCapacity = newCapacity;
+    myHead = 0;
+    myTail = length;
+}
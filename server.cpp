@@ -7,14 +7,34 @@ static bool processUDPPacketFnc(UDPPacket *packet);
 static void handleSigTerm(int param);
 
 Server server;
+/* Set by handleSigTerm, so that the loop can shut down at a safe point. */
+static volatile sig_atomic_t terminating = 0;
 
 Server::Server() {
     myListeningSocket = 0;
     myUDPSocket = 0;
+    myEpollSocket = 0;
     myTww = new TWW();
     myDungeon = new Dungeon(DUNGEON_SIZE_X, DUNGEON_SIZE_Y);
     myFactory = new PlayerFactory();
+    myStore = NULL;
     myUDPHandler = NULL;
+    mySlowConsumerPolicy = SLOW_CONSUMER_DISCONNECT;
+    myTickRate = 0;
+    myNextTick = 0;
+    myStatsInterval = 0;
+    myPlayerFormat = PLAYERS_LOG;
+    myCommitDelay = STORE_COMMIT_DELAY_MS;
+    myAutosaveInterval = AUTOSAVE_INTERVAL_S;
+    myNextAutosave = 0;
+    myShutdownDeadline = 0;
+    myFinalBatchesDue = 0;
+    myRandomSeed = 0;
+    myNextSnapshot = 0;
+    myBackend = BACKEND_EPOLL;
+#ifdef USE_IO_URING
+    myURing = NULL;
+#endif
     /* myClients has already been instantiated and put on the server object's 
     stack because in TWW.h it was declared not a pointer but an object*/
     
@@ -25,6 +45,15 @@ Server::Server() {
     myIP = 0;
     disconnectPrevSuccessor = false;
     numJoinResponses = 0;
+    
+    /* Sharding */
+    myShardID = 0;
+    myNumShards = 1;
+    myShards = NULL;
+    myDirectory = NULL;
+    myMailboxSocket = 0;
+    pthread_mutex_init(&myMailboxLock, NULL);
+    myMailbox = new ShardMessageList();
 }
 
 void Server::startServer(uint16_t tcpPort, uint16_t udpPort) {
@@ -55,6 +84,7 @@ void Server::startServer(uint16_t tcpPort, uint16_t udpPort) {
         on_server_failure();
         exit(1);
     }
+    fcntl(myListeningSocket, F_SETFL, fcntl(myListeningSocket, F_GETFL) | O_NONBLOCK);
     
     /* UDP */
     myUDPSocket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -77,11 +107,19 @@ void Server::startServer(uint16_t tcpPort, uint16_t udpPort) {
     }
     
     myUDPHandler = new UDPHandler(myUDPSocket, false, false);
+    
+    /* Every socket is registered once; epoll only reports the ones with work. */
+    makeEventLoop();
+    watchSocket(myListeningSocket);
+    watchSocket(myUDPSocket);
   
     makeMyServerEntry(tcpPort,udpPort);
 
     myServerEntry->print();
-    myPeers = new Peers(string("peers.lst"), myServerEntry);    
+    myStore = new PlayerStore(myPlayerFormat, myCommitDelay);
+    watchSocket(myStore->commitEvent());
+    myFactory->useStore(myStore);
+    myPeers = new Peers(string("peers.lst"), myServerEntry, myStore);
 
     on_server_init_success();
     
@@ -114,173 +152,202 @@ void Server::makeMyServerEntry(uint16_t tcpPort, uint16_t udpPort) {
 
 void Server::run() {
     debug("running Server");
+    if (myRandomSeed) {
+        seedRandom(myRandomSeed + myShardID);
+    }
+#ifdef USE_IO_URING
+    if (myURing) {
+        runURing();
+        return;
+    }
+#endif
 
-    unsigned char readBytes[MAX_PACKET_LENGTH];
-
-    int newClientSocket, clientSocket;
-    map<int, struct client_data>::iterator clientDataIter;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int numEvents, socket;
 
     while (true) {
-        struct timeval timeSelect;
-        timeSelect.tv_sec = 0;
-        timeSelect.tv_usec = 10000;
-    
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(myListeningSocket, &readfds);
-        FD_SET(myUDPSocket, &readfds);
-
-        /* Add all client sockets to select set. */
-        for (clientDataIter = myClients.begin(); clientDataIter != myClients.end(); clientDataIter++) {
-            FD_SET(clientDataIter->first, &readfds);
-        }
-
-        unsigned int maxSocket = max(myUDPSocket, max(myListeningSocket, maxClientSocket()));
-        int selectVal = select(maxSocket + 1, &readfds, NULL, NULL, &timeSelect);
-        if (selectVal < 0) {
+        exitIfTerminating();
+        p2pSetup();
+        
+        numEvents = epoll_wait(myEpollSocket, events, MAX_EPOLL_EVENTS, pollTimeout());
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             exit(1);
         }
 
-        if (FD_ISSET(myListeningSocket, &readfds)) {
-            debug("Listening socket heard a request!");
-
-            struct sockaddr_in client_sin;
-            int clientAddressLength = sizeof(client_sin);
-            newClientSocket = accept(myListeningSocket, (struct sockaddr *) &client_sin, 
-                                        (socklen_t *) &clientAddressLength);
-            if (newClientSocket < 0) {
+        for (int i = 0; i < numEvents; i++) {
+            socket = events[i].data.fd;
+            if (socket == myListeningSocket) {
+                debug("Listening socket heard a request!");
+                acceptClients();
+            } else if (socket == myUDPSocket) {
+                debug("UDP socket receiving");
+                receiveFromUDP();
+            } else if (socket == myMailboxSocket) {
+                processMailbox();
+            } else if (myStore && socket == myStore->commitEvent()) {
+                answerCommittedSaves();
             } else {
-                fprintf(stdout, "New connection from %s.%d. fd=%d\n", 
-                    inet_ntoa(client_sin.sin_addr), 
-                    ntohs(client_sin.sin_port),
-                    newClientSocket);
-
-                struct client_data clientData;
-                clientData.player = NO_PLAYER;
-                clientData.buffer = new vector<unsigned char>();
-                myClients.insert(pair<int, struct client_data>(newClientSocket, clientData));
+                /* An earlier event in this batch may have closed it already. */
+                if ((events[i].events & EPOLLOUT) && myClients.count(socket)) {
+                    flushClient(socket);
+                }
+                if ((events[i].events & ~EPOLLOUT) && myClients.count(socket)) {
+                    receiveFromClient(socket);
+                }
             }
         }
         
-        if (FD_ISSET(myUDPSocket, &readfds)) {
-            debug("UDP socket receiving");
+        runDueTick();
+        settleClients();
+        publishDueSnapshot();
+        autosaveIfDue();
+    }
+}
+
+void Server::acceptClients() {
+    struct sockaddr_in client_sin;
+    socklen_t clientAddressLength;
+    int newClientSocket;
+
+    while (true) {
+        clientAddressLength = sizeof(client_sin);
+        newClientSocket = accept(myListeningSocket, (struct sockaddr *) &client_sin, 
+                                    &clientAddressLength);
+        if (newClientSocket < 0) {
+            return;
+        }
+        welcomeClient(newClientSocket, &client_sin);
+    }
+}
+
+void Server::welcomeClient(int clientSocket, struct sockaddr_in *client_sin) {
+    fprintf(stdout, "New connection from %s.%d. fd=%d\n", 
+        inet_ntoa(client_sin->sin_addr), 
+        ntohs(client_sin->sin_port),
+        clientSocket);
+    
+    addClient(clientSocket);
+}
+
+void Server::receiveFromUDP() {
+    myUDPHandler->receiveAll(processUDPPacketFnc);
+}
 
-            myUDPHandler->receive(readfds, processUDPPacketFnc);
+void Server::receiveFromClient(int clientSocket) {
+    ReceiveBuffer *buffer;
+    unsigned char *writeSpace;
+    size_t space;
+    ssize_t bytesRead;
+
+    do {
+        buffer = myClients.find(clientSocket)->second.buffer;
+        writeSpace = buffer->writeSpace(&space);
+        bytesRead = recv(clientSocket, writeSpace, space, MSG_DONTWAIT);
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytesRead > 0) {
+            buffer->commit(bytesRead);
+        }
+    } while (consumeFromClient(clientSocket, bytesRead));
+}
+
+bool Server::consumeFromClient(int clientSocket, ssize_t bytesRead) {
+    int socketToClose;
+    try {
+        if (bytesRead <= 0) {
+            debug("client disconnected");
+            throw -1;
         }
         
-        p2pSetup();
+        updateGame(clientSocket);
+        if (handOffIfMoved(clientSocket)) {
+            return false;
+        }
+    } catch (int e) {
+        socketToClose = clientSocket;
+        if (disconnectPrevSuccessor) {
+            ServerEntry *newSuccessor = myPeers->findSuccessor(myServerEntry);
+            mySuccessorSocket = connectToPeer(newSuccessor->ip, newSuccessor->tcpPort, true);
+            printf("P2P: connect to suc %d. p2pfd %d \n", newSuccessor->id, mySuccessorSocket);
+            socketToClose = myPrevSuccessorSocket;
+            disconnectPrevSuccessor = false;
+        }
         
-        for (clientDataIter = myClients.begin(); clientDataIter != myClients.end();) {
-            clientSocket = clientDataIter->first;
-            if (FD_ISSET(clientSocket, &readfds)) {
-                size_t bytesRead = recv(clientSocket, readBytes, MAX_PACKET_LENGTH, 0);
-                try {
-                    if (bytesRead <= 0) {
-                        debug("client disconnected");
-                        throw -1;
-                    }
-                    
-                    updateGame(clientSocket, readBytes, bytesRead);
-                } catch (int e) {
-                    if (disconnectPrevSuccessor) {
-                        ServerEntry *newSuccessor = myPeers->findSuccessor(myServerEntry);
-                        mySuccessorSocket = connectToPeer(newSuccessor->ip, newSuccessor->tcpPort);
-                        printf("P2P: connect to suc %d. p2pfd %d \n", newSuccessor->id, mySuccessorSocket);
-                        clientSocket = myPrevSuccessorSocket;
-                        disconnectPrevSuccessor = false;
-                        if (myPrevSuccessorSocket == 0) {
-                            clientDataIter++;
-                            continue;
-                        }
-                    }
-                    
-                    FD_CLR(clientSocket, &readfds);
-                    disconnectClient(clientSocket);
-                    clientDataIter = myClients.begin();
-                    continue;
-                }
-            }
-            clientDataIter++;
+        if (socketToClose != 0) {
+            disconnectClient(socketToClose);
+        }
+        if (socketToClose == clientSocket) {
+            return false;
         }
     }
+    return true;
 }
 
-void Server::updateGame(int clientSocket, unsigned char *buffer, size_t bytesRead) {
+void Server::updateGame(int clientSocket) {
     map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
     if (clientDataIter == myClients.end()) {
         on_server_failure();
     }
 
-    PacketList *packetsParsed = myTww->parsePackets(buffer, bytesRead,
-            clientDataIter->second.buffer);
-    debug("number of packets: %u", packetsParsed->size());
-    Packet *packet;
-    bool error = false;
+    /* Each frame is handled in place before the next one is looked at. */
+    ReceiveBuffer *buffer = clientDataIter->second.buffer;
+    PacketView frame;
+    PacketView *packet = &frame;
 
-    try {
-        for (unsigned int i = 0; i < packetsParsed->size(); i++) {
-            packet = packetsParsed->at(i);
-            printf("- fd:%d received ", clientSocket);
-            packet->print();
-            switch (packet->msgType()) {
-                case LOGIN_REQUEST:
-                    debug("LOGIN");
-                    processLoginRequest(clientSocket, packet);
-                    break;
-                case MOVE:
-                    debug("MOVE");
-                    processMove(clientSocket, packet);
-                    break;
-                case ATTACK:
-                    debug("ATTACK");
-                    processAttack(clientSocket, packet);
-                    break;
-                case SPEAK:
-                    debug("SPEAK");
-                    processSpeak(clientSocket, packet);
-                    break;
-                case LOGOUT:
-                    debug("LOGOUT");
-                    processLogout(clientSocket, packet);
-                    break;
-                /* P2P MESSAGES */
-                case JOIN_REQUEST:
-                    debug("JOIN_REQUEST");
-                    processJoinRequest(clientSocket, packet);
-                    break;
-                case JOIN_RESPONSE:
-                    debug("JOIN_RESPONSE");
-                    processJoinResponse(clientSocket, packet);
-                    debug("YO BITCHES WE'VE RECEIVED %u JOIN RESPONSES", numJoinResponses);
-                    break;
-                case BKUP_REQUEST:
-                    debug("BKUP_REQUEST");
-                    processBkupRequest(clientSocket, packet);
-                    break;
-                case BKUP_RESPONSE:
-                    debug("BKUP_RESPONSE");
-                    processBkupResponse(clientSocket, packet);
-                    break;
-                default:
-                    debug("DISCONNECT");
-                    throw -1;
-            }
+    while (myTww->nextFrame(buffer, packet)) {
+        printf("- fd:%d received ", clientSocket);
+        packet->print();
+        switch (packet->msgType()) {
+            case LOGIN_REQUEST:
+                debug("LOGIN");
+                processLoginRequest(clientSocket, packet);
+                break;
+            case MOVE:
+                debug("MOVE");
+                processMove(clientSocket, packet);
+                break;
+            case ATTACK:
+                debug("ATTACK");
+                processAttack(clientSocket, packet);
+                break;
+            case SPEAK:
+                debug("SPEAK");
+                processSpeak(clientSocket, packet);
+                break;
+            case LOGOUT:
+                debug("LOGOUT");
+                processLogout(clientSocket, packet);
+                break;
+            /* P2P MESSAGES */
+            case JOIN_REQUEST:
+                debug("JOIN_REQUEST");
+                processJoinRequest(clientSocket, packet);
+                break;
+            case JOIN_RESPONSE:
+                debug("JOIN_RESPONSE");
+                processJoinResponse(clientSocket, packet);
+                debug("YO BITCHES WE'VE RECEIVED %u JOIN RESPONSES", numJoinResponses);
+                break;
+            case BKUP_REQUEST:
+                debug("BKUP_REQUEST");
+                processBkupRequest(clientSocket, packet);
+                break;
+            case BKUP_RESPONSE:
+                debug("BKUP_RESPONSE");
+                processBkupResponse(clientSocket, packet);
+                break;
+            default:
+                debug("DISCONNECT");
+                throw -1;
         }
-    } catch (int e) {
-        error = true;
-    }
-
-    for (int i = 0; i < packetsParsed->size(); i++) {
-        delete packetsParsed->at(i);
-    }
-    delete packetsParsed;
-    
-    if (error) {
-        throw -1;
     }
 }
 
-void Server::processLoginRequest(int clientSocket, Packet *packet) {
+void Server::processLoginRequest(int clientSocket, PacketView *packet) {
     if (packet->length != sizeof(tww_packet_header) + sizeof(tww_login_request)) {
         debug("processLogin: corrupt packet");
         throw -1;
@@ -296,35 +363,36 @@ void Server::processLoginRequest(int clientSocket, Packet *packet) {
     int errorCode;
     map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
 
-    if (clientDataIter->second.player) {
+    if (clientDataIter->second.player != NO_PLAYER_HANDLE) {
         /* client already logged in */
         errorCode = 1;
         sendInvalidState(clientSocket, errorCode);
-    } else if (myDungeon->findPlayer(login->name)) {
+    } else if (playerNameTaken(login->name)) {
         /* a player already logged in with the same name */
         errorCode = 1;
         sendLoginReply(clientSocket, errorCode, NULL);
     } else {
         errorCode = 0;
-        Player *player = myFactory->newPlayer(login->name, ntohl(login->hp), ntohl(login->exp), login->x, login->y);
-        clientDataIter->second.player = player;
-        myDungeon->addPlayer(player);
+        Player *player = myFactory->newPlayer(login->name, ntohl(login->hp), ntohl(login->exp), ntoh_coord(login->x), ntoh_coord(login->y));
+        clientDataIter->second.player = player->myHandle;
+        myDungeon->addPlayer(player, clientSocket);
         
         sendLoginReply(clientSocket, errorCode, player);
-        /* broadcast MOVE_NOTIFY of this new player to existing players */
-        broadcastMoveNotify(player);
-        /* for each existing player, send MOVE_NOTIFY of that player to this new player */
-        Player *otherPlayer;
-        for (clientDataIter = myClients.begin(); clientDataIter != myClients.end(); clientDataIter++) {
-            otherPlayer = clientDataIter->second.player;
-            if (otherPlayer && otherPlayer != player) {
-                sendMoveNotify(clientSocket, otherPlayer);                
-            }
-        }
+        /* broadcast VISION_ENTER of this new player to the players around it */
+        broadcastVisionEnter(player);
+        /* for each player around, send VISION_ENTER of that player to this new player */
+        introducePlayer(clientSocket, player, NULL);
+    }
+}
+
+bool Server::playerNameTaken(char *name) {
+    if (myNumShards > 1) {
+        return !myDirectory->reserve(name, myShardID);
     }
+    return myDungeon->findPlayer(name) != NULL;
 }
 
-void Server::processMove(int clientSocket, Packet *packet) {
+void Server::processMove(int clientSocket, PacketView *packet) {
     if (packet->length != sizeof(tww_packet_header) + sizeof(tww_move)) {
         debug("processMove: corrupt packet");
         throw -1;
@@ -338,18 +406,31 @@ void Server::processMove(int clientSocket, Packet *packet) {
     
     struct tww_move *move;
     move = (struct tww_move *) (packet->packet + sizeof(tww_move));
-    if (move->direction == NORTH || move->direction == SOUTH ||
-        move->direction == EAST || move->direction == WEST) {
-        myDungeon->movePlayer(player, move->direction);
-    } else {
+    if (move->direction != NORTH && move->direction != SOUTH &&
+        move->direction != EAST && move->direction != WEST) {
         debug("processMove: corrupt packet");
         throw -1;        
     }
     
-    broadcastMoveNotify(player);
+    if (myTickRate) {
+        struct pending_move pending;
+        pending.socket = clientSocket;
+        pending.player = player->myHandle;
+        pending.direction = move->direction;
+        myPendingMoves.push_back(pending);
+        return;
+    }
+    
+    struct location previous = player->myLocation;
+    myDungeon->movePlayer(player, move->direction);
+    
+    /* Those who lose sight of the player see it walk away; the player then
+       learns about whoever it walked up to. */
+    broadcastMoveNotify(player, previous);
+    introducePlayer(clientSocket, player, &previous);
 }
 
-void Server::processAttack(int clientSocket, Packet *packet) {
+void Server::processAttack(int clientSocket, PacketView *packet) {
     if (packet->length != sizeof(tww_packet_header) + sizeof(tww_attack)) {
         debug("processAttack: corrupt packet");
         throw -1;
@@ -369,6 +450,20 @@ void Server::processAttack(int clientSocket, Packet *packet) {
     }
     
     Player *victim = myDungeon->findPlayer(attack->name);
+    if (!victim && myNumShards > 1) {
+        /* The victim may be standing in another shard's strip. */
+        int shard = myDirectory->shardOf(attack->name);
+        if (shard >= 0 && shard != myShardID) {
+            struct shard_message message;
+            memset(&message, 0, sizeof(message));
+            message.type = SHARD_ATTACK;
+            message.area.from = attacker->myLocation;
+            strncpy(message.name, attacker->myName, MAX_LOGIN_LENGTH + 1);
+            strncpy(message.otherName, attack->name, MAX_LOGIN_LENGTH + 1);
+            postToShard(shard, &message);
+            return;
+        }
+    }
     if (!victim) {
         debug("processAttack: victim doesn't exist");
         return;
@@ -378,24 +473,34 @@ void Server::processAttack(int clientSocket, Packet *packet) {
         return;
     }
     
+    attacker->myExp += damagePlayer(attacker->myName, attacker->myLocation, victim);
+    attacker->myUnsaved = true;
+}
+
+int Server::damagePlayer(char *attackerName, struct location attackerLocation, Player *victim) {
     int damage = random(10, 20);
-    if (damage > victim->myHp) {
-        damage = victim->myHp;
+    int hp = victim->hp();
+    if (damage > hp) {
+        damage = hp;
     }
-    victim->myHp -= damage;
-    assert(victim->myHp >= 0);
-    attacker->myExp += damage;
-    debug("%s attacked %s. damage:%d hp:%d exp:%d", attacker->myName, victim->myName,
-       damage, victim->myHp, attacker->myExp);
-
-    broadcastAttackNotify(clientSocket, attacker->myName, victim->myName, damage, victim->myHp);
-
-    if (victim->myHp == 0) {
+    hp -= damage;
+    assert(hp >= 0);
+    victim->setHp(hp);
+    debug("%s attacked %s. damage:%d hp:%d", attackerName, victim->myName,
+       damage, hp);
+
+    struct area_of_interest area;
+    area.from = attackerLocation;
+    area.to = victim->myLocation;
+    broadcastAttackNotify(0, attackerName, victim->myName, damage, hp, area);
+
+    if (hp == 0) {
         myFactory->resurrectPlayer(victim);
     }
+    return damage;
 }
 
-void Server::processSpeak(int clientSocket, Packet *packet) {
+void Server::processSpeak(int clientSocket, PacketView *packet) {
     if (packet->length > sizeof(tww_packet_header) + MAX_MSG_LENGTH + 1) {
         debug("processSpeak: corrupt packet");
         throw -1;
@@ -416,10 +521,10 @@ void Server::processSpeak(int clientSocket, Packet *packet) {
     }
 
     debug("%s said: %s", player->myName, packetMsg);
-    broadcastSpeakNotify(player->myName, packetMsg);
+    broadcastSpeakNotify(player, packetMsg);
 }
 
-void Server::processLogout(int clientSocket, Packet *packet) {
+void Server::processLogout(int clientSocket, PacketView *packet) {
     if (packet->length != sizeof(tww_packet_header)) {
         debug("processLogout: corrupt packet");
         throw -1;
@@ -431,6 +536,9 @@ void Server::processLogout(int clientSocket, Packet *packet) {
         return;
     }
 
+    /* The client saves its own state as it logs out, and that save is the
+       one to keep. */
+    player->myUnsaved = false;
     throw -1;
 }
 
@@ -460,7 +568,7 @@ void Server::p2pSetup() {
             debug("P2PState P2P_FIND_NEW_SUCCESSOR");
             myPeers->readPeers();
             successor = myPeers->findSuccessor(myPeers->findSuccessor(myServerEntry));
-            mySuccessorSocket = successor ? connectToPeer(successor->ip, successor->tcpPort) : 0;
+            mySuccessorSocket = successor ? connectToPeer(successor->ip, successor->tcpPort, true) : 0;
             if (mySuccessorSocket == 0) {
                 debug("OH NOES cannot connect to new successor");
             }
@@ -499,10 +607,10 @@ void Server::p2pConnectToPeers() {
     } else {
         if (predecessor == successor) {
             debug("2 servers");
-            myPredecessorSocket = mySuccessorSocket = connectToPeer(predecessor->ip, predecessor->tcpPort);
+            myPredecessorSocket = mySuccessorSocket = connectToPeer(predecessor->ip, predecessor->tcpPort, true);
         } else {
-            myPredecessorSocket = connectToPeer(predecessor->ip, predecessor->tcpPort);
-            mySuccessorSocket = connectToPeer(successor->ip, successor->tcpPort);
+            myPredecessorSocket = connectToPeer(predecessor->ip, predecessor->tcpPort, true);
+            mySuccessorSocket = connectToPeer(successor->ip, successor->tcpPort, true);
         }
         printf("P2P: find predecessor %d, find successor %d \n", predecessor->id, successor->id);
         myP2PState = P2P_SEND_JOIN;
@@ -513,32 +621,33 @@ void Server::p2pConnectToPeers() {
     }
 }
 
-int Server::connectToPeer(string ip, uint16_t port) {
+int Server::connectToPeer(string ip, uint16_t port, bool wait) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         return -1;
     }
     debug("Communicating through socket %d", sock);
+    if (!wait) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    }
 
     struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = inet_addr(ip.c_str());
     sin.sin_port = htons(port);
-    if (connect(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    if (connect(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0 && (wait || errno != EINPROGRESS)) {
         debug("Failed to connect!");
+        close(sock);
         return -1;
     }
     
-    struct client_data clientData;
-    clientData.player = NO_PLAYER;
-    clientData.buffer = new vector<unsigned char>();
-    myClients.insert(pair<int, struct client_data>(sock, clientData));
+    addClient(sock);
     
     return sock;
 }
 
-void Server::processJoinRequest(int serverSocket, Packet *packet) {
+void Server::processJoinRequest(int serverSocket, PacketView *packet) {
     debug("processJoinRequest");
     if (packet->length != (sizeof(tww_packet_header) + sizeof(p2p_join_request))) {
         debug("processJoinRequest: corrupt packet");
@@ -599,7 +708,7 @@ void Server::processJoinRequest(int serverSocket, Packet *packet) {
     }
 }
 
-void Server::processJoinResponse(int serverSocket, Packet *packet) {
+void Server::processJoinResponse(int serverSocket, PacketView *packet) {
     unsigned int user_number = packet->packet[sizeof(tww_packet_header)];
     printf("P2P: recv P2P_JOIN_RESPONSE (%u users)\n", user_number);
     user_number = ntohl(user_number);
@@ -617,6 +726,8 @@ void Server::processJoinResponse(int serverSocket, Packet *packet) {
         user_data = user_data_list[i];
         user_data.hp = ntohl(user_data.hp);
         user_data.exp = ntohl(user_data.exp);
+        user_data.x = ntoh_coord(user_data.x);
+        user_data.y = ntoh_coord(user_data.y);
         myPeers->writeUserDataToDisk(user_data);
     }
     
@@ -628,7 +739,7 @@ void Server::processJoinResponse(int serverSocket, Packet *packet) {
     }
 }
 
-void Server::processBkupRequest(int serverSocket, Packet *packet) {
+void Server::processBkupRequest(int serverSocket, PacketView *packet) {
     if (packet->length != (sizeof(tww_packet_header) + sizeof(p2p_user_data))) {
         debug("processBkupRequest: corrupt packet");
         throw -1;
@@ -637,11 +748,19 @@ void Server::processBkupRequest(int serverSocket, Packet *packet) {
     bk_user_data = (struct p2p_user_data *) (packet->packet + sizeof(tww_packet_header));
     bk_user_data->hp = ntohl(bk_user_data->hp);
     bk_user_data->exp = ntohl(bk_user_data->exp);
-    bool errorcode = myPeers->writeUserDataToDisk(*bk_user_data);
-    sendP2PBackupResponse(serverSocket, errorcode);
+    bk_user_data->x = ntoh_coord(bk_user_data->x);
+    bk_user_data->y = ntoh_coord(bk_user_data->y);
+
+    /* The sender counts the save as made once answered, so the answer
+       waits until the save is on disk. */
+    struct pending_save pending;
+    memset(&pending, 0, sizeof(pending));
+    pending.socket = serverSocket;
+    pending.commit = myPeers->writeUserDataToDisk(*bk_user_data);
+    myPendingSaves.push_back(pending);
 }
 
-void Server::processBkupResponse(int serverSocket, Packet *packet) {
+void Server::processBkupResponse(int serverSocket, PacketView *packet) {
     debug("processBkupResponse");
     if (packet->length != (sizeof(tww_packet_header) + sizeof(p2p_bkup_response))) {
         debug("processBkupResponse: corrupt packet");
@@ -649,8 +768,25 @@ void Server::processBkupResponse(int serverSocket, Packet *packet) {
     }
     struct p2p_bkup_response *bkup;
     bkup = (struct p2p_bkup_response *) (packet->packet + sizeof(tww_packet_header));
-    debug("Error code returned is: %c", bkup->error_code);
+    debug("Error code returned is: %u", bkup->error_code);
 
+    /* Answers come back in the order the autosave sent its requests. */
+    map<int, UserDataQueue>::iterator inFlight = myStorageInFlight.find(serverSocket);
+    if (inFlight == myStorageInFlight.end() || inFlight->second.empty()) {
+        return;
+    }
+    UserDataQueue answered;
+    answered.push_back(inFlight->second.front());
+    inFlight->second.pop_front();
+    if (bkup->error_code != 0) {
+        debug("FAIL: storage server refused %s's save", answered.front().name);
+        for (unsigned int i = 0; i < inFlight->second.size(); i++) {
+            if (!strcmp(inFlight->second[i].name, answered.front().name)) {
+                return;
+            }
+        }
+        retryInFlight(answered);
+    }
 }
 
 void Server::sendLoginReply(int clientSocket, int errorCode, Player *player) {
@@ -658,97 +794,660 @@ void Server::sendLoginReply(int clientSocket, int errorCode, Player *player) {
     if (errorCode == 1 && !player) {
         packet = myTww->makeLoginReplyPacket(errorCode, 0, 0, 0, 0);
     } else {
-        packet = myTww->makeLoginReplyPacket(errorCode, player->myHp, player->myExp,
+        packet = myTww->makeLoginReplyPacket(errorCode, player->hp(), player->myExp,
                             player->myLocation.x, player->myLocation.y);
     }
 
     sendAll(clientSocket, packet);
-    delete packet;
+    packet->release();
 }
 
-void Server::broadcastMoveNotify(Player *player) {
-    Packet *packet = myTww->makeMoveNotifyPacket(player->myName, player->myHp,
+void Server::broadcastMoveNotify(Player *player, struct location previous) {
+    Packet *packet = myTww->makeMoveNotifyPacket(player->myName, player->hp(),
                 player->myExp, player->myLocation.x, player->myLocation.y);
-    broadcast(packet);
-    delete packet;
+    struct area_of_interest area;
+    area.from = previous;
+    area.to = player->myLocation;
+    broadcast(packet, area);
+    packet->release();
 }
 
-void Server::sendMoveNotify(int clientSocket, Player *player) {
-    Packet *packet = myTww->makeMoveNotifyPacket(player->myName, player->myHp,
+void Server::broadcastVisionEnter(Player *player) {
+    Packet *packet = myTww->makeVisionEnterPacket(player->myName, player->hp(),
                 player->myExp, player->myLocation.x, player->myLocation.y);
-    sendAll(clientSocket, packet);
-    delete packet;
+    struct area_of_interest area;
+    area.from = area.to = player->myLocation;
+    broadcast(packet, area);
+    packet->release();
 }
 
 void Server::broadcastAttackNotify(int clientSocket, char *attackerName, 
-    char *victimName, int damage, int hp) {
+    char *victimName, int damage, int hp, struct area_of_interest area) {
     debug("I'm in your broadcastAttackNotify, makin' ur packet!!");
     Packet *packet = myTww->makeAttackNotifyPacket(attackerName, victimName,
         damage, hp);
     debug("Lolz I sendAll these packets!");
-    broadcast(packet);
-    delete packet;
+    broadcast(packet, area);
+    packet->release();
 }
 
-void Server::broadcastSpeakNotify(char *playerName, char *msg) {
-    Packet *packet = myTww->makeSpeakNotifyPacket(playerName, msg);
-    broadcast(packet);
-    delete packet;
+void Server::broadcastSpeakNotify(Player *player, char *msg) {
+    Packet *packet = myTww->makeSpeakNotifyPacket(player->myName, msg);
+    struct area_of_interest area;
+    area.from = area.to = player->myLocation;
+    broadcast(packet, area);
+    packet->release();
 }
 
-void Server::broadcastLogoutNotify(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
+void Server::broadcastLogoutNotify(char *playerName, int hp, int exp, coord_t x, coord_t y) {
     Packet *packet = myTww->makeLogoutNotifyPacket(playerName, hp, exp, x, y);
-    broadcast(packet);
-    delete packet;
+    struct area_of_interest area;
+    area.from.x = area.to.x = x;
+    area.from.y = area.to.y = y;
+    broadcast(packet, area);
+    packet->release();
 }
 
 void Server::sendInvalidState(int clientSocket, int errorCode) {
     Packet *packet = myTww->makeInvalidStatePacket(errorCode);
     sendAll(clientSocket, packet);
-    delete packet;
+    packet->release();
+}
+
+void Server::broadcast(Packet *packet, struct area_of_interest area) {
+    broadcastLocally(packet, &area);
+    
+    if (myNumShards > 1) {
+        struct shard_message message;
+        memset(&message, 0, sizeof(message));
+        message.type = SHARD_BROADCAST;
+        message.area = area;
+        for (unsigned int i = 0; i < myNumShards; i++) {
+            if ((int) i != myShardID && shardCovers(i, &area)) {
+                packet->retain();
+                message.packet = packet;
+                postToShard(i, &message);
+            }
+        }
+    }
 }
 
-void Server::broadcast(Packet *packet) {
+void Server::broadcastLocally(Packet *packet, struct area_of_interest *area) {
+    if (packet->msgType() == MOVE_NOTIFY) {
+        broadcastMoveLocally(packet, area);
+        return;
+    }
+    
+    printf("- broadcasting ");
+    packet->print();
+    
+    struct bounds fromVision = myDungeon->visionOf(area->from);
+    struct bounds toVision = myDungeon->visionOf(area->to);
+    myDungeon->playersWithin(&fromVision, &toVision, myNearbyPlayers);
+    
     map<int, struct client_data>::iterator clientDataIter;
-    for (clientDataIter = myClients.begin(); clientDataIter != myClients.end(); clientDataIter++) {
-        if (clientDataIter->second.player) {
-            sendAll(clientDataIter->first, packet);            
+    for (unsigned int i = 0; i < myNearbyPlayers.size(); i++) {
+        clientDataIter = clientOfPlayerAt(myNearbyPlayers[i]);
+        if (clientDataIter != myClients.end()) {
+            enqueue(clientDataIter->first, &clientDataIter->second, packet);
         }
     }
 }
 
+void Server::broadcastMoveLocally(Packet *packet, struct area_of_interest *area) {
+    printf("- broadcasting ");
+    packet->print();
+    
+    struct bounds fromVision = myDungeon->visionOf(area->from);
+    struct bounds toVision = myDungeon->visionOf(area->to);
+    myDungeon->playersWithin(&fromVision, &toVision, myNearbyPlayers);
+    
+    /* The other two are only made if somebody needs them. */
+    struct tww_move_notify *move = (struct tww_move_notify *) (packet->packet + sizeof(tww_packet_header));
+    Packet *enter = NULL;
+    Packet *leave = NULL;
+    
+    map<int, struct client_data>::iterator clientDataIter;
+    Player *player;
+    bool sawBefore, seesNow;
+    for (unsigned int i = 0; i < myNearbyPlayers.size(); i++) {
+        clientDataIter = clientOfPlayerAt(myNearbyPlayers[i]);
+        if (clientDataIter == myClients.end()) {
+            continue;
+        }
+        player = myDungeon->playerAt(myNearbyPlayers[i]);
+        sawBefore = myDungeon->inRange(player->myLocation, area->from);
+        seesNow = myDungeon->inRange(player->myLocation, area->to);
+        if ((sawBefore && seesNow) || !strcmp(player->myName, move->name)) {
+            /* A tick's worth of moves can take the player out of its own 
+               old vision, but it never loses sight of itself. */
+            enqueue(clientDataIter->first, &clientDataIter->second, packet);
+        } else if (seesNow) {
+            if (!enter) {
+                enter = myTww->makeVisionEnterPacket(move->name, ntohl(move->hp), ntohl(move->exp),
+                    ntoh_coord(move->x), ntoh_coord(move->y));
+            }
+            enqueue(clientDataIter->first, &clientDataIter->second, enter);
+        } else {
+            if (!leave) {
+                leave = myTww->makeVisionLeavePacket(move->name);
+            }
+            enqueue(clientDataIter->first, &clientDataIter->second, leave);
+        }
+    }
+    
+    if (enter) {
+        enter->release();
+    }
+    if (leave) {
+        leave->release();
+    }
+}
+
+map<int, struct client_data>::iterator Server::clientOfPlayerAt(int index) {
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(myDungeon->ownerAt(index));
+    if (clientDataIter != myClients.end() && (clientDataIter->second.closing ||
+            clientDataIter->second.player != myDungeon->playerAt(index)->myHandle)) {
+        return myClients.end();
+    }
+    return clientDataIter;
+}
+
 void Server::sendAll(int clientSocket, Packet *packet) {
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
+    if (clientDataIter == myClients.end() || clientDataIter->second.closing) {
+        return;
+    }
+
     printf("- fd:%d sending ", clientSocket);
     packet->print();
-            
-    unsigned char *buffer = packet->packet;
-    size_t length = packet->length;
     
-    /* Courtesy Beej's Guide. */
-    size_t totalSent = 0;
-    size_t bytesleft = length;
-    size_t n;
+    enqueue(clientSocket, &clientDataIter->second, packet);
+}
+
+void Server::enqueue(int clientSocket, struct client_data *clientData, Packet *packet) {
+    /* Connections without a player (peers, clients logging in) carry the
+       replication traffic, so they always get their bytes. */
+    if (clientData->player != NO_PLAYER_HANDLE && clientData->queuedBytes + packet->length > MAX_OUTPUT_QUEUE_BYTES) {
+        /* Only bytes the kernel won't take count against the client. */
+        flushClient(clientSocket);
+        if (clientData->closing) {
+            return;
+        }
+    }
+    if (clientData->player != NO_PLAYER_HANDLE && clientData->queuedBytes + packet->length > MAX_OUTPUT_QUEUE_BYTES &&
+        !outputPending(clientSocket)) {
+        switch (mySlowConsumerPolicy) {
+            case SLOW_CONSUMER_COALESCE:
+                if (packet->msgType() == MOVE_NOTIFY) {
+                    /* Older positions of the same player are now worthless. 
+                       The front packet may be partly written, so it stays. */
+                    char *name = (char *) packet->packet + sizeof(tww_packet_header);
+                    deque<Packet *>::iterator queued = clientData->outQueue->begin();
+                    if (clientData->inFlight > 0) {
+                        queued += clientData->inFlight;
+                    } else if (clientData->sentOffset > 0) {
+                        queued++;
+                    }
+                    while (queued != clientData->outQueue->end()) {
+                        if ((*queued)->msgType() == MOVE_NOTIFY && !strncmp(name, 
+                                (char *) (*queued)->packet + sizeof(tww_packet_header), MAX_LOGIN_LENGTH + 1)) {
+                            clientData->queuedBytes -= (*queued)->length;
+                            (*queued)->release();
+                            queued = clientData->outQueue->erase(queued);
+                        } else {
+                            queued++;
+                        }
+                    }
+                }
+                if (clientData->queuedBytes + packet->length <= MAX_OUTPUT_QUEUE_BYTES) {
+                    break;
+                }
+                /* Nothing to coalesce with; fall through and drop it. */
+            case SLOW_CONSUMER_DROP:
+                debug("fd:%d is too slow, dropping packet", clientSocket);
+                return;
+            case SLOW_CONSUMER_DISCONNECT:
+            default:
+                debug("fd:%d is too slow, disconnecting", clientSocket);
+                markForClosing(clientSocket, clientData);
+                return;
+        }
+    }
+    
+    packet->retain();
+    clientData->outQueue->push_back(packet);
+    clientData->queuedBytes += packet->length;
+    if (!clientData->dirty) {
+        clientData->dirty = true;
+        myDirtySockets.push_back(clientSocket);
+    }
+}
 
-    while (totalSent < length) {
-        n = send(clientSocket, buffer + totalSent, bytesleft, 0);
-        if (n == -1) {
-            throw -1;
+void Server::flushClient(int clientSocket) {
+#ifdef USE_IO_URING
+    if (myURing) {
+        sendThroughURing(clientSocket);
+        return;
+    }
+#endif
+    struct client_data *clientData = &myClients.find(clientSocket)->second;
+    struct iovec iov[MAX_WRITEV_PACKETS];
+    struct msghdr msg;
+    ssize_t n;
+    
+    while (!clientData->outQueue->empty() && !clientData->closing) {
+        /* sendmsg rather than writev, for MSG_NOSIGNAL. */
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gatherOutput(clientData, iov);
+        n = sendmsg(clientSocket, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                markForClosing(clientSocket, clientData);
+            }
+            return;
         }
-        totalSent += n;
-        bytesleft -= n;
-        debug("SENDING!");
+        consumeOutput(clientData, n);
     }
+}
 
-    if (totalSent != length) {
-        debug("Houston, we have a problem; sendAll() is being whack");
-        throw -1;
+bool Server::outputPending(int clientSocket) {
+#ifdef USE_IO_URING
+    if (myURing) {
+        return sendPendingThroughURing(clientSocket);
+    }
+#endif
+    return false;
+}
+
+unsigned int Server::gatherOutput(struct client_data *clientData, struct iovec *iov) {
+    deque<Packet *> *outQueue = clientData->outQueue;
+    unsigned int numPackets = min((size_t) MAX_WRITEV_PACKETS, outQueue->size());
+    for (unsigned int i = 0; i < numPackets; i++) {
+        iov[i].iov_base = outQueue->at(i)->packet;
+        iov[i].iov_len = outQueue->at(i)->length;
+    }
+    iov[0].iov_base = outQueue->front()->packet + clientData->sentOffset;
+    iov[0].iov_len -= clientData->sentOffset;
+    return numPackets;
+}
+
+void Server::consumeOutput(struct client_data *clientData, size_t bytesSent) {
+    deque<Packet *> *outQueue = clientData->outQueue;
+    size_t sent = clientData->sentOffset + bytesSent;
+    Packet *packet;
+    while (!outQueue->empty() && sent >= outQueue->front()->length) {
+        packet = outQueue->front();
+        sent -= packet->length;
+        clientData->queuedBytes -= packet->length;
+        outQueue->pop_front();
+        packet->release();
+    }
+    clientData->sentOffset = sent;
+}
+
+void Server::settleClients() {
+    /* Closing a client queues its logout for the others. */
+    do {
+        closeMarkedClients();
+        flushDirtyClients();
+    } while (!myClosingSockets.empty());
+}
+
+void Server::flushDirtyClients() {
+    map<int, struct client_data>::iterator clientDataIter;
+    for (unsigned int i = 0; i < myDirtySockets.size(); i++) {
+        /* It may have been closed or handed to another shard since. */
+        clientDataIter = myClients.find(myDirtySockets[i]);
+        if (clientDataIter != myClients.end() && clientDataIter->second.dirty) {
+            clientDataIter->second.dirty = false;
+            flushClient(myDirtySockets[i]);
+        }
+    }
+    myDirtySockets.clear();
+}
+
+void Server::markForClosing(int clientSocket, struct client_data *clientData) {
+    if (!clientData->closing) {
+        clientData->closing = true;
+        myClosingSockets.push_back(clientSocket);
+    }
+}
+
+void Server::closeMarkedClients() {
+    /* Disconnecting broadcasts a logout, which may mark more clients. */
+    while (!myClosingSockets.empty()) {
+        int clientSocket = myClosingSockets.back();
+        myClosingSockets.pop_back();
+        if (myClients.count(clientSocket)) {
+            disconnectClient(clientSocket);
+        }
+    }
+}
+
+void Server::setSlowConsumerPolicy(int policy) {
+    mySlowConsumerPolicy = policy;
+}
+
+void Server::setTickRate(unsigned int ticksPerSecond) {
+    myTickRate = ticksPerSecond;
+}
+
+void Server::setBackend(int backend) {
+    myBackend = backend;
+}
+
+void Server::setStatsInterval(unsigned int seconds) {
+    myStatsInterval = seconds;
+}
+
+void Server::setRandomSeed(uint64_t seed) {
+    myRandomSeed = seed;
+}
+
+void Server::setPlayerFormat(int format) {
+    myPlayerFormat = format;
+}
+
+void Server::setCommitDelay(unsigned int milliseconds) {
+    myCommitDelay = milliseconds;
+}
+
+void Server::setAutosaveInterval(unsigned int seconds) {
+    myAutosaveInterval = seconds;
+}
+
+void Server::runDueTick() {
+    if (!myTickRate) {
+        return;
+    }
+    uint64_t now = monotonicMillis();
+    if (now < myNextTick) {
+        return;
+    }
+    
+    tick();
+    
+    /* Keep a steady rate, but don't try to make up for ticks we slept through. */
+    myNextTick += 1000 / myTickRate;
+    if (myNextTick <= now) {
+        myNextTick = now + 1000 / myTickRate;
+    }
+}
+
+void Server::publishDueSnapshot() {
+    /* The stats thread is the only reader so far. */
+    if (!myStatsInterval) {
+        return;
+    }
+    uint64_t now = monotonicMillis();
+    if (now < myNextSnapshot) {
+        return;
+    }
+    myDungeon->publishSnapshot();
+    myNextSnapshot = now + SNAPSHOT_INTERVAL_MS;
+}
+
+void Server::autosaveIfDue() {
+    if (!myAutosaveInterval) {
+        return;
+    }
+    uint64_t now = monotonicMillis();
+    if (!myNextAutosave) {
+        myNextAutosave = now + myAutosaveInterval * 1000;
+    }
+    if (now < myNextAutosave) {
+        return;
+    }
+    myNextAutosave = now + myAutosaveInterval * 1000;
+    myUnreachableStorage.clear();
+
+    UserDataList *users = new UserDataList();
+    map<string, struct p2p_user_data>::iterator retry;
+    for (retry = myDepartedRetries.begin(); retry != myDepartedRetries.end(); retry++) {
+        users->push_back(retry->second);
+    }
+    myDepartedRetries.clear();
+    myDungeon->takeUnsavedPlayers(*users);
+    debug("autosaving %lu players", users->size());
+    if (users->empty()) {
+        delete users;
+    } else {
+        persistFromShard(users);
+    }
+}
+
+void Server::persistDeparted(Player *player) {
+    UserDataList *users = new UserDataList(1);
+    struct p2p_user_data *user = &users->front();
+    memset(user, 0, sizeof(*user));
+    strncpy(user->name, player->myName, MAX_LOGIN_LENGTH + 1);
+    user->hp = player->hp();
+    user->exp = player->myExp;
+    user->x = player->myLocation.x;
+    user->y = player->myLocation.y;
+    persistFromShard(users);
+}
+
+void Server::persistFromShard(UserDataList *users) {
+    if (myShardID == 0) {
+        persistPlayers(*users);
+        delete users;
+    } else {
+        struct shard_message message;
+        memset(&message, 0, sizeof(message));
+        message.type = SHARD_AUTOSAVE;
+        message.users = users;
+        postToShard(0, &message);
+    }
+}
+
+void Server::persistPlayers(UserDataList &users) {
+    /* A retry must not land on top of these newer saves. */
+    for (unsigned int i = 0; i < users.size(); i++) {
+        myDepartedRetries.erase(string(users[i].name));
+    }
+
+    /* Until the ring is known, every player is ours. */
+    if (myP2PState != P2P_ACTIVE) {
+        saveOwnShare(users);
+        return;
+    }
+
+    /* Each server's share, so each is connected to once. */
+    map<ServerEntry *, UserDataList> batches;
+    ServerEntry *targets[2];
+    for (unsigned int i = 0; i < users.size(); i++) {
+        targets[0] = myPeers->ownerOf(calc_p2p_id((unsigned char *) users[i].name));
+        targets[1] = targets[0] ? myPeers->findSuccessor(targets[0]) : NULL;
+        if (!targets[0]) {
+            targets[0] = myServerEntry;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (targets[j] && !(j == 1 && targets[1] == targets[0])) {
+                batches[targets[j]].push_back(users[i]);
+            }
+        }
+    }
+
+    map<ServerEntry *, UserDataList>::iterator batch;
+    int socket;
+    for (batch = batches.begin(); batch != batches.end(); batch++) {
+        if (batch->first == myServerEntry) {
+            saveOwnShare(batch->second);
+        } else if ((socket = storageSocket(batch->first)) > 0) {
+            for (unsigned int i = 0; i < batch->second.size(); i++) {
+                sendP2PBackupRequest(socket, batch->second[i]);
+                myStorageInFlight[socket].push_back(batch->second[i]);
+            }
+        } else {
+            /* A retry could land after a newer save, so rather than keep
+               these, send them afresh from the players as they are then;
+               only those who left are retried as they are. */
+            debug("storage server %u unreachable, dropping %lu saves",
+                batch->first->id, batch->second.size());
+            markUnsaved(batch->second);
+        }
+    }
+}
+
+void Server::saveOwnShare(UserDataList &users) {
+    struct pending_batch pending;
+    pending.commit = myStore->saveAll(users);
+    pending.users = users;
+    myPendingBatches.push_back(pending);
+}
+
+void Server::markUnsaved(UserDataList &users) {
+    Player *player;
+    int shard;
+    for (unsigned int i = 0; i < users.size(); i++) {
+        shard = myNumShards > 1 ? myDirectory->shardOf(users[i].name) : myShardID;
+        player = shard == myShardID ? myDungeon->findPlayer(users[i].name) : NULL;
+        if (player) {
+            player->myUnsaved = true;
+        } else if (shard >= 0 && shard != myShardID) {
+            struct shard_message message;
+            memset(&message, 0, sizeof(message));
+            message.type = SHARD_UNSAVED;
+            strncpy(message.name, users[i].name, MAX_LOGIN_LENGTH + 1);
+            postToShard(shard, &message);
+        } else {
+            /* The player is gone, and this save is all that is left of it. */
+            myDepartedRetries[string(users[i].name)] = users[i];
+        }
+    }
+}
+
+void Server::retryInFlight(UserDataQueue &failed) {
+    /* The last save of each player is the one to keep. */
+    map<string, unsigned int> latest;
+    for (unsigned int i = 0; i < failed.size(); i++) {
+        latest[string(failed[i].name)] = i;
+    }
+    UserDataList users;
+    map<string, unsigned int>::iterator entry;
+    for (entry = latest.begin(); entry != latest.end(); entry++) {
+        users.push_back(failed[entry->second]);
+    }
+    debug("retrying %lu failed saves", users.size());
+    markUnsaved(users);
+}
+
+int Server::storageSocket(ServerEntry *server) {
+    map<unsigned int, int>::iterator entry = myStorageSockets.find(server->id);
+    if (entry != myStorageSockets.end()) {
+        return entry->second;
+    }
+    if (myUnreachableStorage.count(server->id)) {
+        return -1;
+    }
+    /* A host that is down must not hold up the shard for a connect timeout;
+       a connect that fails later closes the socket like any other. */
+    int socket = connectToPeer(string(server->ip), server->tcpPort, false);
+    if (socket < 0) {
+        myUnreachableStorage.insert(server->id);
+        return -1;
+    }
+    myStorageSockets[server->id] = socket;
+    return socket;
+}
+
+void Server::tick() {
+    /* Where each moved player stood when the tick started, and where its
+       moves take it, by socket. */
+    map<int, struct area_of_interest> moved;
+    map<int, struct area_of_interest>::iterator movedIter;
+    map<int, struct client_data>::iterator clientDataIter;
+    struct pending_move *pending;
+    struct area_of_interest area;
+    Player *player;
+    
+    for (unsigned int i = 0; i < myPendingMoves.size(); i++) {
+        pending = &myPendingMoves[i];
+        /* The client may have left, and its socket and slab slot been reused, since. */
+        clientDataIter = myClients.find(pending->socket);
+        player = PlayerSlab::lookup(pending->player);
+        if (!player || clientDataIter == myClients.end() || clientDataIter->second.player != pending->player ||
+            clientDataIter->second.closing) {
+            continue;
+        }
+        movedIter = moved.find(pending->socket);
+        if (movedIter == moved.end()) {
+            area.from = area.to = player->myLocation;
+            movedIter = moved.insert(pair<int, struct area_of_interest>(pending->socket, area)).first;
+        }
+        myDungeon->computeMovePlayer(movedIter->second.to, pending->direction, &movedIter->second.to);
+    }
+    myPendingMoves.clear();
+    
+    /* One player at a time, so that everybody else is still where its
+       observers last heard it was, and enter and leave events stay exact. */
+    for (movedIter = moved.begin(); movedIter != moved.end(); movedIter++) {
+        player = PlayerSlab::lookup(myClients.find(movedIter->first)->second.player);
+        myDungeon->placePlayer(player, movedIter->second.to);
+        broadcastMoveNotify(player, movedIter->second.from);
+        introducePlayer(movedIter->first, player, &movedIter->second.from);
+    }
+    for (movedIter = moved.begin(); movedIter != moved.end(); movedIter++) {
+        handOffIfMoved(movedIter->first);
     }
 }
 
 void Server::closeServer() {
+    if (myStore) {
+        myStore->close();
+    }
     close(myListeningSocket);
 }
 
+void Server::exitIfTerminating() {
+    /* Every shard sees the flag, but only shard 0 owns the store. Another
+       shard exiting first would end the process before the flush. */
+    if (!terminating || myShardID != 0) {
+        return;
+    }
+    if (!myShutdownDeadline) {
+        debug("handling SIGTERM");
+        myShutdownDeadline = monotonicMillis() + SHUTDOWN_SAVE_MS;
+        if (myAutosaveInterval) {
+            struct shard_message message;
+            memset(&message, 0, sizeof(message));
+            message.type = SHARD_FINAL_SAVE;
+            for (unsigned int i = 1; i < myNumShards; i++) {
+                postToShard(i, &message);
+            }
+            myFinalBatchesDue = myNumShards - 1;
+            
+            /* Ignore the interval; this is the last chance. */
+            myNextAutosave = 1;
+            autosaveIfDue();
+        }
+    }
+    if (!finalSaveDone() && monotonicMillis() < myShutdownDeadline) {
+        return;
+    }
+    if (!finalSaveDone()) {
+        debug("FAIL: final save unfinished after %d ms", SHUTDOWN_SAVE_MS);
+    }
+    closeServer();
+    exit(1);
+}
+
+bool Server::finalSaveDone() {
+    if (myFinalBatchesDue) {
+        return false;
+    }
+    map<int, UserDataQueue>::iterator inFlight;
+    for (inFlight = myStorageInFlight.begin(); inFlight != myStorageInFlight.end(); inFlight++) {
+        if (!inFlight->second.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool Server::processUDPPacket(UDPPacket *packet) {
     if (DEBUG) {
         struct in_addr ipSender = { ntohl(packet->ip) };
@@ -794,7 +1493,11 @@ void Server::processPlayerStateRequest(UDPPacket *packet) {
         throw -1;
     }
     
+    /* Without a response, the client gives up on logging in. */
     Player *player = myFactory->newPlayerFromFile(player_state_request->name);
+    if (!player) {
+        return;
+    }
     sendPlayerStateResponse(packet->ip, packet->port, packet->id(), player);
 }
 
@@ -816,23 +1519,31 @@ void Server::processSaveStateRequest(UDPPacket *packet) {
     
     save_state_request->hp = ntohl(save_state_request->hp);
     save_state_request->exp = ntohl(save_state_request->exp);
+    save_state_request->x = ntoh_coord(save_state_request->x);
+    save_state_request->y = ntoh_coord(save_state_request->y);
     
     if (save_state_request->hp < 0 || save_state_request->exp < 0) {
         debug("ERROR: hp and/or exp negative");
         throw -1;
     }
     
-    bool success = myFactory->savePlayer(save_state_request->name,
+    /* The response waits until the save is on disk. */
+    struct pending_save pending;
+    pending.ip = packet->ip;
+    pending.port = packet->port;
+    pending.id = packet->id();
+    pending.socket = 0;
+    pending.commit = myFactory->savePlayer(save_state_request->name,
         save_state_request->hp, save_state_request->exp, save_state_request->x, save_state_request->y);
-    sendSaveStateResponse(packet->ip, packet->port, packet->id(), success);
+    myPendingSaves.push_back(pending);
     
     if (mySuccessorSocket != 0) {
         struct p2p_user_data user;
         strncpy(user.name, save_state_request->name, MAX_LOGIN_LENGTH+1);
         user.x = save_state_request->x;
         user.y = save_state_request->y;
-        user.hp = htonl(save_state_request->hp);
-        user.exp = htonl(save_state_request->exp);
+        user.hp = save_state_request->hp;
+        user.exp = save_state_request->exp;
         sendP2PBackupRequest(mySuccessorSocket, user);        
     }
 }
@@ -840,9 +1551,9 @@ void Server::processSaveStateRequest(UDPPacket *packet) {
 void Server::sendPlayerStateResponse(uint32_t dstIP, uint16_t dstPort, uint32_t msgID, Player *player) {
     debug("sendPlayerStateResponse!");
     UDPPacket *packet = myUDPHandler->makePlayerStateResponse(dstIP, dstPort,
-        msgID, player->myName, player->myHp, player->myExp, player->myLocation.x, player->myLocation.y);
+        msgID, player->myName, player->hp(), player->myExp, player->myLocation.x, player->myLocation.y);
     myUDPHandler->send(packet);
-    delete player;
+    myFactory->destroyPlayer(player);
     delete packet;
 }
 
@@ -853,28 +1564,80 @@ void Server::sendSaveStateResponse(uint32_t dstIP, uint16_t dstPort, uint32_t ms
     delete packet;
 }
 
+void Server::answerCommittedSaves() {
+    uint64_t count;
+    if (read(myStore->commitEvent(), &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    /* Saves are numbered in the order they arrived, and batches finish
+       in that order too. */
+    CommitResultList results;
+    myStore->takeResults(results);
+    struct pending_save *pending;
+    UserDataQueue failed;
+    for (unsigned int i = 0; i < results.size(); i++) {
+        /* saveAll numbers a batch under one lock, so it is never split. */
+        while (!myPendingBatches.empty() && myPendingBatches.front().commit <= results[i].through) {
+            if (!results[i].durable) {
+                failed.insert(failed.end(), myPendingBatches.front().users.begin(),
+                    myPendingBatches.front().users.end());
+            }
+            myPendingBatches.pop_front();
+        }
+        while (!myPendingSaves.empty() && myPendingSaves.front().commit <= results[i].through) {
+            pending = &myPendingSaves.front();
+            if (pending->socket > 0) {
+                sendP2PBackupResponse(pending->socket, !results[i].durable);
+            } else if (pending->socket == 0) {
+                sendSaveStateResponse(pending->ip, pending->port, pending->id, results[i].durable);
+            }
+            myPendingSaves.pop_front();
+        }
+    }
+    if (failed.empty()) {
+        return;
+    }
+
+    /* An autosave still on its way to the disk has newer data. */
+    set<string> newer;
+    for (unsigned int i = 0; i < myPendingBatches.size(); i++) {
+        for (unsigned int j = 0; j < myPendingBatches[i].users.size(); j++) {
+            newer.insert(string(myPendingBatches[i].users[j].name));
+        }
+    }
+    UserDataQueue retries;
+    for (unsigned int i = 0; i < failed.size(); i++) {
+        if (!newer.count(string(failed[i].name))) {
+            retries.push_back(failed[i]);
+        }
+    }
+    debug("FAIL: the store gave up on %lu autosaved players", failed.size());
+    retryInFlight(retries);
+}
+
 void Server::sendP2PJoinRequest(int serverSocket) {
     Packet *packet = myTww->makeP2PJoinRequestPacket(myServerEntry->id);
     sendAll(serverSocket, packet);
-    delete packet;
+    packet->release();
 }
 
 void Server::sendP2PJoinResponse(int serverSocket, UserDataList *userDataList) {
     Packet *packet = myTww->makeP2PJoinResponsePacket(userDataList);
     sendAll(serverSocket, packet);
-    delete packet;
+    packet->release();
 }
 
 void Server::sendP2PBackupRequest(int serverSocket, struct p2p_user_data userData) {
     Packet *packet = myTww->makeP2PBackupRequest(userData);
     sendAll(serverSocket, packet);
-    delete packet;
+    packet->release();
 }
 
 void Server::sendP2PBackupResponse(int serverSocket, bool errorCode) {
     Packet *packet = myTww->makeP2PBackupResponse(errorCode ? 2 : 0);
     sendAll(serverSocket, packet);
-    delete packet;
+    packet->release();
 }
 
 void Server::disconnectClient(int clientSocket) {
@@ -883,21 +1646,56 @@ void Server::disconnectClient(int clientSocket) {
         on_server_failure();
     }
     
-    Player *disconnectingPlayer = clientDataIter->second.player;
+    Player *disconnectingPlayer = PlayerSlab::lookup(clientDataIter->second.player);
     if (disconnectingPlayer) {
         printf("broadcasting %s's logout notification\n", disconnectingPlayer->myName);
-        broadcastLogoutNotify(disconnectingPlayer->myName, disconnectingPlayer->myHp, disconnectingPlayer->myExp,
+        broadcastLogoutNotify(disconnectingPlayer->myName, disconnectingPlayer->hp(), disconnectingPlayer->myExp,
             disconnectingPlayer->myLocation.x, disconnectingPlayer->myLocation.y);
         myDungeon->removePlayer(disconnectingPlayer);
+        if (myNumShards > 1) {
+            myDirectory->remove(disconnectingPlayer->myName);
+        }
+        if (disconnectingPlayer->myUnsaved && myAutosaveInterval) {
+            persistDeparted(disconnectingPlayer);
+        }
         myFactory->destroyPlayer(disconnectingPlayer);
     }
     if (clientSocket == mySuccessorSocket) {
         myP2PState = P2P_FIND_NEW_SUCCESSOR;
     }
+    map<unsigned int, int>::iterator storage;
+    for (storage = myStorageSockets.begin(); storage != myStorageSockets.end(); storage++) {
+        if (storage->second == clientSocket) {
+            myUnreachableStorage.insert(storage->first);
+            myStorageSockets.erase(storage);
+            break;
+        }
+    }
+    map<int, UserDataQueue>::iterator inFlight = myStorageInFlight.find(clientSocket);
+    if (inFlight != myStorageInFlight.end()) {
+        retryInFlight(inFlight->second);
+        myStorageInFlight.erase(inFlight);
+    }
+    /* Its descriptor may be reused before these saves are committed. */
+    for (unsigned int i = 0; i < myPendingSaves.size(); i++) {
+        if (myPendingSaves[i].socket == clientSocket) {
+            myPendingSaves[i].socket = -1;
+        }
+    }
+
+    /* Let the leaving client see its own logout, if the socket still works. */
+    if (!clientDataIter->second.closing) {
+        flushClient(clientSocket);
+    }
     
     delete clientDataIter->second.buffer;
+    deque<Packet *> *outQueue = clientDataIter->second.outQueue;
+    for (unsigned int i = 0; i < outQueue->size(); i++) {
+        outQueue->at(i)->release();
+    }
+    delete outQueue;
+    unwatchSocket(clientSocket);
     myClients.erase(clientDataIter);
-    
     close(clientSocket);
 
     printf("* Socket closed. fd=%d \n", clientSocket);
@@ -908,26 +1706,93 @@ Player * Server::playerOfSocket(int clientSocket) {
     if (clientDataIter == myClients.end()) {
         on_server_failure();
     }
-    return clientDataIter->second.player;
+    return PlayerSlab::lookup(clientDataIter->second.player);
+}
+
+void Server::addClient(int clientSocket) {
+    struct client_data clientData;
+    clientData.player = NO_PLAYER_HANDLE;
+    clientData.buffer = new ReceiveBuffer(RECEIVE_BUFFER_SIZE);
+    clientData.outQueue = new deque<Packet *>();
+    clientData.queuedBytes = 0;
+    clientData.sentOffset = 0;
+    clientData.dirty = false;
+    clientData.inFlight = 0;
+    clientData.closing = false;
+    myClients.insert(pair<int, struct client_data>(clientSocket, clientData));
+    
+    fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) | O_NONBLOCK);
+    watchSocket(clientSocket);
 }
 
-int Server::maxClientSocket() {
-    int socket = 0;
-    map<int, struct client_data>::iterator client;
-    for (client = myClients.begin(); client != myClients.end(); client++) {
-        socket = max(socket, (*client).first);
+void Server::watchSocket(int socket) {
+#ifdef USE_IO_URING
+    if (myURing) {
+        watchThroughURing(socket);
+        return;
     }
-    return socket;
+#endif
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    /* Only client and peer streams are written through output queues; the
+       listening and UDP sockets and the eventfds just need draining. */
+    event.events = myClients.count(socket) ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET;
+    event.data.fd = socket;
+    if (epoll_ctl(myEpollSocket, EPOLL_CTL_ADD, socket, &event) < 0) {
+        on_server_failure();
+    }
+}
+
+void Server::unwatchSocket(int socket) {
+#ifdef USE_IO_URING
+    if (myURing) {
+        unwatchThroughURing(socket);
+        return;
+    }
+#endif
+    epoll_ctl(myEpollSocket, EPOLL_CTL_DEL, socket, NULL);
+}
+
+int Server::pollTimeout() {
+    /* p2pSetup still has a step to take; come straight back to it. */
+    if (myP2PState != P2P_ACTIVE && myP2PState != P2P_RECEIVE_JOIN) {
+        return 0;
+    }
+    uint64_t now = monotonicMillis();
+    int timeout = -1;
+    if (myTickRate) {
+        timeout = myNextTick > now ? (int) (myNextTick - now) : 0;
+    }
+    if (myStatsInterval) {
+        int untilSnapshot = myNextSnapshot > now ? (int) (myNextSnapshot - now) : 0;
+        if (timeout < 0 || untilSnapshot < timeout) {
+            timeout = untilSnapshot;
+        }
+    }
+    if (myAutosaveInterval && myNextAutosave) {
+        int untilAutosave = myNextAutosave > now ? (int) (myNextAutosave - now) : 0;
+        if (timeout < 0 || untilAutosave < timeout) {
+            timeout = untilAutosave;
+        }
+    }
+    if (myShutdownDeadline) {
+        int untilShutdown = myShutdownDeadline > now ? (int) (myShutdownDeadline - now) : 0;
+        if (timeout < 0 || untilShutdown < timeout) {
+            timeout = untilShutdown;
+        }
+    }
+    return timeout;
 }
 
 void handleSigTerm(int param) {
-    debug("handling SIGTERM");
-    exit(1);
+    terminating = 1;
 }
 
 int main(int argc, char **argv) {
     uint16_t tcpPort = 0;
     uint16_t udpPort = 0;
+    unsigned int numShards = 1;
+    unsigned int tickRate = 0;
 
     /* If no arguments, we assume defaults. */
     if (argc == 1) {
@@ -944,6 +1809,64 @@ int main(int argc, char **argv) {
         } else if (opt == "-u") {
             udpPort = atoi(argv[i+1]);
             i += 2;
+        } else if (opt == "-w") {
+            numShards = atoi(argv[i+1]);
+            i += 2;
+        } else if (opt == "-r") {
+            tickRate = atoi(argv[i+1]);
+            i += 2;
+        } else if (opt == "-b") {
+            string backend = argv[i+1];
+            if (backend == "epoll") {
+                server.setBackend(BACKEND_EPOLL);
+            } else if (backend == "uring") {
+#ifdef USE_IO_URING
+                server.setBackend(BACKEND_URING);
+#else
+                fprintf(stdout, "! This server was built without io_uring (make URING=1).\n");
+                exit(1);
+#endif
+            } else {
+                fprintf(stdout, "! The network backend must be epoll or uring.\n");
+                exit(1);
+            }
+            i += 2;
+        } else if (opt == "-q") {
+            string policy = argv[i+1];
+            if (policy == "drop") {
+                server.setSlowConsumerPolicy(SLOW_CONSUMER_DROP);
+            } else if (policy == "coalesce") {
+                server.setSlowConsumerPolicy(SLOW_CONSUMER_COALESCE);
+            } else if (policy == "disconnect") {
+                server.setSlowConsumerPolicy(SLOW_CONSUMER_DISCONNECT);
+            } else {
+                fprintf(stdout, "! Slow consumer policy must be drop, coalesce or disconnect.\n");
+                exit(1);
+            }
+            i += 2;
+        } else if (opt == "-s") {
+            server.setStatsInterval(atoi(argv[i+1]));
+            i += 2;
+        } else if (opt == "-d") {
+            server.setRandomSeed(strtoull(argv[i+1], NULL, 10));
+            i += 2;
+        } else if (opt == "-p") {
+            string format = argv[i+1];
+            if (format == "log") {
+                server.setPlayerFormat(PLAYERS_LOG);
+            } else if (format == "table") {
+                server.setPlayerFormat(PLAYERS_TABLE);
+            } else {
+                fprintf(stdout, "! The player store must be log or table.\n");
+                exit(1);
+            }
+            i += 2;
+        } else if (opt == "-y") {
+            server.setCommitDelay(atoi(argv[i+1]));
+            i += 2;
+        } else if (opt == "-a") {
+            server.setAutosaveInterval(atoi(argv[i+1]));
+            i += 2;
         } else {
             i++;
         }
@@ -953,11 +1876,32 @@ int main(int argc, char **argv) {
         on_server_invalid_port();
         exit(1);
     }
+    if (numShards < 1 || numShards > MAX_NUM_SHARDS) {
+        fprintf(stdout, "! The number of worker shards must be between 1 and %d.\n", MAX_NUM_SHARDS);
+        exit(1);
+    }
+    if (tickRate > MAX_TICK_RATE) {
+        fprintf(stdout, "! The tick rate must be between 0 (off) and %d per second.\n", MAX_TICK_RATE);
+        exit(1);
+    }
+    server.setTickRate(tickRate);
     
     signal(SIGTERM, handleSigTerm);
+    
+    /* Only this thread, which runs shard 0 and the store, takes SIGTERM,
+       so that it always wakes up to write out unsaved players. */
+    sigset_t terminate;
+    sigemptyset(&terminate);
+    sigaddset(&terminate, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &terminate, NULL);
 
     try {
         server.startServer(tcpPort, udpPort);
+        if (numShards > 1) {
+            server.startShards(numShards);
+        }
+        server.startStats();
+        pthread_sigmask(SIG_UNBLOCK, &terminate, NULL);
         server.run();
         server.closeServer();
     } catch (int e) {
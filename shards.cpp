@@ -0,0 +1,359 @@
+#include "tww.h"
+
+using namespace std;
+
+static void * runShardFnc(void *shard);
+
+/****** PlayerDirectory ******/
+
+PlayerDirectory::PlayerDirectory() {
+    pthread_mutex_init(&myLock, NULL);
+}
+
+bool PlayerDirectory::reserve(char *name, int shard) {
+    pthread_mutex_lock(&myLock);
+    bool reserved = myShards.insert(pair<string, int>(string(name), shard)).second;
+    pthread_mutex_unlock(&myLock);
+    return reserved;
+}
+
+void PlayerDirectory::update(char *name, int shard) {
+    pthread_mutex_lock(&myLock);
+    myShards[string(name)] = shard;
+    pthread_mutex_unlock(&myLock);
+}
+
+void PlayerDirectory::remove(char *name) {
+    pthread_mutex_lock(&myLock);
+    myShards.erase(string(name));
+    pthread_mutex_unlock(&myLock);
+}
+
+int PlayerDirectory::shardOf(char *name) {
+    int shard = -1;
+    pthread_mutex_lock(&myLock);
+    map<string, int>::iterator entry = myShards.find(string(name));
+    if (entry != myShards.end()) {
+        shard = entry->second;
+    }
+    pthread_mutex_unlock(&myLock);
+    return shard;
+}
+
+/****** Server sharding ******/
+
+void Server::startShards(unsigned int numShards) {
+    debug("starting %u shards", numShards);
+
+    myNumShards = numShards;
+    myShards = new Server*[numShards];
+    myShards[0] = this;
+    myDirectory = new PlayerDirectory();
+
+    /* Every mailbox has to exist before any shard can post to another. */
+    for (unsigned int i = 1; i < numShards; i++) {
+        myShards[i] = new Server();
+        myShards[i]->startShard(this, i);
+    }
+
+    pthread_t thread;
+    for (unsigned int i = 1; i < numShards; i++) {
+        if (pthread_create(&thread, NULL, runShardFnc, myShards[i])) {
+            on_server_failure();
+        }
+        pthread_detach(thread);
+    }
+}
+
+void Server::startShard(Server *primary, int shardID) {
+    myShardID = shardID;
+    myNumShards = primary->myNumShards;
+    myShards = primary->myShards;
+    myDirectory = primary->myDirectory;
+    mySlowConsumerPolicy = primary->mySlowConsumerPolicy;
+    myTickRate = primary->myTickRate;
+    myStatsInterval = primary->myStatsInterval;
+    myRandomSeed = primary->myRandomSeed;
+    myAutosaveInterval = primary->myAutosaveInterval;
+    myBackend = primary->myBackend;
+
+    /* Storage and P2P traffic stay with shard 0. */
+    myListeningSocket = myUDPSocket = -1;
+    myP2PState = P2P_ACTIVE;
+
+    makeEventLoop();
+}
+
+static void * runShardFnc(void *shard) {
+    try {
+        ((Server *) shard)->run();
+    } catch (int e) {
+        exit(1);
+    }
+    return NULL;
+}
+
+void Server::makeEventLoop() {
+#ifdef USE_IO_URING
+    if (myBackend == BACKEND_URING) {
+        makeURing();
+    } else
+#endif
+    {
+        myEpollSocket = epoll_create1(0);
+        if (myEpollSocket < 0) {
+            on_server_failure();
+        }
+    }
+
+    myMailboxSocket = eventfd(0, EFD_NONBLOCK);
+    if (myMailboxSocket < 0) {
+        on_server_failure();
+    }
+    watchSocket(myMailboxSocket);
+}
+
+void Server::postToShard(int shard, struct shard_message *message) {
+    Server *target = myShards[shard];
+
+    pthread_mutex_lock(&target->myMailboxLock);
+    target->myMailbox->push_back(*message);
+    pthread_mutex_unlock(&target->myMailboxLock);
+
+    uint64_t one = 1;
+    if (write(target->myMailboxSocket, &one, sizeof(one)) < 0) {
+        debug("postToShard: cannot wake shard %d", shard);
+    }
+}
+
+void Server::processMailbox() {
+    /* Reset the counter before taking the messages, so a post racing with
+       us always leaves another wakeup behind. */
+    uint64_t count;
+    if (read(myMailboxSocket, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&myMailboxLock);
+    ShardMessageList *messages = myMailbox;
+    myMailbox = new ShardMessageList();
+    pthread_mutex_unlock(&myMailboxLock);
+
+    struct shard_message *message;
+    Player *player;
+    for (unsigned int i = 0; i < messages->size(); i++) {
+        message = &messages->at(i);
+        switch (message->type) {
+            case SHARD_HANDOFF:
+                debug("SHARD_HANDOFF fd:%d", message->socket);
+                adoptClient(message->socket, message->clientData);
+                break;
+            case SHARD_BROADCAST:
+                broadcastLocally(message->packet, &message->area);
+                message->packet->release();
+                break;
+            case SHARD_SEND:
+                sendToPlayer(message->socket, message->name, message->packet);
+                break;
+            case SHARD_ROSTER_REQUEST:
+                sendRoster(message->socket, message->name, message->area.to, NULL);
+                break;
+            case SHARD_ENTER_REQUEST:
+                sendRoster(message->socket, message->name, message->area.to, &message->area.from);
+                break;
+            case SHARD_ATTACK:
+                player = myDungeon->findPlayer(message->otherName);
+                if (player) {
+                    struct shard_message credit;
+                    memset(&credit, 0, sizeof(credit));
+                    credit.type = SHARD_CREDIT_EXP;
+                    strncpy(credit.name, message->name, MAX_LOGIN_LENGTH + 1);
+                    credit.amount = damagePlayer(message->name, message->area.from, player);
+
+                    int attackerShard = myDirectory->shardOf(message->name);
+                    if (attackerShard >= 0) {
+                        postToShard(attackerShard, &credit);
+                    }
+                }
+                break;
+            case SHARD_CREDIT_EXP:
+                player = myDungeon->findPlayer(message->name);
+                if (player) {
+                    player->myExp += message->amount;
+                    player->myUnsaved = true;
+                }
+                break;
+            case SHARD_AUTOSAVE:
+                persistPlayers(*message->users);
+                delete message->users;
+                break;
+            case SHARD_UNSAVED:
+                player = myDungeon->findPlayer(message->name);
+                if (player) {
+                    player->myUnsaved = true;
+                }
+                break;
+            case SHARD_FINAL_SAVE:
+                /* Answer even with nobody to save, so shard 0 stops waiting. */
+                message->type = SHARD_FINAL_BATCH;
+                message->users = new UserDataList();
+                myDungeon->takeUnsavedPlayers(*message->users);
+                postToShard(0, message);
+                break;
+            case SHARD_FINAL_BATCH:
+                persistPlayers(*message->users);
+                delete message->users;
+                myFinalBatchesDue--;
+                break;
+            default:
+                debug("FAIL: invalid shard message %d", message->type);
+        }
+    }
+    delete messages;
+}
+
+int Server::shardOfLocation(struct location loc) {
+    unsigned int shard = loc.x * myNumShards / DUNGEON_SIZE_X;
+    return min(shard, myNumShards - 1);
+}
+
+bool Server::shardCovers(int shard, struct area_of_interest *area) {
+    struct location sources[2] = {area->from, area->to};
+    struct location low, high;
+    for (int i = 0; i < 2; i++) {
+        low = high = sources[i];
+        low.x = max(sources[i].x - VISION_RANGE, 0);
+        high.x = min(sources[i].x + VISION_RANGE, DUNGEON_SIZE_X - 1);
+        if (shard >= shardOfLocation(low) && shard <= shardOfLocation(high)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Server::handOffIfMoved(int clientSocket) {
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
+    if (myNumShards <= 1 || clientDataIter == myClients.end() ||
+        clientDataIter->second.player == NO_PLAYER_HANDLE || clientDataIter->second.closing) {
+        return false;
+    }
+
+    int shard = shardOfLocation(PlayerSlab::lookup(clientDataIter->second.player)->myLocation);
+    if (shard == myShardID) {
+        return false;
+    }
+#ifdef USE_IO_URING
+    if (myURing) {
+        /* Completions already posted for the client still get handled here. */
+        leaveURing(clientSocket);
+        return false;
+    }
+#endif
+    handOff(clientSocket, shard);
+    return true;
+}
+
+void Server::handOff(int clientSocket, int shard) {
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
+    Player *player = PlayerSlab::lookup(clientDataIter->second.player);
+    debug("handing %s off to shard %d", player->myName, shard);
+    myDungeon->removePlayer(player);
+    unwatchSocket(clientSocket);
+
+    struct shard_message message;
+    memset(&message, 0, sizeof(message));
+    message.type = SHARD_HANDOFF;
+    message.socket = clientSocket;
+    message.clientData = clientDataIter->second;
+    myClients.erase(clientDataIter);
+
+    /* Post before updating the directory: anything routed to the new shard
+       by name then queues up behind the handoff itself. */
+    postToShard(shard, &message);
+    myDirectory->update(player->myName, shard);
+}
+
+void Server::adoptClient(int clientSocket, struct client_data clientData) {
+    /* Whatever is still queued goes out once the socket is writable. */
+    clientData.dirty = false;
+    myClients.insert(pair<int, struct client_data>(clientSocket, clientData));
+    myDungeon->addPlayer(PlayerSlab::lookup(clientData.player), clientSocket);
+
+    /* Registering reports whatever arrived while the client was in transit. */
+    watchSocket(clientSocket);
+}
+
+void Server::sendToPlayer(int clientSocket, char *playerName, Packet *packet) {
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(clientSocket);
+    Player *player = clientDataIter != myClients.end() ? PlayerSlab::lookup(clientDataIter->second.player) : NULL;
+    if (player && !strcmp(player->myName, playerName)) {
+        sendAll(clientSocket, packet);
+        packet->release();
+        return;
+    }
+
+    /* The player moved on before this reached us; chase it. One that is 
+       ours but not here yet is still in our mailbox, so what we post to 
+       ourselves gets handled after it arrives. */
+    int shard = myDirectory->shardOf(playerName);
+    if (shard < 0 || (shard == myShardID && myDungeon->findPlayer(playerName))) {
+        packet->release();
+        return;
+    }
+
+    struct shard_message message;
+    memset(&message, 0, sizeof(message));
+    message.type = SHARD_SEND;
+    message.socket = clientSocket;
+    message.packet = packet;
+    strncpy(message.name, playerName, MAX_LOGIN_LENGTH + 1);
+    postToShard(shard, &message);
+}
+
+void Server::introducePlayer(int clientSocket, Player *player, struct location *previous) {
+    sendRoster(clientSocket, player->myName, player->myLocation, previous);
+    if (myNumShards <= 1) {
+        return;
+    }
+
+    struct shard_message message;
+    memset(&message, 0, sizeof(message));
+    message.type = previous ? SHARD_ENTER_REQUEST : SHARD_ROSTER_REQUEST;
+    message.socket = clientSocket;
+    message.area.to = player->myLocation;
+    if (previous) {
+        message.area.from = *previous;
+    }
+    strncpy(message.name, player->myName, MAX_LOGIN_LENGTH + 1);
+
+    /* Shards around previous hold the players it has to lose sight of. */
+    struct area_of_interest area;
+    area.from = previous ? *previous : player->myLocation;
+    area.to = player->myLocation;
+    for (unsigned int i = 0; i < myNumShards; i++) {
+        if ((int) i != myShardID && shardCovers(i, &area)) {
+            postToShard(i, &message);
+        }
+    }
+}
+
+void Server::sendRoster(int clientSocket, char *playerName, struct location loc, 
+    struct location *previous) {
+    struct bounds vision = myDungeon->visionOf(loc);
+    struct bounds previousVision = previous ? myDungeon->visionOf(*previous) : vision;
+    myDungeon->playersWithin(&vision, &previousVision, myNearbyPlayers);
+    
+    Player *player;
+    for (unsigned int i = 0; i < myNearbyPlayers.size(); i++) {
+        player = myDungeon->playerAt(myNearbyPlayers[i]);
+        if (!strcmp(player->myName, playerName)) {
+            continue;
+        }
+        if (!myDungeon->inRange(loc, player->myLocation)) {
+            sendToPlayer(clientSocket, playerName, myTww->makeVisionLeavePacket(player->myName));
+        } else if (!previous || !myDungeon->inRange(*previous, player->myLocation)) {
+            sendToPlayer(clientSocket, playerName, myTww->makeVisionEnterPacket(player->myName,
+                player->hp(), player->myExp, player->myLocation.x, player->myLocation.y));
+        }
+    }
+}
@@ -0,0 +1,200 @@
+#include "tww.h"
+
+using namespace std;
+
+/****** DungeonSnapshot ******/
+
+DungeonSnapshot::DungeonSnapshot(unsigned int gridWidth, unsigned int gridHeight) {
+    myGridWidth = gridWidth;
+    myGridHeight = gridHeight;
+    myRetiredAt = 0;
+}
+
+/* The grid row or column holding a coordinate, the way the Dungeon counts them. */
+static unsigned int gridLineOf(int coordinate, unsigned int gridLines) {
+    return min((unsigned int) max(coordinate, 0) / GRID_CELL_SIZE, gridLines - 1);
+}
+
+static bool cellKeyOrder(const struct snapshot_cell &cell, const struct snapshot_cell &other) {
+    return cell.key < other.key;
+}
+
+static bool cellKeyBefore(const struct snapshot_cell &cell, unsigned int key) {
+    return cell.key < key;
+}
+
+void DungeonSnapshot::playersWithin(struct bounds *area, vector<int> &found) {
+    found.clear();
+    if (myCells.empty()) {
+        return;
+    }
+
+    unsigned int left = gridLineOf(area->minX, myGridWidth);
+    unsigned int right = gridLineOf(area->maxX, myGridWidth);
+    unsigned int top = gridLineOf(area->minY, myGridHeight);
+    unsigned int bottom = gridLineOf(area->maxY, myGridHeight);
+    vector<struct snapshot_cell>::iterator cell;
+    struct snapshot_player *player;
+    for (unsigned int row = top; row <= bottom; row++) {
+        /* The row's cells under area are next to each other. */
+        cell = lower_bound(myCells.begin(), myCells.end(), row * myGridWidth + left, cellKeyBefore);
+        for (; cell != myCells.end() && cell->key <= row * myGridWidth + right; cell++) {
+            for (unsigned int i = cell->first; i < cell->first + cell->count; i++) {
+                player = &myPlayers[i];
+                if (player->location.x >= area->minX && player->location.x <= area->maxX &&
+                    player->location.y >= area->minY && player->location.y <= area->maxY) {
+                    found.push_back(i);
+                }
+            }
+        }
+    }
+}
+
+/****** Dungeon snapshots ******/
+
+void Dungeon::publishSnapshot() {
+    DungeonSnapshot *snapshot = new DungeonSnapshot(myGridWidth, myGridHeight);
+    snapshot->myPlayers.reserve(myPlayers->size());
+
+    struct grid_cell *cell;
+    struct snapshot_cell entry;
+    struct snapshot_player copy;
+    Player *player;
+    unsigned int remaining;
+    uint64_t now = monotonicMillis();
+    memset(&copy, 0, sizeof(copy));
+    /* Chunk by chunk, which keeps the walk in memory the Dungeon already
+       has to touch; the cells get put in key order afterwards. */
+    for (unsigned int chunk = 0; chunk < myChunksWide * myChunksHigh; chunk++) {
+        if (!myChunks[chunk]) {
+            continue;
+        }
+        /* Stop once everybody in the chunk has been seen. */
+        remaining = myChunks[chunk]->numPlayers;
+        for (unsigned int slot = 0; remaining > 0; slot++) {
+            cell = myChunks[chunk]->cells[slot];
+            if (!cell) {
+                continue;
+            }
+            entry.key = ((chunk / myChunksWide) * GRID_CHUNK_SIZE + slot / GRID_CHUNK_SIZE) * myGridWidth +
+                (chunk % myChunksWide) * GRID_CHUNK_SIZE + slot % GRID_CHUNK_SIZE;
+            entry.first = snapshot->myPlayers.size();
+            entry.count = cell->players.size();
+            snapshot->myCells.push_back(entry);
+            remaining -= entry.count;
+            for (unsigned int i = 0; i < entry.count; i++) {
+                player = cell->players[i];
+                strncpy(copy.name, player->myName, MAX_LOGIN_LENGTH + 1);
+                copy.hp = player->hpAt(now);
+                copy.exp = player->myExp;
+                copy.location = player->myLocation;
+                copy.owner = myOwners[cell->indexes[i]];
+                snapshot->myPlayers.push_back(copy);
+            }
+        }
+    }
+    sort(snapshot->myCells.begin(), snapshot->myCells.end(), cellKeyOrder);
+
+    /* A reader that saw the new epoch also sees the new snapshot, so only
+       readers still in an older epoch can hold the old one. */
+    DungeonSnapshot *old = __atomic_exchange_n(&mySnapshot, snapshot, __ATOMIC_SEQ_CST);
+    uint64_t epoch = myEpoch + 1;
+    __atomic_store_n(&myEpoch, epoch, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->myRetiredAt = epoch;
+        myRetiredSnapshots.push_back(old);
+    }
+
+    uint64_t oldest = epoch;
+    uint64_t readerEpoch;
+    int numReaders = __atomic_load_n(&myNumReaders, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < numReaders; i++) {
+        readerEpoch = __atomic_load_n(&myReaderEpochs[i], __ATOMIC_SEQ_CST);
+        if (readerEpoch && readerEpoch < oldest) {
+            oldest = readerEpoch;
+        }
+    }
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < myRetiredSnapshots.size(); i++) {
+        if (myRetiredSnapshots[i]->myRetiredAt <= oldest) {
+            delete myRetiredSnapshots[i];
+        } else {
+            myRetiredSnapshots[kept++] = myRetiredSnapshots[i];
+        }
+    }
+    myRetiredSnapshots.resize(kept);
+}
+
+int Dungeon::addSnapshotReader() {
+    int reader = __atomic_fetch_add(&myNumReaders, 1, __ATOMIC_SEQ_CST);
+    if (reader >= MAX_SNAPSHOT_READERS) {
+        debug("FAIL: more than %d snapshot readers", MAX_SNAPSHOT_READERS);
+        throw -1;
+    }
+    return reader;
+}
+
+DungeonSnapshot * Dungeon::startReading(int reader) {
+    uint64_t epoch = __atomic_load_n(&myEpoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&myReaderEpochs[reader], epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&mySnapshot, __ATOMIC_SEQ_CST);
+}
+
+void Dungeon::stopReading(int reader) {
+    __atomic_store_n(&myReaderEpochs[reader], 0, __ATOMIC_SEQ_CST);
+}
+
+/****** Server stats ******/
+
+static void * runStatsFnc(void *server);
+
+void Server::startStats() {
+    if (!myStatsInterval) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runStatsFnc, this)) {
+        on_server_failure();
+    }
+    pthread_detach(thread);
+}
+
+static void * runStatsFnc(void *server) {
+    try {
+        ((Server *) server)->runStats();
+    } catch (int e) {
+        exit(1);
+    }
+    return NULL;
+}
+
+void Server::runStats() {
+    Dungeon *dungeons[MAX_NUM_SHARDS];
+    int readers[MAX_NUM_SHARDS];
+    for (unsigned int i = 0; i < myNumShards; i++) {
+        dungeons[i] = myShards ? myShards[i]->myDungeon : myDungeon;
+        readers[i] = dungeons[i]->addSnapshotReader();
+    }
+
+    DungeonSnapshot *snapshot;
+    unsigned int total, busiest;
+    while (true) {
+        sleep(myStatsInterval);
+        total = 0;
+        for (unsigned int i = 0; i < myNumShards; i++) {
+            snapshot = dungeons[i]->startReading(readers[i]);
+            if (snapshot) {
+                busiest = 0;
+                for (unsigned int j = 0; j < snapshot->myCells.size(); j++) {
+                    busiest = max(busiest, snapshot->myCells[j].count);
+                }
+                printf("stats: shard %u has %u players in %lu cells, at most %u in one\n",
+                    i, snapshot->size(), snapshot->myCells.size(), busiest);
+                total += snapshot->size();
+            }
+            dungeons[i]->stopReading(readers[i]);
+        }
+        printf("stats: %u players\n", total);
+        fflush(stdout);
+    }
+}
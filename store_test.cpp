@@ -0,0 +1,436 @@
+#include "tww.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+/* Checks the player files and the Dungeon's name index against the cases
+   they were written for: damaged records, torn logs, compaction, tables
+   that grow or do not match their headers, and deletions from the middle
+   of a probe run.
+
+   usage: store_test [directory]
+
+   Scratch files go in directory, /tmp by default, and are removed after.
+   Exits 0 if every check passed. */
+
+static unsigned int numFailed = 0;
+
+static void check(bool passed, const char *what) {
+    if (!passed) {
+        printf("FAIL: %s\n", what);
+        numFailed++;
+    }
+}
+
+static struct p2p_user_data makeUser(const char *name, int hp) {
+    struct p2p_user_data user;
+    memset(&user, 0, sizeof(user));
+    strncpy(user.name, name, MAX_LOGIN_LENGTH + 1);
+    user.hp = hp;
+    user.exp = hp * 2;
+    user.x = hp % DUNGEON_SIZE_X;
+    user.y = hp / DUNGEON_SIZE_X % DUNGEON_SIZE_Y;
+    return user;
+}
+
+static void save(PlayerFile *file, const char *name, int hp) {
+    struct p2p_user_data user = makeUser(name, hp);
+    check(file->write(&user, 1), "write");
+}
+
+static int hpOf(PlayerFile *file, const char *name) {
+    char key[MAX_LOGIN_LENGTH + 1];
+    struct p2p_user_data user;
+    strncpy(key, name, sizeof(key));
+    if (file->read(key, &user) != RECORD_FOUND) {
+        return -1;
+    }
+    return user.hp;
+}
+
+static int readResult(PlayerFile *file, const char *name) {
+    char key[MAX_LOGIN_LENGTH + 1];
+    struct p2p_user_data user;
+    strncpy(key, name, sizeof(key));
+    return file->read(key, &user);
+}
+
+static off_t sizeOf(const char *fileName) {
+    struct stat info;
+    if (stat(fileName, &info) < 0) {
+        return -1;
+    }
+    return info.st_size;
+}
+
+static void pokeByte(const char *fileName, off_t offset, unsigned char value) {
+    int file = open(fileName, O_WRONLY);
+    check(file >= 0 && pwrite(file, &value, 1, offset) == 1, "poke");
+    close(file);
+}
+
+/* Whether opening fileName as a PLAYERS_LOG or PLAYERS_TABLE ends the
+   process, as it should for a file the build cannot read. */
+static bool openRejected(const char *fileName, int format) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        if (format == PLAYERS_LOG) {
+            new PlayerLog(fileName);
+        } else {
+            new PlayerTable(fileName);
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void testRecords() {
+    struct p2p_user_data user = makeUser("alice", 77), decoded;
+    struct player_record record, damaged;
+    encodePlayerRecord(&user, &record);
+    check(sizeof(record) == 32, "records are 32 bytes");
+    check(decodePlayerRecord(&record, &decoded), "record round trip");
+    check(!memcmp(&user, &decoded, sizeof(user)), "record round trip keeps every field");
+
+    /* Any byte the checksum covers. */
+    for (size_t i = offsetof(struct player_record, name); i < sizeof(record); i++) {
+        damaged = record;
+        ((unsigned char *) &damaged)[i] ^= 0x01;
+        if (decodePlayerRecord(&damaged, &decoded)) {
+            check(false, "record checksum catches a flipped bit");
+            break;
+        }
+    }
+    damaged = record;
+    damaged.checksum ^= htonl(1);
+    check(!decodePlayerRecord(&damaged, &decoded), "record with a bad checksum");
+    damaged = record;
+    damaged.magic = htons(PLAYER_RECORD_MAGIC + 1);
+    check(!decodePlayerRecord(&damaged, &decoded), "record with a bad magic number");
+    damaged = record;
+    damaged.version = PLAYER_RECORD_VERSION + 1;
+    check(!decodePlayerRecord(&damaged, &decoded), "record from another version");
+
+    /* A name with no terminator, even with a checksum to match. */
+    size_t start = offsetof(struct player_record, name);
+    damaged = record;
+    memset(damaged.name, 'a', sizeof(damaged.name));
+    damaged.checksum = htonl(calc_crc32((unsigned char *) &damaged + start, sizeof(damaged) - start));
+    check(!decodePlayerRecord(&damaged, &decoded), "record with an unterminated name");
+
+    memset(&record, 0, sizeof(record));
+    check(!decodePlayerRecord(&record, &decoded), "zeroed record");
+}
+
+static void testLogRecovery(const char *fileName) {
+    unlink(fileName);
+    off_t header = sizeof(struct log_header);
+    off_t recordSize = sizeof(struct player_record);
+
+    PlayerLog *log = new PlayerLog(fileName);
+    save(log, "alice", 1);
+    save(log, "bob", 2);
+    save(log, "alice", 3);
+    check(log->sync(), "log sync");
+    check(hpOf(log, "alice") == 3, "log reads the latest record");
+    delete log;
+
+    /* Half a record at the end, as a crash mid-append leaves. */
+    struct player_record record;
+    struct p2p_user_data user = makeUser("carol", 4);
+    encodePlayerRecord(&user, &record);
+    int file = open(fileName, O_WRONLY);
+    check(pwrite(file, &record, recordSize / 2, header + 3 * recordSize) == recordSize / 2, "tear log");
+    close(file);
+
+    log = new PlayerLog(fileName);
+    check(sizeOf(fileName) == header + 3 * recordSize, "torn record is truncated away");
+    check(hpOf(log, "alice") == 3 && hpOf(log, "bob") == 2, "records before a torn end survive");
+    check(readResult(log, "carol") == RECORD_MISSING, "torn record is not indexed");
+
+    /* A whole record at the end whose bytes did not all make it. */
+    save(log, "bob", 5);
+    check(log->sync(), "log sync");
+    delete log;
+    pokeByte(fileName, header + 3 * recordSize + recordSize - 1, 0x55);
+    log = new PlayerLog(fileName);
+    check(sizeOf(fileName) == header + 3 * recordSize, "damaged last record is truncated away");
+    check(hpOf(log, "bob") == 2, "damaged last record falls back to the one before");
+
+    /* Damage short of the end was acknowledged and must not fall back. */
+    save(log, "dave", 6);
+    check(log->sync(), "log sync");
+    delete log;
+    pokeByte(fileName, header + 2 * recordSize + recordSize - 1, 0x55);
+    log = new PlayerLog(fileName);
+    check(sizeOf(fileName) == header + 4 * recordSize, "damage mid log keeps the records after it");
+    check(readResult(log, "alice") == RECORD_DAMAGED, "damaged mid log record reads as damaged");
+    check(hpOf(log, "bob") == 2 && hpOf(log, "dave") == 6, "records around damage survive");
+    save(log, "alice", 7);
+    check(hpOf(log, "alice") == 7, "a new save replaces a damaged record");
+    delete log;
+
+    /* The header is not a whole record, so tearing it leaves a new log. */
+    unlink(fileName);
+    file = open(fileName, O_RDWR | O_CREAT, 0666);
+    struct log_header head;
+    memset(&head, 0, sizeof(head));
+    head.magic = htonl(0x5457574cu);
+    check(write(file, &head, 2) == 2, "tear header");
+    close(file);
+    log = new PlayerLog(fileName);
+    check(sizeOf(fileName) == header, "torn header is rewritten");
+    delete log;
+
+    head.version = PLAYER_RECORD_VERSION + 1;
+    file = open(fileName, O_WRONLY | O_TRUNC);
+    check(write(file, &head, sizeof(head)) == sizeof(head), "write header");
+    close(file);
+    check(openRejected(fileName, PLAYERS_LOG), "log from another version is rejected");
+    head.version = PLAYER_RECORD_VERSION;
+    head.magic = htonl(0x12345678);
+    file = open(fileName, O_WRONLY | O_TRUNC);
+    check(write(file, &head, sizeof(head)) == sizeof(head), "write header");
+    close(file);
+    check(openRejected(fileName, PLAYERS_LOG), "log with a bad magic number is rejected");
+    unlink(fileName);
+}
+
+static void testLogCompaction(const char *fileName) {
+    unlink(fileName);
+    char name[MAX_LOGIN_LENGTH + 1];
+    unsigned int numNames = 64;
+    unsigned int numSaves = LOG_COMPACT_MIN_RECORDS * 2;
+
+    PlayerLog *log = new PlayerLog(fileName);
+    for (unsigned int i = 0; i < numSaves; i++) {
+        snprintf(name, sizeof(name), "p%u", i % numNames);
+        save(log, name, i);
+    }
+    check(log->sync(), "log sync");
+
+    /* The first call starts the thread; later ones finish it once done.
+       A save made meanwhile has to be carried over. */
+    log->maintain();
+    save(log, "late", 1);
+    off_t compacted = sizeof(struct log_header) + (numNames + 1) * sizeof(struct player_record);
+    for (unsigned int i = 0; i < 1000 && sizeOf(fileName) != compacted; i++) {
+        usleep(1000);
+        log->maintain();
+    }
+    check(sizeOf(fileName) == compacted, "compaction keeps only live records");
+    for (unsigned int i = numSaves - numNames; i < numSaves; i++) {
+        snprintf(name, sizeof(name), "p%u", i % numNames);
+        if (hpOf(log, name) != (int) i) {
+            check(false, "compacted log reads the latest records");
+            break;
+        }
+    }
+    check(hpOf(log, "late") == 1, "compaction keeps a save made while it ran");
+    save(log, "later", 2);
+    check(log->sync(), "log sync");
+    delete log;
+
+    log = new PlayerLog(fileName);
+    check(hpOf(log, "p0") == (int) (numSaves - numNames) && hpOf(log, "later") == 2,
+        "compacted log reopens");
+    delete log;
+    unlink(fileName);
+}
+
+static void writeTableHeader(const char *fileName, uint32_t magic, uint32_t numSlots,
+    uint32_t numUsed, off_t length) {
+    struct table_header header;
+    header.magic = htonl(magic);
+    header.numSlots = htonl(numSlots);
+    header.numUsed = htonl(numUsed);
+    int file = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    check(file >= 0 && ftruncate(file, length) == 0 &&
+        pwrite(file, &header, sizeof(header), 0) == sizeof(header), "write table header");
+    close(file);
+}
+
+/* Where name's slot is in the file, or -1. */
+static off_t slotOffset(const char *fileName, const char *name) {
+    struct player_record record;
+    int file = open(fileName, O_RDONLY);
+    off_t found = -1;
+    for (off_t offset = sizeof(struct table_header);
+         pread(file, &record, sizeof(record), offset) == sizeof(record); offset += sizeof(record)) {
+        if (!strncmp(record.name, name, MAX_LOGIN_LENGTH + 1)) {
+            found = offset;
+            break;
+        }
+    }
+    close(file);
+    return found;
+}
+
+static void testTable(const char *fileName) {
+    unlink(fileName);
+    off_t recordSize = sizeof(struct player_record);
+    off_t initialLength = sizeof(struct table_header) + TABLE_INITIAL_SLOTS * recordSize;
+    string asideName = string(fileName) + ".new";
+    string grownName = string(fileName) + ".grow";
+
+    PlayerTable *table = new PlayerTable(fileName);
+    check(sizeOf(fileName) == initialLength, "new table has its initial slots");
+    check(sizeOf(asideName.c_str()) < 0, "new table is renamed into place");
+    save(table, "alice", 1);
+    save(table, "bob", 2);
+    save(table, "alice", 3);
+    check(table->sync(), "table sync");
+    check(hpOf(table, "alice") == 3 && hpOf(table, "bob") == 2, "table reads the latest record");
+    check(readResult(table, "carol") == RECORD_MISSING, "table misses an unknown name");
+    delete table;
+
+    /* A damaged slot still holds its player's name. A new player probing
+       past it must not take it over, and only a new save of that player
+       may overwrite it. */
+    off_t alice = slotOffset(fileName, "alice");
+    check(alice > 0, "table holds alice's slot");
+    pokeByte(fileName, alice + recordSize - 1, 0x55);
+    table = new PlayerTable(fileName);
+    check(readResult(table, "alice") == RECORD_DAMAGED, "damaged slot reads as damaged");
+
+    /* Enough players to grow the table twice, with probe runs that cross
+       the damaged slot. */
+    char name[MAX_LOGIN_LENGTH + 1];
+    unsigned int numPlayers = TABLE_INITIAL_SLOTS * 2;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        save(table, name, i);
+    }
+    check(table->sync(), "table sync");
+    check(sizeOf(fileName) > initialLength, "table grows past half full");
+    check(sizeOf(grownName.c_str()) < 0, "grown table is renamed into place");
+    check(readResult(table, "alice") == RECORD_DAMAGED, "damaged slot survives new players and a grow");
+    bool found = true;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        found = found && hpOf(table, name) == (int) i;
+    }
+    check(found, "grown table finds every player");
+    vector<string> names;
+    table->names(names);
+    check(names.size() == numPlayers + 2, "grown table names every player once");
+    delete table;
+
+    off_t grownLength = sizeOf(fileName);
+    table = new PlayerTable(fileName);
+    found = true;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        found = found && hpOf(table, name) == (int) i;
+    }
+    check(found, "grown table reopens");
+    check(hpOf(table, "bob") == 2, "grown table keeps older players");
+    check(readResult(table, "alice") == RECORD_DAMAGED, "grown table keeps the damaged slot");
+    save(table, "alice", 4);
+    check(hpOf(table, "alice") == 4, "a new save replaces a damaged slot");
+    check(table->sync(), "table sync");
+    delete table;
+
+    /* A table cut short, or with a header that does not match its file. */
+    int file = open(fileName, O_WRONLY);
+    check(ftruncate(file, grownLength - recordSize) == 0, "cut table");
+    close(file);
+    check(openRejected(fileName, PLAYERS_TABLE), "table cut short is rejected");
+    uint32_t magic = 0x54575755u;
+    writeTableHeader(fileName, magic + 1, TABLE_INITIAL_SLOTS, 0, initialLength);
+    check(openRejected(fileName, PLAYERS_TABLE), "table with a bad magic number is rejected");
+    writeTableHeader(fileName, magic, TABLE_INITIAL_SLOTS - 1, 0,
+        sizeof(struct table_header) + (TABLE_INITIAL_SLOTS - 1) * recordSize);
+    check(openRejected(fileName, PLAYERS_TABLE), "table with slots not a power of two is rejected");
+    writeTableHeader(fileName, magic, 0, 0, sizeof(struct table_header));
+    check(openRejected(fileName, PLAYERS_TABLE), "table with no slots is rejected");
+    writeTableHeader(fileName, magic, TABLE_INITIAL_SLOTS, TABLE_INITIAL_SLOTS + 1, initialLength);
+    check(openRejected(fileName, PLAYERS_TABLE), "table with more players than slots is rejected");
+    writeTableHeader(fileName, magic, TABLE_INITIAL_SLOTS, 0, initialLength * 2);
+    check(openRejected(fileName, PLAYERS_TABLE), "table longer than its header says is rejected");
+    writeTableHeader(fileName, magic, TABLE_INITIAL_SLOTS, 0, 4);
+    check(openRejected(fileName, PLAYERS_TABLE), "table shorter than its header is rejected");
+    writeTableHeader(fileName, magic, TABLE_INITIAL_SLOTS, 0, initialLength);
+    table = new PlayerTable(fileName);
+    check(readResult(table, "alice") == RECORD_MISSING, "table with a valid header opens");
+    delete table;
+    unlink(fileName);
+}
+
+/* Removing from the middle of a probe run has to shift the rest of the
+   run back, or names past the hole become unreachable. */
+static void testNameIndex() {
+    Dungeon dungeon(DUNGEON_SIZE_X, DUNGEON_SIZE_Y);
+    dungeon.setBoundary(0, 0, DUNGEON_SIZE_X - 1, DUNGEON_SIZE_Y - 1);
+    unsigned int numPlayers = 3000;
+    char name[MAX_LOGIN_LENGTH + 1];
+    vector<Player *> players;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        struct location loc = { (int) (i % DUNGEON_SIZE_X), (int) (i / DUNGEON_SIZE_X % DUNGEON_SIZE_Y) };
+        players.push_back(new Player(name, 100, 0, loc));
+        dungeon.addPlayer(players.back(), 0);
+    }
+
+    for (unsigned int i = 0; i < numPlayers; i += 3) {
+        dungeon.removePlayer(players[i]);
+    }
+    bool found = true, gone = true;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        if (i % 3 == 0) {
+            gone = gone && dungeon.findPlayer(name) == NULL;
+        } else {
+            found = found && dungeon.findPlayer(name) == players[i];
+        }
+    }
+    check(found, "name index finds every player left after removals");
+    check(gone, "name index forgets removed players");
+
+    for (unsigned int i = 0; i < numPlayers; i += 3) {
+        dungeon.addPlayer(players[i], 0);
+    }
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        if (dungeon.findPlayer(name) != players[i]) {
+            check(false, "name index finds players added back");
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        dungeon.removePlayer(players[i]);
+    }
+    gone = true;
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        snprintf(name, sizeof(name), "p%u", i);
+        gone = gone && dungeon.findPlayer(name) == NULL;
+        delete players[i];
+    }
+    check(gone, "name index empties");
+}
+
+int main(int argc, char **argv) {
+    string directory = argc > 1 ? argv[1] : "/tmp";
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "/store_test.%d", (int) getpid());
+    string fileName = directory + suffix;
+
+    testRecords();
+    testLogRecovery(fileName.c_str());
+    testLogCompaction(fileName.c_str());
+    testTable(fileName.c_str());
+    testNameIndex();
+
+    if (numFailed) {
+        printf("%u checks failed\n", numFailed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
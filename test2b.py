@@ -73,6 +73,11 @@ def write_player(players, pinfo='40 1 20 20'):
     if not os.path.isdir(datadir):
         os.mkdir(datadir)
 
+    # The server imports users/ only into an empty store.
+    for store in ['users.log', 'users.table']:
+        if os.path.isfile(store):
+            os.remove(store)
+
     for i in range(len(players)):
         if os.path.isfile(datadir+'/'+players[i]):
             continue
@@ -2,117 +2,105 @@
 
 using namespace std;
 
-Packet * TWW::makeLoginPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
-    struct tww_login_request payload;
-    memset(&payload, 0, sizeof(payload));
-    strncpy(payload.name, playerName, strlen(playerName) + 1);
-    null_terminate(payload.name, strlen(playerName));
-    payload.hp = htonl(hp);
-    payload.exp = htonl(exp);
-    payload.x = x;
-    payload.y = y;
+Packet * TWW::makeLoginPacket(char *playerName, int hp, int exp, coord_t x, coord_t y) {
+    Packet *packet = makePacket(LOGIN_REQUEST, sizeof(tww_login_request));
+    struct tww_login_request *payload = (struct tww_login_request *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->name, playerName, strlen(playerName) + 1);
+    null_terminate(payload->name, strlen(playerName));
+    payload->hp = htonl(hp);
+    payload->exp = htonl(exp);
+    payload->x = hton_coord(x);
+    payload->y = hton_coord(y);
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
-    
-    return makePacket(LOGIN_REQUEST, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeLogoutPacket() {
-    return makePacket(LOGOUT, NULL, 0);
+    return makePacket(LOGOUT, 0);
 }
 
 Packet * TWW::makeMovePacket(uint8_t dir) {
-    struct tww_move payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.direction = dir;
-
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
+    Packet *packet = makePacket(MOVE, sizeof(tww_move));
+    struct tww_move *payload = (struct tww_move *) (packet->packet + sizeof(tww_packet_header));
+    payload->direction = dir;
 
-    return makePacket(MOVE, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeAttackPacket(char *victim) {
     debug("I'm in ur Tww, makin' ur attackPacket!");
-    struct tww_attack payload;
-    memset(&payload, 0, sizeof(payload));
-    strncpy(payload.name, victim, strlen(victim) + 1);
-    null_terminate(payload.name, strlen(victim));
+    Packet *packet = makePacket(ATTACK, sizeof(tww_attack));
+    struct tww_attack *payload = (struct tww_attack *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->name, victim, strlen(victim) + 1);
+    null_terminate(payload->name, strlen(victim));
 
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
-
-    return makePacket(ATTACK, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeSpeakPacket(char *msg) {
     debug("I'm in ur Tww, makin' ur speakPacket!");
-    size_t paddingSize = calculatePaddingSize(strlen(msg) + 1);
-    struct tww_speak payload;
-    payload.msg = (char *) malloc(strlen(msg) + 1);
-    strncpy(payload.msg, msg, strlen(msg) + 1);
-    int payloadLength = strlen(payload.msg) + paddingSize + 1;
-    null_terminate(payload.msg, strlen(msg));
-
-    unsigned char payloadBytes[payloadLength];
-    memcpy(payloadBytes, payload.msg, strlen(payload.msg) + 1);
-
-    if (paddingSize != 0) {
-        memset(payloadBytes + strlen(payload.msg) + 1, 0, paddingSize);
-    }
-    free(payload.msg);
+    size_t msgLength = strlen(msg);
+    size_t paddingSize = calculatePaddingSize(msgLength + 1);
 
-    return makePacket(SPEAK, payloadBytes, payloadLength);
+    /* The message, its terminator and the padding are already zeroed. */
+    Packet *packet = makePacket(SPEAK, msgLength + 1 + paddingSize);
+    memcpy(packet->packet + sizeof(tww_packet_header), msg, msgLength);
+
+    return packet;
 }
 
-Packet * TWW::makeLoginReplyPacket(int errorCode, int hp, int exp, uint8_t x, uint8_t y) {
-    struct tww_login_reply payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.errorCode = errorCode;
-    payload.hp = htonl(hp);
-    payload.exp = htonl(exp);
-    payload.x = x;
-    payload.y = y;
-    payload.padding = 0;
+Packet * TWW::makeLoginReplyPacket(int errorCode, int hp, int exp, coord_t x, coord_t y) {
+    Packet *packet = makePacket(LOGIN_REPLY, sizeof(tww_login_reply));
+    struct tww_login_reply *payload = (struct tww_login_reply *) (packet->packet + sizeof(tww_packet_header));
+    payload->errorCode = errorCode;
+    payload->hp = htonl(hp);
+    payload->exp = htonl(exp);
+    payload->x = hton_coord(x);
+    payload->y = hton_coord(y);
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
+    return packet;
+}
+
+Packet * TWW::makeMoveNotifyPacket(char *playerName, int hp, int exp, coord_t x, coord_t y) {
+    Packet *packet = makePacket(MOVE_NOTIFY, sizeof(tww_move_notify));
+    struct tww_move_notify *payload = (struct tww_move_notify *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->name, playerName, strlen(playerName) + 1);
+    null_terminate(payload->name, strlen(playerName));
+    payload->x = hton_coord(x);
+    payload->y = hton_coord(y);
+    payload->hp = htonl(hp);
+    payload->exp = htonl(exp);
     
-    return makePacket(LOGIN_REPLY, payloadBytes, sizeof(payload));
+    return packet;
 }
 
-Packet * TWW::makeMoveNotifyPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
-    struct tww_move_notify payload;
-    memset(&payload, 0, sizeof(payload));
-    strncpy(payload.name, playerName, strlen(playerName) + 1);
-    null_terminate(payload.name, strlen(playerName));
-    payload.x = x;
-    payload.y = y;
-    payload.hp = htonl(hp);
-    payload.exp = htonl(exp);
+Packet * TWW::makeVisionEnterPacket(char *playerName, int hp, int exp, coord_t x, coord_t y) {
+    Packet *packet = makeMoveNotifyPacket(playerName, hp, exp, x, y);
+    ((struct tww_packet_header *) packet->packet)->msg_type = VISION_ENTER;
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
+    return packet;
+}
+
+Packet * TWW::makeVisionLeavePacket(char *playerName) {
+    Packet *packet = makePacket(VISION_LEAVE, sizeof(tww_vision_leave));
+    struct tww_vision_leave *payload = (struct tww_vision_leave *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->name, playerName, strlen(playerName) + 1);
+    null_terminate(payload->name, strlen(playerName));
     
-    return makePacket(MOVE_NOTIFY, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeAttackNotifyPacket(char *attackerName, char *victimName, int damage, int hp) {
-    struct tww_attack_notify payload;
-    memset(&payload, 0, sizeof(payload));
-    
-    strncpy(payload.attacker, attackerName, strlen(attackerName) + 1);
-    null_terminate(payload.attacker, strlen(attackerName));
-    strncpy(payload.victim, victimName, strlen(victimName) + 1);
-    null_terminate(payload.victim, strlen(victimName));
-    payload.damage = damage;
-    payload.hp = htonl(hp);
+    Packet *packet = makePacket(ATTACK_NOTIFY, sizeof(tww_attack_notify));
+    struct tww_attack_notify *payload = (struct tww_attack_notify *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->attacker, attackerName, strlen(attackerName) + 1);
+    null_terminate(payload->attacker, strlen(attackerName));
+    strncpy(payload->victim, victimName, strlen(victimName) + 1);
+    null_terminate(payload->victim, strlen(victimName));
+    payload->damage = damage;
+    payload->hp = htonl(hp);
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
-    
-    return makePacket(ATTACK_NOTIFY, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeSpeakNotifyPacket(char *playerName, char *msg) {
@@ -122,173 +110,146 @@ Packet * TWW::makeSpeakNotifyPacket(char *playerName, char *msg) {
         on_server_failure();
     }
 
-    size_t msgLength  = strlen(msg);
-    struct tww_speak_notify payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.msg = (char *) malloc(msgLength + 1);
-    strncpy(payload.msg, msg, msgLength + 1);
-    null_terminate(payload.msg, msgLength);
-
-    strncpy(payload.name, playerName, strlen(playerName) + 1);
-    null_terminate(payload.name, strlen(playerName));
+    /* The wire length counts the struct's msg pointer as well, though the
+       message itself follows straight after the name. */
+    size_t msgLength = strlen(msg);
+    size_t payloadLength = sizeof(tww_speak_notify) + msgLength + 1;
+    payloadLength += calculatePaddingSize(payloadLength);
 
-    size_t payloadLength = sizeof(payload) + msgLength + 1;
-
-    size_t paddingSize = calculatePaddingSize(payloadLength);
-    payloadLength += paddingSize;
-
-    unsigned char payloadBytes[payloadLength];
-    memcpy(payloadBytes, payload.name, sizeof(payload.name));
-    memcpy(payloadBytes+sizeof(payload.name), payload.msg, msgLength+1);
-
-    free(payload.msg);
+    Packet *packet = makePacket(SPEAK_NOTIFY, payloadLength);
+    char *name = (char *) packet->packet + sizeof(tww_packet_header);
+    strncpy(name, playerName, strlen(playerName) + 1);
+    null_terminate(name, strlen(playerName));
+    memcpy(name + MAX_LOGIN_LENGTH + 1, msg, msgLength);
     
-    return makePacket(SPEAK_NOTIFY, payloadBytes, payloadLength);
+    return packet;
 }
 
-Packet * TWW::makeLogoutNotifyPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
-    struct tww_logout_notify payload;
-    memset(&payload, 0, sizeof(payload));
-    strncpy(payload.name, playerName, strlen(playerName) + 1);
-    null_terminate(payload.name, strlen(playerName));
-    payload.hp = htonl(hp);
-    payload.exp = htonl(exp);
-    payload.x = x;
-    payload.y = y;
-    
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
+Packet * TWW::makeLogoutNotifyPacket(char *playerName, int hp, int exp, coord_t x, coord_t y) {
+    Packet *packet = makePacket(LOGOUT_NOTIFY, sizeof(tww_logout_notify));
+    struct tww_logout_notify *payload = (struct tww_logout_notify *) (packet->packet + sizeof(tww_packet_header));
+    strncpy(payload->name, playerName, strlen(playerName) + 1);
+    null_terminate(payload->name, strlen(playerName));
+    payload->hp = htonl(hp);
+    payload->exp = htonl(exp);
+    payload->x = hton_coord(x);
+    payload->y = hton_coord(y);
     
-    return makePacket(LOGOUT_NOTIFY, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeInvalidStatePacket(int errorCode) {
-    struct tww_invalid_state payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.errorCode = errorCode;
+    Packet *packet = makePacket(INVALID_STATE, sizeof(tww_invalid_state));
+    struct tww_invalid_state *payload = (struct tww_invalid_state *) (packet->packet + sizeof(tww_packet_header));
+    payload->errorCode = errorCode;
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
-    
-    return makePacket(INVALID_STATE, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeP2PBackupResponse(int errorCode) {
-    struct p2p_bkup_response payload;
-    memset(&payload, 0, sizeof(payload));
-    payload.error_code = errorCode;
-    
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
+    Packet *packet = makePacket(BKUP_RESPONSE, sizeof(p2p_bkup_response));
+    struct p2p_bkup_response *payload = (struct p2p_bkup_response *) (packet->packet + sizeof(tww_packet_header));
+    payload->error_code = errorCode;
     
-    return makePacket(BKUP_RESPONSE, payloadBytes, sizeof(payload));
+    return packet;
 }
 
 Packet * TWW::makeP2PBackupRequest(struct p2p_user_data userData) {
-    unsigned char payloadBytes[sizeof(p2p_user_data)];
+    Packet *packet = makePacket(BKUP_REQUEST, sizeof(p2p_user_data));
     userData.hp = htonl(userData.hp);
     userData.exp = htonl(userData.exp);
-    memcpy(payloadBytes, &userData, sizeof(p2p_user_data));
+    userData.x = hton_coord(userData.x);
+    userData.y = hton_coord(userData.y);
+    memcpy(packet->packet + sizeof(tww_packet_header), &userData, sizeof(p2p_user_data));
     
-    return makePacket(BKUP_REQUEST, payloadBytes, sizeof(p2p_user_data));
+    return packet;
 }
 
 Packet * TWW::makeP2PJoinResponsePacket(UserDataList *userDataList) {
-    struct p2p_join_response payload;
-    memset(&payload, 0, sizeof(payload));
-    
-    payload.user_number = userDataList->size();
-    
-    int userDataList_size = sizeof(p2p_user_data) * payload.user_number;
-    payload.user_data_list = (struct p2p_user_data *)malloc(userDataList_size);
+    /* The user data goes after the whole struct, list pointer included. */
+    int userDataList_size = sizeof(p2p_user_data) * userDataList->size();
+    Packet *packet = makePacket(JOIN_RESPONSE, sizeof(p2p_join_response) + userDataList_size);
+    unsigned char *payloadBytes = packet->packet + sizeof(tww_packet_header);
     
-    unsigned char payloadBytes[sizeof(payload) + userDataList_size];
-    payload.user_number = htonl(payload.user_number);
-    
-    memcpy(payloadBytes, &payload, sizeof(payload));
-    int offset = sizeof(payload);
+    struct p2p_join_response *payload = (struct p2p_join_response *) payloadBytes;
+    payload->user_number = htonl(userDataList->size());
+    int offset = sizeof(p2p_join_response);
     
     struct p2p_user_data data;
     for (int i = 0; i < userDataList->size(); i++) {
         data = userDataList->at(i);
         data.hp = htonl(data.hp);
         data.exp = htonl(data.exp);
+        data.x = hton_coord(data.x);
+        data.y = hton_coord(data.y);
         memcpy(payloadBytes + offset, &data, sizeof(p2p_user_data));
         offset += sizeof(p2p_user_data);
     }
     
-    return makePacket(JOIN_RESPONSE, payloadBytes, sizeof(payload) + userDataList_size);
+    return packet;
 }
 
 Packet * TWW::makeP2PJoinRequestPacket(int p2p_id) {
-    struct p2p_join_request payload;
-    memset(&payload, 0, sizeof(payload));
-    
-    payload.server_p2p_id = htonl(p2p_id);
+    Packet *packet = makePacket(JOIN_REQUEST, sizeof(p2p_join_request));
+    struct p2p_join_request *payload = (struct p2p_join_request *) (packet->packet + sizeof(tww_packet_header));
+    payload->server_p2p_id = htonl(p2p_id);
     
-    unsigned char payloadBytes[sizeof(payload)];
-    memcpy(payloadBytes, &payload, sizeof(payload));
-    
-    return makePacket(JOIN_REQUEST, payloadBytes, sizeof(payload));
+    return packet;
 }
 
-Packet * TWW::makePacket(char messageType, unsigned char *payload, size_t payloadLength) {
+Packet * TWW::makePacket(char messageType, size_t payloadLength) {
     size_t headerLength = sizeof(tww_packet_header);
     size_t totalLength = headerLength + payloadLength;
     
-    struct tww_packet_header header;
-    header.version = VALID_VERSION;
-    header.total_length = htons(totalLength);
-    header.msg_type = messageType;
+    Packet *packet = PacketPool::allocate(totalLength);
+    struct tww_packet_header *header = (struct tww_packet_header *) packet->packet;
+    header->version = VALID_VERSION;
+    header->total_length = htons(totalLength);
+    header->msg_type = messageType;
+    memset(packet->packet + headerLength, 0, payloadLength);
     
-    unsigned char *packet = (unsigned char *) malloc(totalLength);
-    /* copy header */
-    memcpy(packet, &header, headerLength);
-    /* copy payload */
-    if (payloadLength > 0) {
-        memcpy(packet + headerLength, payload, payloadLength);
+    return packet;
+}
+
+bool TWW::nextFrame(ReceiveBuffer *clientBuffer, PacketView *frame) {
+    if (clientBuffer->size() < sizeof(tww_packet_header)) {
+        return false;
     }
-    
-    return new Packet(packet, sizeof(tww_packet_header) + payloadLength);
+
+    /* Invariant: The first 4 bytes in the buffer should always be a header. */
+    uint8_t version = clientBuffer->at(0);
+    uint16_t totalLength = (clientBuffer->at(1) << 8) + clientBuffer->at(2);
+    uint8_t msgType = clientBuffer->at(3);
+    debug("received packet of size: %u", totalLength);
+    if (version != 4 ||
+        totalLength % 4 != 0 ||
+        totalLength < sizeof(tww_packet_header) ||
+        msgType < 1 || msgType >= MAX_MESSAGE) {
+        debug("fail: bad packet");
+        throw -1;
+    }
+
+    if (totalLength > clientBuffer->size()) {
+        /* We cannot make a packet of the remaining bytes 
+           we haven't processed in the buffer. */
+        clientBuffer->reserve(totalLength);
+        return false;
+    }
+    frame->packet = clientBuffer->front(totalLength);
+    frame->length = totalLength;
+    clientBuffer->drop(totalLength);
+    return true;
 }
 
-PacketList * TWW::parsePackets(unsigned char *buffer, size_t bytesReceived, 
-                                    vector<unsigned char> *clientBuffer) {
+PacketList * TWW::parsePackets(ReceiveBuffer *clientBuffer) {
     PacketList *parsedPackets = new PacketList();
+    PacketView frame;
 
-    for (unsigned int i = 0; i < bytesReceived; i++) {
-        clientBuffer->push_back(buffer[i]);
-    }
-    unsigned int bufferOffset = 0;
-
-    while (bufferOffset + sizeof(tww_packet_header) <= clientBuffer->size()) {
-        /* Invariant: The first 4 bytes in the buffer should always be a header. */
-        uint8_t version = clientBuffer->at(bufferOffset);
-        uint16_t totalLength = (clientBuffer->at(bufferOffset+1) << 8) + clientBuffer->at(bufferOffset+2);
-        uint8_t msgType = clientBuffer->at(bufferOffset + 3);
-        debug("received packet of size: %u", totalLength);
-        if (version != 4 ||
-            totalLength % 4 != 0 ||
-            msgType < 1 || msgType >= MAX_MESSAGE) {
-            debug("fail: bad packet");
-            throw -1;
-        }
-
-        if (bufferOffset + totalLength <= clientBuffer->size()) {
-            unsigned char *packet = (unsigned char *) malloc(totalLength);
-            memset(packet, 0, sizeof(packet));
-            for (unsigned int i = 0; i < totalLength; i++) {
-                packet[i] = clientBuffer->at(bufferOffset + i);
-            }
-            parsedPackets->push_back(new Packet(packet, totalLength));
-            bufferOffset += totalLength;
-        } else {
-            /* We cannot make a packet of the remaining bytes 
-               we haven't processed in the buffer. */
-            break;
-        }
+    while (nextFrame(clientBuffer, &frame)) {
+        unsigned char *packet = (unsigned char *) malloc(frame.length);
+        memcpy(packet, frame.packet, frame.length);
+        parsedPackets->push_back(new Packet(packet, frame.length));
     }
 
-    clientBuffer->erase(clientBuffer->begin(), clientBuffer->begin() + bufferOffset);
     return parsedPackets;
 }
@@ -10,6 +10,10 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <list>
+#include <set>
+#include <deque>
+#include <new>
 #include <cmath>
 #include <ctime>
 
@@ -19,6 +23,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/uio.h>
 
 /** General utility files for the project. */
 #include "constants.h"
@@ -26,6 +31,16 @@
 
 /** Other */
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef USE_IO_URING
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define DEBUG false
 extern void debug(const char* format, ...);
@@ -39,12 +54,37 @@ extern size_t calculatePaddingSize(int length);
 /** Calculates P2P ID. */
 extern uint32_t calc_p2p_id(unsigned char *name);
 
+/** The CRC-32 (IEEE) of length bytes at data. */
+extern uint32_t calc_crc32(unsigned char *data, size_t length);
+
 /** Prints user data. */
 extern void printUserData(struct p2p_user_data user);
 
-/** Returns a random number between low and high, inclusive. */
+/** Prints a packet's header fields and then all of its bytes in hex. */
+extern void printPacketBytes(unsigned char *packet, size_t length, uint8_t msgType);
+
+/** Fills record with user, ready to be written to disk. */
+extern void encodePlayerRecord(struct p2p_user_data *user, struct player_record *record);
+
+/** Sets user from record and returns true, or returns false if record is
+ *  torn, damaged or of a version this build does not know. */
+extern bool decodePlayerRecord(struct player_record *record, struct p2p_user_data *user);
+
+/** Returns a random number between low and high, inclusive, from the
+ *  calling thread's own generator. */
 int random(int low, int high);
 
+/** Restarts the calling thread's generator at seed. Threads that never call
+ *  it are seeded from the clock. */
+void seedRandom(uint64_t seed);
+
+/** Milliseconds on a clock that never jumps. */
+uint64_t monotonicMillis();
+
+/** Puts the directory holding fileName on disk, so that a rename into it
+ *  survives a crash. */
+bool syncDirectoryOf(std::string fileName);
+
 class Client;
 class Server;
 class Tracker;
@@ -54,9 +94,20 @@ class UDPHandler;
 class Packet;
 class UDPPacket;
 class Dungeon;
+class DungeonSnapshot;
 class Player;
 class PlayerFactory;
+class PlayerStore;
+class PlayerFile;
+class PlayerLog;
+class PlayerTable;
 class Peers;
+class PlayerDirectory;
+class ReceiveBuffer;
+class PacketView;
+#ifdef USE_IO_URING
+class URing;
+#endif
 
 /****** TCP Packet structures ******/
 
@@ -70,17 +121,25 @@ struct tww_login_request {
     char name[MAX_LOGIN_LENGTH + 1];
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
+#ifdef LARGE_WORLD
+    /* Keeps TCP frames a multiple of four bytes. */
+    uint8_t wide_padding[2];
+#endif
 } __attribute((packed));
 
 struct tww_login_reply {
     uint8_t errorCode;
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
     uint8_t padding;
+#ifdef LARGE_WORLD
+    /* Keeps TCP frames a multiple of four bytes. */
+    uint8_t wide_padding[2];
+#endif
 } __attribute((packed));
 
 struct tww_move {
@@ -90,10 +149,14 @@ struct tww_move {
 
 struct tww_move_notify {
     char name[MAX_LOGIN_LENGTH + 1];
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
     int hp;
     int exp;
+#ifdef LARGE_WORLD
+    /* Keeps TCP frames a multiple of four bytes. */
+    uint8_t wide_padding[2];
+#endif
 } __attribute((packed));
 
 struct tww_attack {
@@ -101,6 +164,12 @@ struct tww_attack {
     uint8_t padding[2];
 } __attribute((packed));
 
+/* VISION_ENTER carries a tww_move_notify. */
+struct tww_vision_leave {
+    char name[MAX_LOGIN_LENGTH + 1];
+    uint8_t padding[2];
+} __attribute((packed));
+
 struct tww_attack_notify {
     char attacker[MAX_LOGIN_LENGTH + 1];
     char victim[MAX_LOGIN_LENGTH + 1];
@@ -122,8 +191,12 @@ struct tww_logout_notify {
     char name[MAX_LOGIN_LENGTH + 1];
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
+#ifdef LARGE_WORLD
+    /* Keeps TCP frames a multiple of four bytes. */
+    uint8_t wide_padding[2];
+#endif
 } __attribute((packed));
 
 struct tww_invalid_state {
@@ -160,24 +233,24 @@ struct udp_player_state_response {
     char name[MAX_LOGIN_LENGTH + 1];
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
     uint8_t padding[3];
 } __attribute((packed));
 
 struct udp_server_area_request {
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
     uint8_t padding;
 } __attribute((packed));
 
 struct udp_server_area_response {
     uint32_t server_ip_address;
     uint16_t server_tcp_port;
-    uint8_t min_x;
-    uint8_t max_x;
-    uint8_t min_y;
-    uint8_t max_y;
+    coord_t min_x;
+    coord_t max_x;
+    coord_t min_y;
+    coord_t max_y;
     uint8_t padding;
 } __attribute((packed));
 
@@ -185,8 +258,8 @@ struct udp_save_state_request {
     char name[MAX_LOGIN_LENGTH + 1];
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
     uint8_t padding[3];
 } __attribute((packed));
 
@@ -206,8 +279,29 @@ struct p2p_user_data {
     char name[MAX_LOGIN_LENGTH + 1];
     int hp;
     int exp;
-    uint8_t x;
-    uint8_t y;
+    coord_t x;
+    coord_t y;
+#ifdef LARGE_WORLD
+    /* Keeps TCP frames a multiple of four bytes. */
+    uint8_t wide_padding[2];
+#endif
+} __attribute((packed));
+
+/** A player as PlayerLog and PlayerTable keep it on disk: the same 32
+ *  bytes, in network byte order, whatever the build. The checksum covers
+ *  everything after it, so a torn or damaged record is recognised. A new
+ *  layout gets a new version. */
+struct player_record {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t padding;
+    uint32_t checksum;
+    char name[MAX_LOGIN_LENGTH + 1];
+    uint32_t hp;
+    uint32_t exp;
+    uint16_t x;
+    uint16_t y;
+    uint8_t reserved[2];
 } __attribute((packed));
 
 struct p2p_join_response {
@@ -225,8 +319,20 @@ struct p2p_bkup_response {
 /****** Other ******/
 
 struct client_data {
-    Player *player;
-    std::vector<unsigned char> *buffer;
+    /* The logged in player, or NO_PLAYER_HANDLE. A handle rather than a
+       pointer, so that a slot the slab has since reused reads as gone. */
+    player_handle_t player;
+    ReceiveBuffer *buffer;
+    /* Packets waiting for the socket to become writable. */
+    std::deque<Packet *> *outQueue;
+    size_t queuedBytes;
+    /* Bytes of the front packet already sent. */
+    size_t sentOffset;
+    /* Waiting in myDirtySockets for the end of loop flush. */
+    bool dirty;
+    /* Front packets the kernel is still sending from (io_uring only). */
+    unsigned int inFlight;
+    bool closing;
 };
 
 struct location {
@@ -234,6 +340,93 @@ struct location {
     int y;
 };
 
+/** The squares from (minX, minY) to (maxX, maxY), inclusive. */
+struct bounds {
+    int minX, maxX;
+    int minY, maxY;
+};
+
+/** A Dungeon name index entry. The name is zero padded, so that it can be
+ *  compared as a fixed size key. */
+struct player_slot {
+    char name[MAX_LOGIN_LENGTH + 1];
+    /* Where the player is in myPlayers, or -1 if the slot is free. */
+    int index;
+};
+
+/* Where an event happened. It concerns every player who can see either 
+   location; from and to are the same for events with a single source. */
+struct area_of_interest {
+    struct location from;
+    struct location to;
+};
+
+/** Work handed from one region shard to another. */
+struct shard_message {
+    int type;
+    int socket;
+    struct client_data clientData;
+    Packet *packet;
+    struct area_of_interest area;
+    char name[MAX_LOGIN_LENGTH + 1];
+    char otherName[MAX_LOGIN_LENGTH + 1];
+    int amount;
+    /* SHARD_AUTOSAVE's batch, which shard 0 deletes. */
+    std::vector<struct p2p_user_data> *users;
+};
+
+#ifdef USE_IO_URING
+/* What this shard's ring is doing with one client connection. */
+struct uring_socket {
+    int socket;
+    /* Still one of this shard's clients. */
+    bool attached;
+    bool receiving;
+    bool sending;
+    /* To be handed to another shard once nothing is in flight. */
+    bool leaving;
+    /* The in flight sendmsg reads these until it completes. */
+    struct msghdr msg;
+    struct iovec iov[MAX_WRITEV_PACKETS];
+    Packet *inFlight[MAX_WRITEV_PACKETS];
+    unsigned int numInFlight;
+    /* The round the send went to the kernel in. */
+    unsigned long sendRound;
+};
+#endif
+
+/* A MOVE waiting for the next tick. */
+struct pending_move {
+    int socket;
+    player_handle_t player;
+    int direction;
+};
+
+/* How the PlayerStore writer's batch of the saves numbered up to through
+   ended: on disk, or given up on. */
+struct commit_result {
+    uint64_t through;
+    bool durable;
+};
+
+/* A SAVE_STATE_RESPONSE, or a BKUP_RESPONSE to the storage server on
+   socket, held back until commit is durable. socket is 0 for the former,
+   and -1 once the storage server has gone. */
+struct pending_save {
+    uint32_t ip;
+    uint16_t port;
+    uint32_t id;
+    int socket;
+    uint64_t commit;
+};
+
+/* The players an autosave put in this server's own store, up to save
+   number commit, kept until the store reports how that went. */
+struct pending_batch {
+    uint64_t commit;
+    std::vector<struct p2p_user_data> users;
+};
+
 struct range {
     uint16_t high;
     uint16_t low;
@@ -244,6 +437,45 @@ typedef std::vector<Packet *> PacketList;
 typedef std::vector<UDPPacket *> UDPPacketList;
 typedef std::vector<ServerEntry *> ServerEntryList;
 typedef std::vector<struct p2p_user_data> UserDataList;
+typedef std::deque<struct p2p_user_data> UserDataQueue;
+typedef std::vector<struct shard_message> ShardMessageList;
+typedef std::vector<struct pending_move> PendingMoveList;
+typedef std::deque<struct pending_save> PendingSaveList;
+typedef std::deque<struct pending_batch> PendingBatchList;
+typedef std::vector<struct commit_result> CommitResultList;
+
+/** The players in one square of a Dungeon's grid. Their positions are
+ *  copied into xs and ys so that a whole vector of them can be compared at
+ *  once. */
+struct grid_cell {
+    PlayerList players;
+    std::vector<int> xs, ys;
+    /* Where each player is in the Dungeon's myPlayers. */
+    std::vector<int> indexes;
+};
+
+/** GRID_CHUNK_SIZE by GRID_CHUNK_SIZE grid cells, row by row. A Dungeon only
+ *  has the chunks and cells somebody is standing in; the rest are NULL. */
+struct grid_chunk {
+    struct grid_cell *cells[GRID_CHUNK_SIZE * GRID_CHUNK_SIZE];
+    unsigned int numPlayers;
+};
+
+/** A player as a DungeonSnapshot saw it. */
+struct snapshot_player {
+    char name[MAX_LOGIN_LENGTH + 1];
+    int hp, exp;
+    struct location location;
+    int owner;
+};
+
+/** The players of one grid cell, which sit together in a snapshot. key is
+ *  the cell's row times the grid width plus its column; a snapshot keeps its
+ *  cells in key order. */
+struct snapshot_cell {
+    unsigned int key;
+    unsigned int first, count;
+};
 
 /****** Class declarations ******/
 
@@ -260,36 +492,51 @@ public:
     
     void run();
     
-    void updateGame(int clientSocket, unsigned char *buffer, size_t bytesRead);
+    /** Accepts every pending connection on the listening socket. */
+    void acceptClients();
+    
+    void receiveFromUDP();
+    
+    /** Drains the client's socket, feeding what arrives into the game. */
+    void receiveFromClient(int clientSocket);
+    
+    /** Feeds what was just read into the client's receive buffer into the 
+     *  game; a non-positive count means the connection is gone. Returns 
+     *  false once the client is no longer this shard's to read from. */
+    bool consumeFromClient(int clientSocket, ssize_t bytesRead);
+    
+    void updateGame(int clientSocket);
 
     /* Sending */
     
     void sendLoginReply(int clientSocket, int errorCode, Player *player);
     
-    void broadcastMoveNotify(Player *player);
+    /** Tells the players who saw the player at previous, or see it now. */
+    void broadcastMoveNotify(Player *player, struct location previous);
     
-    void sendMoveNotify(int clientSocket, Player *player);
+    /** Tells the players around a player who just arrived that they see it. */
+    void broadcastVisionEnter(Player *player);
     
     void broadcastAttackNotify(int clientSocket, char *attackerName, char *victimName, 
-        int damage, int hp);
+        int damage, int hp, struct area_of_interest area);
     
-    void broadcastSpeakNotify(char *playerName, char *msg);
+    void broadcastSpeakNotify(Player *player, char *msg);
     
-    void broadcastLogoutNotify(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    void broadcastLogoutNotify(char *playerName, int hp, int exp, coord_t x, coord_t y);
     
     void sendInvalidState(int clientSocket, int errorCode);
 
     /* Receiving */
 
-    void processLoginRequest(int clientSocket, Packet *packet);
+    void processLoginRequest(int clientSocket, PacketView *packet);
 
-    void processSpeak(int clientSocket, Packet *packet);
+    void processSpeak(int clientSocket, PacketView *packet);
 
-    void processMove(int clientSocket, Packet *packet);
+    void processMove(int clientSocket, PacketView *packet);
 
-    void processAttack(int clientSocket, Packet *packet);
+    void processAttack(int clientSocket, PacketView *packet);
 
-    void processLogout(int clientSocket, Packet *packet);
+    void processLogout(int clientSocket, PacketView *packet);
     
     /* P2P Setup */
     
@@ -297,7 +544,9 @@ public:
     
     void p2pSetup();
     
-    int connectToPeer(std::string ip, uint16_t port);
+    /** A connected socket, or -1. Unless wait, the connect may still be
+     *  under way, and packets queue until it completes. */
+    int connectToPeer(std::string ip, uint16_t port, bool wait);
     
     /* Receiving P2P */
     
@@ -309,13 +558,13 @@ public:
     
     void sendP2PBackupResponse(int serverSocket, bool errorCode);
 
-    void processJoinRequest(int clientSocket, Packet *packet);
+    void processJoinRequest(int clientSocket, PacketView *packet);
     
-    void processJoinResponse(int clientSocket, Packet *packet);
+    void processJoinResponse(int clientSocket, PacketView *packet);
     
-    void processBkupRequest(int clientSocket, Packet *packet);
+    void processBkupRequest(int clientSocket, PacketView *packet);
     
-    void processBkupResponse(int clientSocket, Packet *packet);
+    void processBkupResponse(int clientSocket, PacketView *packet);
     
     /* Sending and Receiving UDP */
     
@@ -323,41 +572,329 @@ public:
     
     void sendSaveStateResponse(uint32_t dstIP, uint16_t dstPort, uint32_t msgID, bool success);
     
+    /** Sends the SAVE_STATE_RESPONSE or BKUP_RESPONSE for every save the
+     *  store has now committed or given up on. */
+    void answerCommittedSaves();
+    
     bool processUDPPacket(UDPPacket *packet);
     
     void processPlayerStateRequest(UDPPacket *packet);
     
     void processSaveStateRequest(UDPPacket *packet);
 
+    /** Writes out unsaved players and stops listening. */
     void closeServer();
+    
+    /** Once SIGTERM has arrived, saves every shard's unsaved players,
+     *  then closes the server and exits when the storage servers have
+     *  answered, or SHUTDOWN_SAVE_MS has passed. */
+    void exitIfTerminating();
+    
+    /** Whether every shard has handed in its final save and every
+     *  BKUP_REQUEST has been answered. */
+    bool finalSaveDone();
+    
+    /* Sharding */
+    
+    /** Splits the dungeon into numShards vertical strips, each run by its
+     *  own thread. This server becomes shard 0 and keeps accepting clients,
+     *  storage traffic and P2P. */
+    void startShards(unsigned int numShards);
+    
+    /** Sets up this server as worker shard shardID of primary. */
+    void startShard(Server *primary, int shardID);
+    
+    void postToShard(int shard, struct shard_message *message);
+    
+    void processMailbox();
+    
+    void setSlowConsumerPolicy(int policy);
+    
+    /** Ticks per second, or 0 to apply every MOVE as soon as it arrives. */
+    void setTickRate(unsigned int ticksPerSecond);
+    
+    void setBackend(int backend);
+    
+    /** Every seconds, a helper thread reports on each shard's players from
+     *  Dungeon snapshots. 0 turns the reports, and the snapshots, off. */
+    void setStatsInterval(unsigned int seconds);
+    
+    /** Makes every shard draw the same random numbers on every run: shard i 
+     *  seeds its generator with seed + i. 0 seeds them from the clock. */
+    void setRandomSeed(uint64_t seed);
+    
+    /** Whether the storage server keeps players in a log or a table. */
+    void setPlayerFormat(int format);
+    
+    /** How long the storage server lets saves gather before committing
+     *  them to disk together. */
+    void setCommitDelay(unsigned int milliseconds);
+    
+    /** Every seconds, each shard saves the players that changed since the
+     *  last time to the storage servers that own them. 0 leaves saving to
+     *  the clients. */
+    void setAutosaveInterval(unsigned int seconds);
+    
+    void startStats();
+    
+    /** The helper thread started by startStats. */
+    void runStats();
 
 private:
+    /** Queues the packet for the client. Nothing is written until the end of
+     *  the loop iteration, when flushDirtyClients gives each socket one sendmsg. */
     void sendAll(int clientSocket, Packet *packet);
+    
+    /** Queues a reference to packet, applying the slow consumer policy if 
+     *  the queue is full. */
+    void enqueue(int clientSocket, struct client_data *clientData, Packet *packet);
+    
+    /** Writes out as much of the client's output queue as the socket takes. */
+    void flushClient(int clientSocket);
+    
+    /** Points iov at the unsent front of the output queue. Returns how many
+     *  entries it filled, at most MAX_WRITEV_PACKETS. */
+    unsigned int gatherOutput(struct client_data *clientData, struct iovec *iov);
+    
+    /** Drops what the socket has taken from the front of the output queue. */
+    void consumeOutput(struct client_data *clientData, size_t bytesSent);
+    
+    void flushDirtyClients();
+    
+    /** Schedules the client to be disconnected once it is safe to do so. */
+    void markForClosing(int clientSocket, struct client_data *clientData);
+    
+    void closeMarkedClients();
 
-    void broadcast(Packet *packet);
+    /** Sends the packet to every player the area concerns, on any shard. */
+    void broadcast(Packet *packet, struct area_of_interest area);
+    
+    /** Sends the packet to the players of this shard the area concerns. */
+    void broadcastLocally(Packet *packet, struct area_of_interest *area);
+    
+    /** broadcastLocally for a MOVE_NOTIFY. Players who only see one end of
+     *  the move get a VISION_ENTER or VISION_LEAVE in its place. */
+    void broadcastMoveLocally(Packet *packet, struct area_of_interest *area);
+    
+    /** The client controlling the Dungeon's player at index, or myClients.end()
+     *  if nobody we can still send to does. */
+    std::map<int, struct client_data>::iterator clientOfPlayerAt(int index);
+    
+    /** Could the shard own a player who can see where the event happened? */
+    bool shardCovers(int shard, struct area_of_interest *area);
+    
+    /** Applies an attack on victim and tells those nearby. Returns the damage dealt. */
+    int damagePlayer(char *attackerName, struct location attackerLocation, Player *victim);
+    
+    bool playerNameTaken(char *name);
+    
+    /** Creates the epoll set along with this shard's mailbox. */
+    void makeEventLoop();
+    
+    int shardOfLocation(struct location loc);
+    
+    /** Moves the client to the shard now owning its player, if that changed. 
+     *  Returns true if the client left this shard. */
+    bool handOffIfMoved(int clientSocket);
+    
+    void handOff(int clientSocket, int shard);
+    
+    void adoptClient(int clientSocket, struct client_data clientData);
+    
+    /** Sends to the player's client wherever it lives. Takes ownership of packet. */
+    void sendToPlayer(int clientSocket, char *playerName, Packet *packet);
+    
+    /** Sends the player a VISION_ENTER for each player it can now see. With
+     *  a previous location the ones it could already see from there are left
+     *  out, and the ones it can no longer see get a VISION_LEAVE. */
+    void introducePlayer(int clientSocket, Player *player, struct location *previous);
+    
+    /** The part of introducePlayer covering this shard's players. */
+    void sendRoster(int clientSocket, char *playerName, struct location loc, 
+        struct location *previous);
     
     void disconnectClient(int clientSocket);
     
     Player * playerOfSocket(int clientSocket);
-        
-    int maxClientSocket();
+    
+    void welcomeClient(int clientSocket, struct sockaddr_in *client_sin);
+    
+    /** Starts tracking a connected socket and registers it with epoll. */
+    void addClient(int clientSocket);
+    
+    void watchSocket(int socket);
+    
+    void unwatchSocket(int socket);
+    
+    /** How long epoll_wait may block, in milliseconds. */
+    int pollTimeout();
+    
+    void runDueTick();
+    
+    /** Republishes the Dungeon snapshot every SNAPSHOT_INTERVAL_MS, if
+     *  anything reads snapshots. */
+    void publishDueSnapshot();
+    
+    /** Every myAutosaveInterval, hands this shard's changed players to
+     *  shard 0 for persistPlayers. Shard 0 also retries the storage
+     *  servers it could not reach last time. */
+    void autosaveIfDue();
+    
+    /** Saves a player whose connection dropped with changes the autosave
+     *  has not caught, before a later session can save newer ones. */
+    void persistDeparted(Player *player);
+    
+    /** Passes users, which the callee deletes, to persistPlayers on
+     *  shard 0. */
+    void persistFromShard(UserDataList *users);
+    
+    /** Saves users on the storage servers that own them and those servers'
+     *  successors, which back them up: one batch for this server's own
+     *  store, and a stream of BKUP_REQUESTs to each of the others, which
+     *  stay in flight until answered. Saves for a server that cannot be
+     *  reached are dropped, and given to markUnsaved. */
+    void persistPlayers(UserDataList &users);
+    
+    /** Has the shards holding users count them as changed since their
+     *  last save, which takeUnsavedPlayers took them to be. Players no
+     *  longer online keep their save for the next autosave round, unless
+     *  a newer one is made first. */
+    void markUnsaved(UserDataList &users);
+    
+    /** Saves users, an autosave's share for this server, in its own store
+     *  and keeps them in myPendingBatches until they are committed. */
+    void saveOwnShare(UserDataList &users);
+    
+    /** Gives markUnsaved the saves in failed, less any a later one in it
+     *  replaces: a storage socket's in flight saves that will not be
+     *  answered, or autosaves our own store gave up on. */
+    void retryInFlight(UserDataQueue &failed);
+    
+    /** A connection to the storage server, opened without waiting the
+     *  first time, or -1 if it failed this autosave round. */
+    int storageSocket(ServerEntry *server);
+    
+    /** Applies the moves queued since the last tick, then tells each
+     *  observer once about every player that moved. */
+    void tick();
+    
+    /** Writes out what this loop iteration queued, closing the clients that
+     *  fail along the way. */
+    void settleClients();
+    
+    /** Whether the kernel has taken the client's output but not yet said how
+     *  much of it went out. */
+    bool outputPending(int clientSocket);
+    
+#ifdef USE_IO_URING
+    /* The io_uring backend, in uring.cpp */
+    
+    void makeURing();
+    
+    void runURing();
+    
+    void handleCompletion(struct io_uring_cqe *cqe);
+    
+    void watchThroughURing(int socket);
+    
+    void unwatchThroughURing(int socket);
+    
+    /** Arms a multishot receive into the ring's buffers. */
+    void receiveThroughURing(uint64_t key);
+    
+    void receivedThroughURing(uint64_t key, struct io_uring_cqe *cqe);
+    
+    /** Hands the front of the output queue to the kernel, unless it is
+     *  still busy with the last batch. */
+    void sendThroughURing(int clientSocket);
+    
+    void sentThroughURing(uint64_t key, int result);
+    
+    /** Whether the kernel has yet to answer the client's last send, which
+     *  it gets a whole round to do. */
+    bool sendPendingThroughURing(int clientSocket);
+    
+    void cancelThroughURing(int operation, uint64_t key);
+    
+    /** Stops reading for a client that is moving to another shard; the
+     *  handoff happens once the ring lets go of it. */
+    void leaveURing(int clientSocket);
+    
+    /** Forgets or hands off the client once nothing is in flight for it. */
+    void settleURingSocket(uint64_t key);
+    
+    /** Identifies the socket's current connection, telling it apart from 
+     *  earlier ones that had the same descriptor. */
+    uint64_t uringKeyOf(int socket);
+#endif
     
     bool validPacket(Packet *packet);
     
-    int myListeningSocket, myUDPSocket;
+    int myListeningSocket, myUDPSocket, myEpollSocket;
     int myPredecessorSocket, mySuccessorSocket, myPrevSuccessorSocket;
     int myP2PState;
     TWW *myTww;
     Dungeon *myDungeon;
     std::map<int, struct client_data> myClients;
     PlayerFactory *myFactory;
+    /* Only the server that stores players, shard 0, has one. */
+    PlayerStore *myStore;
     UDPHandler *myUDPHandler;
+    std::vector<int> myClosingSockets;
+    std::vector<int> myDirtySockets;
+    /* Scratch space for the Dungeon's range queries. */
+    std::vector<int> myNearbyPlayers;
+    int mySlowConsumerPolicy;
+    unsigned int myTickRate;
+    uint64_t myNextTick;
+    unsigned int myStatsInterval;
+    uint64_t myRandomSeed;
+    int myPlayerFormat;
+    unsigned int myCommitDelay;
+    /* SAVE_STATE_RESPONSEs waiting for their saves to reach the disk. */
+    PendingSaveList myPendingSaves;
+    /* Autosaves to our own store not yet committed, oldest first. */
+    PendingBatchList myPendingBatches;
+    unsigned int myAutosaveInterval;
+    uint64_t myNextAutosave;
+    /* Other storage servers persistPlayers has connected to, by P2P ID. */
+    std::map<unsigned int, int> myStorageSockets;
+    /* Those whose connection failed this autosave round. */
+    std::set<unsigned int> myUnreachableStorage;
+    /* The BKUP_REQUESTs sent on each storage socket and not yet answered,
+       oldest first. */
+    std::map<int, UserDataQueue> myStorageInFlight;
+    /* Failed saves of players who are no longer online, by name. */
+    std::map<std::string, struct p2p_user_data> myDepartedRetries;
+    /* When exitIfTerminating stops waiting for the final save; 0 until
+       SIGTERM. */
+    uint64_t myShutdownDeadline;
+    /* Shards whose final save has not reached shard 0 yet. */
+    unsigned int myFinalBatchesDue;
+    uint64_t myNextSnapshot;
+    PendingMoveList myPendingMoves;
+    int myBackend;
+#ifdef USE_IO_URING
+    URing *myURing;
+    unsigned long myURingRound;
+    std::map<uint64_t, struct uring_socket> myURingSockets;
+    std::map<int, unsigned int> myURingGenerations;
+#endif
     ServerEntry *myServerEntry;
     Peers *myPeers;
     uint32_t myIP;
     UserDataList *myBackupDataList;
     bool disconnectPrevSuccessor;
     unsigned int numJoinResponses;
+    
+    /* Sharding */
+    int myShardID;
+    unsigned int myNumShards;
+    Server **myShards;
+    PlayerDirectory *myDirectory;
+    int myMailboxSocket;
+    pthread_mutex_t myMailboxLock;
+    ShardMessageList *myMailbox;
 };
 
 class Client {
@@ -366,6 +903,10 @@ public:
     
     Client(uint32_t trackerIP, uint16_t trackerPort);
     
+    /** Every seconds while logged in, saves the player's state on its
+     *  storage server. 0, the default, leaves that to the server. */
+    void setAutosaveInterval(unsigned int seconds);
+    
     void runGame();
     
     void readUserInput(char *commandBuffer);
@@ -404,6 +945,8 @@ public:
     
     void processMoveNotify(Packet *packet);
     
+    void processVisionLeave(Packet *packet);
+    
     void processAttackNotify(Packet *packet);
     
     void processSpeakNotify(Packet *packet);
@@ -442,8 +985,9 @@ private:
     bool myLoggingOut;
     bool autoSave;
     bool autoSaveDone;
+    unsigned int myAutosaveInterval;
     bool firstTimeLoggedIn;
-    std::vector<unsigned char> *myBuffer;
+    ReceiveBuffer *myBuffer;
 
     uint32_t myTrackerIP;
     uint16_t myTrackerPort;
@@ -464,7 +1008,7 @@ public:
     
     ServerEntry * serverStoringPlayer(char *s);
     
-    ServerEntry * serverResponsibleForArea(uint8_t x, uint8_t y);
+    ServerEntry * serverResponsibleForArea(coord_t x, coord_t y);
     
     void startTracker(int port);
     
@@ -534,7 +1078,7 @@ public:
      *  It is the caller's responsibility to free the memory.
      *  Sets length to the number of bytes in returned packet. */
      
-    Packet * makeLoginPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    Packet * makeLoginPacket(char *playerName, int hp, int exp, coord_t x, coord_t y);
     
     Packet * makeLogoutPacket();
     
@@ -544,15 +1088,19 @@ public:
 
     Packet * makeSpeakPacket(char *msg);
 
-    Packet * makeLoginReplyPacket(int errorCode, int hp, int exp, uint8_t x, uint8_t y);
+    Packet * makeLoginReplyPacket(int errorCode, int hp, int exp, coord_t x, coord_t y);
 
-    Packet * makeMoveNotifyPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    Packet * makeMoveNotifyPacket(char *playerName, int hp, int exp, coord_t x, coord_t y);
+    
+    Packet * makeVisionEnterPacket(char *playerName, int hp, int exp, coord_t x, coord_t y);
+    
+    Packet * makeVisionLeavePacket(char *playerName);
     
     Packet * makeAttackNotifyPacket(char *attackerName, char *victimName, int damage, int hp);
         
     Packet * makeSpeakNotifyPacket(char *playerName, char *msg);
     
-    Packet * makeLogoutNotifyPacket(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    Packet * makeLogoutNotifyPacket(char *playerName, int hp, int exp, coord_t x, coord_t y);
         
     Packet * makeInvalidStatePacket(int errorCode);
 
@@ -565,12 +1113,16 @@ public:
     
     Packet * makeP2PJoinRequestPacket(int p2p_id);
 
-    PacketList * parsePackets(unsigned char *buffer, size_t bytesReceived, 
-                                std::vector<unsigned char> *clientBuffer);
+    /** Takes the next complete frame off the front of the buffer, without
+     *  copying it. Returns false if there is none yet. */
+    bool nextFrame(ReceiveBuffer *clientBuffer, PacketView *frame);
+    
+    /** Takes every complete frame off the front of the buffer. */
+    PacketList * parsePackets(ReceiveBuffer *clientBuffer);
 
 private:
-    /** Generates a packet with the given payload. */
-    Packet * makePacket(char messageType, unsigned char *payload, size_t payloadLength);
+    /** Generates a packet with a zeroed payload for the caller to encode into. */
+    Packet * makePacket(char messageType, size_t payloadLength);
 };
 
 class UDPHandler {
@@ -582,6 +1134,9 @@ public:
     void send(UDPPacket *packet);
 
     bool receive(fd_set readfds, bool (*handlerFunction)(UDPPacket *));
+    
+    /** Reads and handles every datagram queued on the socket without blocking. */
+    void receiveAll(bool (*handlerFunction)(UDPPacket *));
 
     UDPPacket * parsePacket(unsigned char *readBytes, size_t bytesRead,
             struct sockaddr_in *sin);
@@ -602,13 +1157,13 @@ public:
 
     UDPPacket * makeServerAreaResponse(uint32_t ip, uint16_t port,
         uint32_t msgID, const char *serverIP, uint16_t serverTCPPort,
-        uint8_t minX, uint8_t maxX, uint8_t minY, uint8_t maxY);
+        coord_t minX, coord_t maxX, coord_t minY, coord_t maxY);
         
     UDPPacket * makePlayerStateRequest(uint32_t ip, uint16_t port, 
         uint32_t msgID, char *playerName);
 
     UDPPacket * makePlayerStateResponse(uint32_t ip, uint16_t port, 
-        uint32_t msgID, char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+        uint32_t msgID, char *playerName, int hp, int exp, coord_t x, coord_t y);
 
     UDPPacket * makeSaveStateRequest(int32_t ip, uint16_t port,
         uint32_t msgID, char *playerName, int hp, int exp, struct location loc);
@@ -620,38 +1175,70 @@ public:
             uint32_t msgID, unsigned char *payload, size_t payloadLength);
 
 private:    
+    /** Handles one datagram. Returns true if the handler says we are done. */
+    bool dispatch(unsigned char *readBytes, int bytesRead, struct sockaddr_in *sin,
+        bool (*handlerFunction)(UDPPacket *));
+    
     int mySocket;
     bool myResend, myIgnoreDups, myIsTracker;
     UDPPacket *myLastSentPacket;
     UDPPacketList *myReceiveHistory;
 };
 
+/** Outbound packets come from here: the Packet and its bytes in one block,
+ *  taken from and returned to free lists of the calling thread. A packet 
+ *  released on another shard's thread joins that thread's lists. */
+class PacketPool {
+public:
+    /** A packet with room for length bytes, recycled if one fits. */
+    static Packet * allocate(size_t length);
+    
+    static void recycle(Packet *packet);
+};
+
 class Packet {
 public:
     Packet(unsigned char *message, size_t size) {
         packet = message;
         length = size;
+        references = 1;
+        sizeClass = -1;
     }
     
     virtual ~Packet() {
         free(packet);
     }
     
+    /** An outbound packet is encoded once and then shared, read only, by 
+     *  every output queue it sits in, possibly on other shards' threads.
+     *  The last holder to release it frees it. */
+    void retain() {
+        __sync_fetch_and_add(&references, 1);
+    }
+    
+    void release() {
+        if (__sync_sub_and_fetch(&references, 1) == 0) {
+            if (sizeClass >= 0) {
+                PacketPool::recycle(this);
+            } else {
+                delete this;
+            }
+        }
+    }
+    
     virtual uint8_t msgType() {
         return (uint8_t) packet[sizeof(tww_packet_header) - 1];
     }
     
     void print() {
-        printf("msg ver:%d len:%lu type:%d raw_pkt(net_byte_order)=[",
-                packet[0], length, msgType());
-        for (int i = 0; i < length; i++) {
-            printf("%02x ", packet[i]);
-        }
-        printf("]\n");
+        printPacketBytes(packet, length, msgType());
     }
     
     unsigned char *packet;
     size_t length;
+    int references;
+    /* The PacketPool block this lives in, or -1 if it was allocated alone. */
+    int sizeClass;
 };
 
 class UDPPacket : public Packet {
@@ -685,6 +1272,66 @@ public:
     struct timeval timeSent;
 };
 
+/** An inbound frame, read where it lies in the connection's receive buffer.
+ *  Handlers may change it in place but must not keep it. */
+class PacketView {
+public:
+    uint8_t msgType() {
+        return (uint8_t) packet[sizeof(tww_packet_header) - 1];
+    }
+    
+    void print() {
+        printPacketBytes(packet, length, msgType());
+    }
+    
+    unsigned char *packet;
+    size_t length;
+};
+
+/** The bytes a connection has received but not yet parsed. A ring, so that
+ *  recv can write straight into it and frames come off the front without
+ *  moving what is left; it only grows for a frame bigger than itself. */
+class ReceiveBuffer {
+public:
+    ReceiveBuffer(size_t capacity);
+    
+    ~ReceiveBuffer();
+    
+    /** The free space after the buffered bytes, as one contiguous block. */
+    unsigned char * writeSpace(size_t *space);
+    
+    /** Adds the bytes just written into writeSpace. */
+    void commit(size_t length);
+    
+    void append(unsigned char *bytes, size_t length);
+    
+    /** The first length bytes, made contiguous if they wrap around. Stays
+     *  valid until the buffer is next written to. */
+    unsigned char * front(size_t length);
+    
+    void drop(size_t length);
+    
+    /** Makes room for at least capacity buffered bytes. */
+    void reserve(size_t capacity);
+    
+    size_t size() {
+        return myTail - myHead;
+    }
+    
+    unsigned char at(size_t offset) {
+        return myBytes[(myHead + offset) & (myCapacity - 1)];
+    }
+
+private:
+    /* myCapacity bytes of ring, then as many again for front() to unwrap
+       a frame into. */
+    unsigned char *myBytes;
+    /* Always a power of two. */
+    size_t myCapacity;
+    /* Free running; only their difference and their values mod myCapacity matter. */
+    size_t myHead, myTail;
+};
+
 
 /** Game */
 
@@ -692,7 +1339,9 @@ class Dungeon {
 public:
     Dungeon(unsigned int width, unsigned int height);
 
-    void addPlayer(Player *player);
+    /** owner is whatever the caller wants ownerAt to say about the player,
+     *  such as the socket of its client, or NO_OWNER. */
+    void addPlayer(Player *player, int owner);
     
     void removePlayer(Player *player);
     
@@ -700,8 +1349,15 @@ public:
     void clear(Player *mainPlayer);
     
     void movePlayer(Player *player, int direction);
+    
+    /** Puts the player at loc, wherever it was before. */
+    void placePlayer(Player *player, struct location loc);
+    
+    /** Appends every player that changed since it was last saved to users,
+     *  and counts them as saved. */
+    void takeUnsavedPlayers(UserDataList &users);
         
-    void setBoundary(uint8_t min_x,uint8_t min_y, uint8_t max_x, uint8_t max_y);
+    void setBoundary(coord_t min_x, coord_t min_y, coord_t max_x, coord_t max_y);
     
     void computeMovePlayer(struct location oldLocation, int direction,
         struct location *newLocation);
@@ -713,39 +1369,152 @@ public:
     /** Is otherPlayer in the vision of player? */
     bool inVision(Player *player, Player *otherPlayer);
     
+    /** Are the locations within VISION_RANGE of each other? Unlike inVision
+     *  this ignores the server boundary. */
+    bool inRange(struct location loc, struct location otherLoc);
+    
     Player *findPlayer(char *name);
     
     bool locationOccupied(int x, int y);
     
+    /** Appends the players other than player that it can see, through
+     *  playersWithin. */
     void playersInRangeOf(Player *player, PlayerList &players);
     
-    void incrementHPForAllPlayers();
+    /** The squares in range of loc, ignoring the server boundary. */
+    struct bounds visionOf(struct location loc);
+    
+    /** Sets found to the indexes of the players inside either bounds. Only looks in
+     *  the grid cells the bounds cover, testing a whole vector of positions
+     *  at a time where the CPU allows. */
+    void playersWithin(struct bounds *first, struct bounds *second, std::vector<int> &found);
+    
+    Player * playerAt(int i) {
+        return myPlayers->at(i);
+    }
+    
+    int ownerAt(int i) {
+        return myOwners[i];
+    }
     
     void print();
     
+    /* Snapshots. The thread that owns the Dungeon publishes them; any thread
+       may read them, without locks, while that thread carries on. */
+    
+    /** Copies the players and their cells into a new snapshot for readers,
+     *  then frees the old snapshots no reader can still be looking at. */
+    void publishSnapshot();
+    
+    /** A reader slot for startReading. Each reading thread takes its own. */
+    int addSnapshotReader();
+    
+    /** The latest snapshot, or NULL if none has been published. It stays
+     *  valid until the reader calls stopReading. */
+    DungeonSnapshot * startReading(int reader);
+    
+    void stopReading(int reader);
+    
 private:
     int findPlayerIndex(char *name);
     
+    /** Where name sits in myIndex, or the free slot it would go in. */
+    unsigned int findSlot(char *name);
+    
+    void indexPlayer(int i);
+    
+    /** Frees the slot, pulling later entries of its probe run back into it. */
+    void unindexSlot(unsigned int slot);
+    
+    void growIndex();
+    
+    /** Swaps the last player into i, so nothing has to be shifted down. */
+    void removePlayerAt(int i);
+    
+    /** The squares in range of loc that are also inside the boundary. */
+    struct bounds clippedVisionOf(struct location loc);
+    
+    /** The grid column and row holding x and y. Locations off the map go
+     *  in the nearest edge cell, so every query still finds them. */
+    unsigned int columnOf(int x);
+    unsigned int rowOf(int y);
+    
+    /** The grid cell at column and row, or NULL if nobody is in it. */
+    struct grid_cell * cellAt(unsigned int column, unsigned int row);
+    
+    struct grid_chunk ** chunkAt(unsigned int column, unsigned int row);
+    
+    /** Adds the player at myPlayers[i] to the cell holding its location. */
+    void addToCell(int i);
+    
+    /** Takes the player out of its cell, returning where it was in myPlayers,
+     *  or -1 if it isn't in the Dungeon. */
+    int removeFromCell(Player *player);
+    
     unsigned int myWidth, myHeight;
-    uint8_t myMinX, myMaxX, myMinY, myMaxY;
+    coord_t myMinX, myMaxX, myMinY, myMaxY;
 
     PlayerList *myPlayers;
+    /* Open addressing with linear probing, at most half full. */
+    struct player_slot *myIndex;
+    unsigned int myIndexSize;
+    /* Cells of GRID_CELL_SIZE squares, grouped into chunks, row by row.
+       Both are allocated as players arrive and freed once they leave, so
+       memory goes with where people are rather than with the world size. */
+    struct grid_chunk **myChunks;
+    unsigned int myGridWidth, myGridHeight;
+    unsigned int myChunksWide, myChunksHigh;
+    /* Parallel to myPlayers. */
+    std::vector<int> myOwners;
+    /* Epoch based reclamation. Each reader slot holds the epoch its reader
+       started in, or 0 if it isn't reading. A replaced snapshot is freed
+       once every reader started in or after the epoch that replaced it. */
+    DungeonSnapshot *mySnapshot;
+    uint64_t myEpoch;
+    uint64_t myReaderEpochs[MAX_SNAPSHOT_READERS];
+    int myNumReaders;
+    std::vector<DungeonSnapshot *> myRetiredSnapshots;
+};
+
+/** An immutable copy of a Dungeon's players, grouped by grid cell in key
+ *  order, so that readers on other threads can still search it by area. */
+class DungeonSnapshot {
+public:
+    DungeonSnapshot(unsigned int gridWidth, unsigned int gridHeight);
+    
+    /** Sets found to the indexes of the players inside area. */
+    void playersWithin(struct bounds *area, std::vector<int> &found);
+    
+    unsigned int size() {
+        return myPlayers.size();
+    }
+    
+    struct snapshot_player * playerAt(int i) {
+        return &myPlayers[i];
+    }
+    
+    std::vector<struct snapshot_player> myPlayers;
+    std::vector<struct snapshot_cell> myCells;
+    unsigned int myGridWidth, myGridHeight;
+    /* The epoch in which a newer snapshot replaced this one. */
+    uint64_t myRetiredAt;
 };
 
 class Player {
 public:
     Player(char *playerName, int hp, int exp, struct location loc) {
-        size_t length = strlen(playerName) + 1;
-        myName = (char *) malloc(length);
-        strncpy(myName, playerName, length);
+        strncpy(myName, playerName, MAX_LOGIN_LENGTH + 1);
+        null_terminate(myName, MAX_LOGIN_LENGTH);
         myHp = hp;
+        myHpTime = monotonicMillis();
         myExp = exp;
         myLocation = loc;
+        myHandle = NO_PLAYER_HANDLE;
+        myUnsaved = false;
     }
     
     ~Player() {
         debug("deleted player %s", myName);
-        free(myName);
     }
     
     void print() {
@@ -753,25 +1522,77 @@ public:
             myName, myHp, myExp, myLocation.x, myLocation.y);
     }
 
-    char *myName;
+    /** HP regenerates a point every HP_REGEN_INTERVAL_MS, up to HP_REGEN_MAX.
+        It is worked out when read, so idle players cost nothing. */
+    int hp() {
+        return hpAt(monotonicMillis());
+    }
+    
+    int hpAt(uint64_t now) {
+        if (myHp >= HP_REGEN_MAX) {
+            return myHp;
+        }
+        uint64_t points = (now - myHpTime) / HP_REGEN_INTERVAL_MS;
+        if (points >= (uint64_t) ((int64_t) HP_REGEN_MAX - myHp)) {
+            return HP_REGEN_MAX;
+        }
+        return myHp + (int) points;
+    }
+
+    void setHp(int hp) {
+        /* Keep the time already spent towards the next point. */
+        uint64_t now = monotonicMillis();
+        myHpTime = now - (now - myHpTime) % HP_REGEN_INTERVAL_MS;
+        myHp = hp;
+        myUnsaved = true;
+    }
+
+    char myName[MAX_LOGIN_LENGTH + 1];
+    /* HP as of myHpTime. Clients only track what the server reports. */
     int myHp, myExp;
+    uint64_t myHpTime;
     struct location myLocation;
+    /* Where PlayerSlab keeps it, or NO_PLAYER_HANDLE if it came from new. */
+    player_handle_t myHandle;
+    /* Changed since the server last saved it. Regeneration alone does not
+       count; it goes out with the next change. */
+    bool myUnsaved;
+};
+
+/** The server's players live here, in chunks that never move or go away.
+ *  A freed slot's generation goes up, so handles to whoever used it before
+ *  stop resolving instead of pointing at the next player. Shared by all 
+ *  shards; only allocate and release take the lock. */
+class PlayerSlab {
+public:
+    static Player * allocate(char *playerName, int hp, int exp, struct location loc);
+    
+    static void release(Player *player);
+    
+    /** The player handle refers to, or NULL if it has been released since. */
+    static Player * lookup(player_handle_t handle);
 };
 
 /** Responsible for making and deleting players, and keeping player state on disk. */
 class PlayerFactory {
 public:
     PlayerFactory();
+    
+    /** Where newPlayerFromFile and savePlayer keep player data. Only the
+     *  server that stores players has one. */
+    void useStore(PlayerStore *store);
 
     /** Creates a player with the given name. Player data is either loaded from
-     *  disk or generated randomly and saved to disk. */
+     *  the store or generated randomly and saved to it. Returns NULL, and
+     *  leaves the store alone, if the player's record is damaged. */
     Player * newPlayerFromFile(char *playerName);
     
     /** Creates a new player with the given state. */
-    Player * newPlayer(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    Player * newPlayer(char *playerName, int hp, int exp, coord_t x, coord_t y);
     
-    /** Saves the player's data to a file on disk. */
-    bool savePlayer(char *playerName, int hp, int exp, uint8_t x, uint8_t y);
+    /** Saves the player's data to the store, returning the save's number
+     *  there. */
+    uint64_t savePlayer(char *playerName, int hp, int exp, coord_t x, coord_t y);
         
     /** Deletes the player. */
     void destroyPlayer(Player *player);
@@ -782,12 +1603,302 @@ private:
     int randomHP(int low, int high);
     
     struct location randomLocation();
+    
+    PlayerStore *myStore;
 };
 
+/** A player's record in the PlayerStore cache. */
+struct store_record {
+    struct p2p_user_data user;
+    /* Changed since it was last written to disk. */
+    bool dirty;
+    /* In the batch the writer is committing. */
+    bool writing;
+    /* Its name's place in PlayerStore::myRecent. */
+    std::list<std::string>::iterator recent;
+};
+
+/** Player records, kept in a PlayerFile behind a write-back cache. Saves
+ *  only mark a record dirty. Records read or saved stay in memory until
+ *  more than STORE_MAX_CACHED are, and then the least recently used clean
+ *  ones are dropped.
+ *  A writer thread commits the dirty records in batches: one write and
+ *  one sync for however many saves came in while the last batch was
+ *  going to disk. Each save is numbered, and each batch's commit_result
+ *  says up to which number it was made durable. A batch that cannot be
+ *  written is retried, and after STORE_MAX_ATTEMPTS given up on, its
+ *  records going back to what is on disk. */
+class PlayerStore {
+public:
+    /** Keeps records in a PlayerLog or, given PLAYERS_TABLE, a PlayerTable.
+     *  The writer waits commitDelay milliseconds after a save for others
+     *  to join its batch. */
+    PlayerStore(int format, unsigned int commitDelay);
+    
+    /** Sets user to name's record and returns RECORD_FOUND, or returns
+     *  RECORD_MISSING or RECORD_DAMAGED as PlayerFile::read does. */
+    int load(char *name, struct p2p_user_data *user);
+    
+    /** Returns the save's number. */
+    uint64_t save(struct p2p_user_data *user);
+    
+    /** Saves every one of users at once, returning the last one's number. */
+    uint64_t saveAll(UserDataList &users);
+    
+    /** Appends every record, saved or not, whose name's P2P ID is from min
+     *  to max to users. Records not cached are read from the file as they
+     *  are, and stay out of the cache. */
+    void loadInRange(uint16_t min, uint16_t max, UserDataList &users);
+    
+    /** Moves the results of the batches finished since the last call, in
+     *  order, to results. */
+    void takeResults(CommitResultList &results);
+    
+    /** An eventfd that is signalled whenever a batch finishes. */
+    int commitEvent();
+    
+    /** Commits everything saved so far and stops the writer. Returns
+     *  false if some of it could not be written. */
+    bool close();
+    
+    /** The writer thread. */
+    void runWriter();
+    
+private:
+    /* Brings the one-file-per-player USERS_DIRECTORY of older servers into
+       an empty file. */
+    void importUserFiles();
+    
+    static bool inP2PRange(char *name, uint16_t min, uint16_t max);
+    
+    /* name's record, made empty if it is not cached, as the most recently
+       used. */
+    struct store_record * touch(const std::string &name);
+    
+    /* Drops clean records, least recently used first, down to
+       STORE_MAX_CACHED. */
+    void evict();
+    
+    PlayerFile *myFile;
+    unsigned int myCommitDelay;
+    
+    /* myLock covers the cache and the counters; myFileLock, myFile. */
+    pthread_mutex_t myLock;
+    pthread_mutex_t myFileLock;
+    pthread_cond_t myWork;
+    std::map<std::string, struct store_record> myRecords;
+    /* The cached names, most recently used first. */
+    std::list<std::string> myRecent;
+    std::vector<std::string> myDirtyNames;
+    uint64_t mySaved;
+    CommitResultList myResults;
+    bool myClosing;
+    pthread_t myWriter;
+    int myCommitEvent;
+};
+
+/** The start of a PlayerLog file. The records follow it. */
+struct log_header {
+    uint32_t magic;
+    /* That of every record in the file. */
+    uint8_t version;
+    uint8_t padding[3];
+} __attribute((packed));
+
+/** Where a PlayerStore keeps its records on disk. */
+class PlayerFile {
+public:
+    virtual ~PlayerFile() {}
+    
+    /** Sets user to name's record and returns RECORD_FOUND, or returns
+     *  RECORD_MISSING if there is none or RECORD_DAMAGED if it cannot be
+     *  decoded. */
+    virtual int read(char *name, struct p2p_user_data *user) = 0;
+    
+    /** Writes count records, replacing any with the same names. */
+    virtual bool write(struct p2p_user_data *users, unsigned int count) = 0;
+    
+    /** Appends the name of every player in the file. */
+    virtual void names(std::vector<std::string> &names) = 0;
+    
+    /** Housekeeping, called after each batch is written and synced. */
+    virtual void maintain() = 0;
+    
+    /** Puts everything written so far on disk. */
+    virtual bool sync() = 0;
+};
+
+/** Every player in one append-only file of fixed size records. The latest
+ *  record for each name is the live one; an index in memory says where it
+ *  is. Once dead records outweigh live ones, a thread copies the live ones
+ *  to a new file, which then takes the old one's place. */
+class PlayerLog : public PlayerFile {
+public:
+    /** Opens fileName, creating it if needed, and indexes it. */
+    PlayerLog(const char *fileName);
+    
+    int read(char *name, struct p2p_user_data *user);
+    
+    /** Appends count records with a single write. */
+    bool write(struct p2p_user_data *users, unsigned int count);
+    
+    void names(std::vector<std::string> &names);
+    
+    /** Starts a compaction if one is worthwhile, or finishes one whose
+     *  thread is done. */
+    void maintain();
+    
+    bool sync();
+    
+    /** The compaction thread. */
+    void runCompaction();
+    
+private:
+    void finishCompaction();
+    
+    std::string myFileName;
+    int myFile;
+    off_t myEnd;
+    /* A compaction renamed its file in, but the directory is not on disk
+       yet, so a crash could bring back the old log. */
+    bool myDirectoryUnsynced;
+    std::map<std::string, off_t> myIndex;
+    
+    /* Compaction. The thread only touches the compacted file, its index,
+       and myCompactionSources, until it sets myCompactionDone. */
+    bool myCompacting;
+    pthread_t myCompactor;
+    int myCompactionDone;
+    bool myCompactionFailed;
+    std::vector<off_t> myCompactionSources;
+    off_t myCompactionStart;
+    int myCompactedFile;
+    off_t myCompactedEnd;
+    std::map<std::string, off_t> myCompactedIndex;
+};
+
+/** The start of a PlayerTable file, in network byte order like the
+ *  records after it. */
+struct table_header {
+    uint32_t magic;
+    /* Always a power of two. */
+    uint32_t numSlots;
+    uint32_t numUsed;
+} __attribute((packed));
+
+/** Every player in a memory-mapped, open-addressed hash table of fixed
+ *  size slots. Reads and writes are a probe and a copy, with no system
+ *  calls until sync msyncs the table. Past half full, it is rehashed
+ *  into a file twice the size.
+ *
+ *  Unlike the log, a save overwrites its player's slot in place. A crash
+ *  while the kernel writes that page back can tear the slot and lose a
+ *  record that was already acknowledged; its checksum then shows it as
+ *  damaged rather than letting it be read. */
+class PlayerTable : public PlayerFile {
+public:
+    /** Opens fileName, creating an empty table if needed, and maps it. */
+    PlayerTable(const char *fileName);
+    
+    int read(char *name, struct p2p_user_data *user);
+    
+    bool write(struct p2p_user_data *users, unsigned int count);
+    
+    void names(std::vector<std::string> &names);
+    
+    void maintain();
+    
+    bool sync();
+    
+private:
+    static size_t tableLength(uint32_t numSlots);
+    
+    /** Puts an empty table at myFileName. */
+    void createTable();
+    void makeTable(int file, uint32_t numSlots);
+    void mapTable(uint32_t numSlots);
+    
+    /** Name's slot in slots, or the empty slot where it would go. */
+    struct player_record * findSlot(struct player_record *slots, uint32_t numSlots, char *name);
+    
+    bool grow();
+    
+    std::string myFileName;
+    int myFile;
+    struct table_header *myHeader;
+    /* myHeader's counts, in host byte order. */
+    uint32_t myNumSlots;
+    uint32_t myNumUsed;
+    /* A slot is empty while its name is. */
+    struct player_record *mySlots;
+    size_t myLength;
+    bool myUnsynced;
+};
+
+
+/** Which shard owns each logged in player. Shared by all shards of a server. */
+class PlayerDirectory {
+public:
+    PlayerDirectory();
+    
+    /** Claims the name for shard. Returns false if it is already taken. */
+    bool reserve(char *name, int shard);
+    
+    void update(char *name, int shard);
+    
+    void remove(char *name);
+    
+    /** Returns the shard owning the player, or -1 if nobody has that name. */
+    int shardOf(char *name);
+    
+private:
+    pthread_mutex_t myLock;
+    std::map<std::string, int> myShards;
+};
+
+#ifdef USE_IO_URING
+/** A bare io_uring instance, driven through the raw system calls. Receives
+ *  land in a ring of provided buffers registered with the kernel. */
+class URing {
+public:
+    URing(unsigned int entries);
+    
+    /** Returns a zeroed submission entry, submitting what is queued if the
+     *  ring is full. */
+    struct io_uring_sqe * nextSqe();
+    
+    /** Submits what is queued and waits up to timeout milliseconds (-1 for
+     *  ever) for a completion. */
+    void submitAndWait(int timeout);
+    
+    /** Copies out the next completion. Returns false if there is none. */
+    bool nextCompletion(struct io_uring_cqe *cqe);
+    
+    unsigned char * buffer(unsigned int bufferID);
+    
+    /** Gives a buffer back to the kernel once its contents are consumed. */
+    void recycleBuffer(unsigned int bufferID);
+    
+private:
+    int enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, 
+        struct io_uring_getevents_arg *arg);
+    
+    int myRingSocket;
+    unsigned int *mySqHead, *mySqTail, *mySqArray;
+    unsigned int mySqMask, mySqEntries, mySqPending;
+    struct io_uring_sqe *mySqes;
+    unsigned int *myCqHead, *myCqTail;
+    unsigned int myCqMask;
+    struct io_uring_cqe *myCqes;
+    struct io_uring_buf_ring *myBufferRing;
+    uint16_t myBufferTail;
+    unsigned char *myBuffers;
+};
+#endif
 
 class Peers {
 public:
-    Peers(std::string filename, ServerEntry *thisServer);
+    Peers(std::string filename, ServerEntry *thisServer, PlayerStore *store);
 
     /** Reads peers.lst, updates my peers and adds this server to the list. */
     void readPeers();
@@ -802,9 +1913,14 @@ public:
     
     ServerEntry *findPredecessor(ServerEntry *server);
     
+    /** The server whose primary range holds p2pID, or NULL if there are
+     *  no servers yet. */
+    ServerEntry *ownerOf(uint32_t p2pID);
+    
     UserDataList *findUsersInRange(uint16_t min, uint16_t max);
 
-    bool writeUserDataToDisk(struct p2p_user_data);
+    /** Returns the save's number in the PlayerStore. */
+    uint64_t writeUserDataToDisk(struct p2p_user_data);
     
 private:
     /** Clears the list of peers, making sure not to clear myServer. */
@@ -814,12 +1930,11 @@ private:
     
     int findServerIndex(ServerEntry *server);
     
-    struct p2p_user_data loadUser(char *name);
-    
     ServerEntryList *myPeers;
     ServerEntry *myServer;
     std::string myFileName;
     bool myFirstTimeRead;
+    PlayerStore *myStore;
 };
 
 #endif
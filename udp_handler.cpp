@@ -42,7 +42,6 @@ bool UDPHandler::receive(fd_set readfds, bool (*handlerFunction)(UDPPacket *)) {
     struct timeval currentTime, timeDiff;
     
     if (FD_ISSET(mySocket, &readfds)) {
-        bool dup = false;
         struct sockaddr_in sin;
 
         socklen_t sin_len = sizeof(struct sockaddr_in);
@@ -57,43 +56,8 @@ bool UDPHandler::receive(fd_set readfds, bool (*handlerFunction)(UDPPacket *)) {
             }
         }
         
-        UDPPacket *udpPacket = parsePacket(readBytes, bytesRead, &sin);
-        if (udpPacket) {
-            registerInReceiveHistory(udpPacket);
-            dup = isDuplicatePacket(udpPacket);
-            if (dup && !myIgnoreDups) {
-                if (myIsTracker) {
-                    tracker_on_udp_duplicate(udpPacket->ip);
-                } else {
-                    on_udp_duplicate(udpPacket->ip);                    
-                }
-            }
-        }
-        
-        if (!(dup && myIgnoreDups)) {
-            if (myResend && myLastSentPacket) {
-                if (udpPacket->id() != myLastSentPacket->id()) {
-                    on_malformed_udp();
-                }
-                
-                if (udpPacket->ip != myLastSentPacket->ip ||
-                    udpPacket->port != myLastSentPacket->port) {
-                    on_invalid_udp_source();
-                }
-                
-                delete myLastSentPacket;
-                myLastSentPacket = NULL;
-            }
-
-            bool done;
-            try {
-                done = handlerFunction(udpPacket);
-            } catch (int e) {
-                on_malformed_udp();
-            }
-            if (done) {
-                return true;
-            }                
+        if (dispatch(readBytes, bytesRead, &sin, handlerFunction)) {
+            return true;
         }
     }
     
@@ -111,6 +75,76 @@ bool UDPHandler::receive(fd_set readfds, bool (*handlerFunction)(UDPPacket *)) {
     return false;
 }
 
+void UDPHandler::receiveAll(bool (*handlerFunction)(UDPPacket *)) {
+    unsigned char readBytes[4096];
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    int bytesRead;
+
+    /* The socket is watched edge-triggered, so keep reading until the
+       kernel has nothing left for us. */
+    while (true) {
+        sin_len = sizeof(struct sockaddr_in);
+        bytesRead = recvfrom(mySocket, readBytes, MAX_PACKET_LENGTH, MSG_DONTWAIT,
+                                (struct sockaddr *) &sin, &sin_len);
+        if (bytesRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            on_malformed_udp();
+            exit(1);
+        }
+        
+        dispatch(readBytes, bytesRead, &sin, handlerFunction);
+    }
+}
+
+bool UDPHandler::dispatch(unsigned char *readBytes, int bytesRead, struct sockaddr_in *sin,
+        bool (*handlerFunction)(UDPPacket *)) {
+    bool dup = false;
+    
+    UDPPacket *udpPacket = parsePacket(readBytes, bytesRead, sin);
+    if (udpPacket) {
+        registerInReceiveHistory(udpPacket);
+        dup = isDuplicatePacket(udpPacket);
+        if (dup && !myIgnoreDups) {
+            if (myIsTracker) {
+                tracker_on_udp_duplicate(udpPacket->ip);
+            } else {
+                on_udp_duplicate(udpPacket->ip);                    
+            }
+        }
+    }
+    
+    if (!(dup && myIgnoreDups)) {
+        if (myResend && myLastSentPacket) {
+            if (udpPacket->id() != myLastSentPacket->id()) {
+                on_malformed_udp();
+            }
+            
+            if (udpPacket->ip != myLastSentPacket->ip ||
+                udpPacket->port != myLastSentPacket->port) {
+                on_invalid_udp_source();
+            }
+            
+            delete myLastSentPacket;
+            myLastSentPacket = NULL;
+        }
+
+        bool done;
+        try {
+            done = handlerFunction(udpPacket);
+        } catch (int e) {
+            on_malformed_udp();
+        }
+        if (done) {
+            return true;
+        }                
+    }
+    
+    return false;
+}
+
 UDPPacket * UDPHandler::parsePacket(unsigned char *readBytes, size_t bytesRead,
         struct sockaddr_in *sin) {
     uint32_t ip = ntohl(sin->sin_addr.s_addr);
@@ -231,8 +265,8 @@ UDPPacket * UDPHandler::makeServerAreaRequest(uint32_t ip, uint16_t port,
         uint32_t msgID, struct location loc) {
     struct udp_server_area_request payload;
     memset(&payload, 0, sizeof(payload));
-    payload.x = loc.x;
-    payload.y = loc.y;
+    payload.x = hton_coord(loc.x);
+    payload.y = hton_coord(loc.y);
         
     unsigned char payloadBytes[sizeof(payload)];
     memcpy(payloadBytes, &payload, sizeof(payload));
@@ -243,16 +277,16 @@ UDPPacket * UDPHandler::makeServerAreaRequest(uint32_t ip, uint16_t port,
 
 UDPPacket * UDPHandler::makeServerAreaResponse(uint32_t ip, uint16_t port,
         uint32_t msgID, const char *serverIP, uint16_t serverTCPPort,
-        uint8_t minX, uint8_t maxX, uint8_t minY, uint8_t maxY) {
+        coord_t minX, coord_t maxX, coord_t minY, coord_t maxY) {
     struct udp_server_area_response payload;
     memset(&payload, 0, sizeof(payload));
 
     payload.server_ip_address = inet_addr(serverIP);
     payload.server_tcp_port = htons(serverTCPPort);
-    payload.min_x = minX;
-    payload.max_x = maxX;
-    payload.min_y = minY;
-    payload.max_y = maxY;
+    payload.min_x = hton_coord(minX);
+    payload.max_x = hton_coord(maxX);
+    payload.min_y = hton_coord(minY);
+    payload.max_y = hton_coord(maxY);
     
     unsigned char payloadBytes[sizeof(payload)];
     memcpy(payloadBytes, &payload, sizeof(payload));
@@ -276,15 +310,15 @@ UDPPacket * UDPHandler::makePlayerStateRequest(uint32_t ip, uint16_t port,
 }
 
 UDPPacket * UDPHandler::makePlayerStateResponse(uint32_t ip, uint16_t port, 
-        uint32_t msgID, char *playerName, int hp, int exp, uint8_t x, uint8_t y) {
+        uint32_t msgID, char *playerName, int hp, int exp, coord_t x, coord_t y) {
     struct udp_player_state_response payload;
     memset(&payload, 0, sizeof(payload));
     strncpy(payload.name, playerName, strlen(playerName) + 1);
     null_terminate(payload.name, strlen(playerName));
     payload.hp = htonl(hp);
     payload.exp = htonl(exp);
-    payload.x = x;
-    payload.y = y;
+    payload.x = hton_coord(x);
+    payload.y = hton_coord(y);
 
     unsigned char payloadBytes[sizeof(payload)];
     memcpy(payloadBytes, &payload, sizeof(payload));
@@ -302,8 +336,8 @@ UDPPacket * UDPHandler::makeSaveStateRequest(int32_t ip, uint16_t port,
     null_terminate(payload.name, strlen(playerName));
     payload.hp = htonl(hp);
     payload.exp = htonl(exp);
-    payload.x = loc.x;
-    payload.y = loc.y;
+    payload.x = hton_coord(loc.x);
+    payload.y = hton_coord(loc.y);
 
     unsigned char payloadBytes[sizeof(payload)];
     memcpy(payloadBytes, &payload, sizeof(payload));
@@ -0,0 +1,470 @@
+#include "tww.h"
+
+#ifdef USE_IO_URING
+
+using namespace std;
+
+/* user_data is the operation in the top byte, then the connection key: a
+   24 bit generation above the 32 bit descriptor. */
+static uint64_t uringUserData(int operation, uint64_t key) {
+    return ((uint64_t) operation << 56) | key;
+}
+
+static int uringOperationOf(uint64_t userData) {
+    return userData >> 56;
+}
+
+static uint64_t uringKeyOfUserData(uint64_t userData) {
+    return userData & 0xffffffffffffffULL;
+}
+
+static int uringSocketOf(uint64_t key) {
+    return (int) (uint32_t) key;
+}
+
+/****** URing ******/
+
+URing::URing(unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    /* Multishot receives can post many completions per submission. */
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    myRingSocket = syscall(__NR_io_uring_setup, entries, &params);
+    if (myRingSocket < 0) {
+        debug("io_uring_setup failed: %s", strerror(errno));
+        on_server_failure();
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        debug("io_uring is too old");
+        on_server_failure();
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    unsigned char *rings = (unsigned char *) mmap(NULL, max(sqSize, cqSize), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, myRingSocket, IORING_OFF_SQ_RING);
+    mySqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, myRingSocket, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || mySqes == MAP_FAILED) {
+        on_server_failure();
+    }
+
+    mySqHead = (unsigned int *) (rings + params.sq_off.head);
+    mySqTail = (unsigned int *) (rings + params.sq_off.tail);
+    mySqArray = (unsigned int *) (rings + params.sq_off.array);
+    mySqMask = *(unsigned int *) (rings + params.sq_off.ring_mask);
+    mySqEntries = params.sq_entries;
+    mySqPending = 0;
+    myCqHead = (unsigned int *) (rings + params.cq_off.head);
+    myCqTail = (unsigned int *) (rings + params.cq_off.tail);
+    myCqMask = *(unsigned int *) (rings + params.cq_off.ring_mask);
+    myCqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+    /* Submission entries are always used in order. */
+    for (unsigned int i = 0; i < mySqEntries; i++) {
+        mySqArray[i] = i;
+    }
+
+    myBufferRing = (struct io_uring_buf_ring *) mmap(NULL, URING_NUM_BUFFERS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (myBufferRing == MAP_FAILED) {
+        on_server_failure();
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) myBufferRing;
+    registration.ring_entries = URING_NUM_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, myRingSocket, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        debug("cannot register the receive buffers: %s", strerror(errno));
+        on_server_failure();
+    }
+
+    myBufferTail = 0;
+    myBuffers = (unsigned char *) malloc(URING_NUM_BUFFERS * URING_BUFFER_SIZE);
+    for (unsigned int i = 0; i < URING_NUM_BUFFERS; i++) {
+        recycleBuffer(i);
+    }
+}
+
+struct io_uring_sqe * URing::nextSqe() {
+    unsigned int tail = *mySqTail + mySqPending;
+    if (tail - __atomic_load_n(mySqHead, __ATOMIC_ACQUIRE) >= mySqEntries) {
+        submitAndWait(0);
+        tail = *mySqTail;
+    }
+
+    struct io_uring_sqe *sqe = &mySqes[tail & mySqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    mySqPending++;
+    return sqe;
+}
+
+void URing::submitAndWait(int timeout) {
+    unsigned int toSubmit = mySqPending;
+    __atomic_store_n(mySqTail, *mySqTail + mySqPending, __ATOMIC_RELEASE);
+    mySqPending = 0;
+
+    /* Don't sleep on completions that are already there. */
+    if (*myCqHead != __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE)) {
+        timeout = 0;
+    }
+
+    if (timeout == 0) {
+        if (toSubmit > 0) {
+            enter(toSubmit, 0, 0, NULL);
+        }
+        return;
+    }
+
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) &ts;
+    }
+    enter(toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+}
+
+int URing::enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags,
+    struct io_uring_getevents_arg *arg) {
+    int result = syscall(__NR_io_uring_enter, myRingSocket, toSubmit, minComplete, flags,
+        arg, arg ? sizeof(*arg) : 0);
+    if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        debug("io_uring_enter failed: %s", strerror(errno));
+        on_server_failure();
+    }
+    return result;
+}
+
+bool URing::nextCompletion(struct io_uring_cqe *cqe) {
+    unsigned int head = *myCqHead;
+    if (head == __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = myCqes[head & myCqMask];
+    __atomic_store_n(myCqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+unsigned char * URing::buffer(unsigned int bufferID) {
+    return myBuffers + bufferID * URING_BUFFER_SIZE;
+}
+
+void URing::recycleBuffer(unsigned int bufferID) {
+    /* Not myBufferRing->bufs: in C++ the header's flexible array member
+       lands after a padded empty struct rather than at offset 0. */
+    struct io_uring_buf *buf = (struct io_uring_buf *) myBufferRing + (myBufferTail & (URING_NUM_BUFFERS - 1));
+    buf->addr = (uint64_t) buffer(bufferID);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bufferID;
+    myBufferTail++;
+    __atomic_store_n(&myBufferRing->tail, myBufferTail, __ATOMIC_RELEASE);
+}
+
+/****** Server io_uring backend ******/
+
+void Server::makeURing() {
+    myURing = new URing(URING_ENTRIES);
+    myURingRound = 0;
+    myEpollSocket = -1;
+}
+
+void Server::runURing() {
+    struct io_uring_cqe cqe;
+
+    while (true) {
+        exitIfTerminating();
+        p2pSetup();
+
+        /* One system call both submits everything the last round queued
+           and waits for more to do. */
+        myURing->submitAndWait(pollTimeout());
+        myURingRound++;
+        while (myURing->nextCompletion(&cqe)) {
+            handleCompletion(&cqe);
+        }
+
+        runDueTick();
+        settleClients();
+        publishDueSnapshot();
+        autosaveIfDue();
+    }
+}
+
+void Server::handleCompletion(struct io_uring_cqe *cqe) {
+    uint64_t key = uringKeyOfUserData(cqe->user_data);
+    int socket = uringSocketOf(key);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (uringOperationOf(cqe->user_data)) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                struct sockaddr_in client_sin;
+                socklen_t clientAddressLength = sizeof(client_sin);
+                getpeername(cqe->res, (struct sockaddr *) &client_sin, &clientAddressLength);
+                fcntl(cqe->res, F_SETFL, fcntl(cqe->res, F_GETFL) | O_NONBLOCK);
+                welcomeClient(cqe->res, &client_sin);
+            }
+            if (!more) {
+                watchThroughURing(socket);
+            }
+            break;
+        case URING_POLL:
+            if (socket == myUDPSocket) {
+                debug("UDP socket receiving");
+                receiveFromUDP();
+            } else if (socket == myMailboxSocket) {
+                processMailbox();
+            } else if (myStore && socket == myStore->commitEvent()) {
+                answerCommittedSaves();
+            }
+            if (!more) {
+                watchThroughURing(socket);
+            }
+            break;
+        case URING_RECEIVE:
+            receivedThroughURing(key, cqe);
+            break;
+        case URING_SEND:
+            sentThroughURing(key, cqe->res);
+            break;
+        case URING_CANCEL:
+            break;
+        default:
+            debug("FAIL: unknown io_uring completion %llx", cqe->user_data);
+    }
+}
+
+uint64_t Server::uringKeyOf(int socket) {
+    return ((uint64_t) (myURingGenerations[socket] & 0xffffff) << 32) | (uint32_t) socket;
+}
+
+void Server::watchThroughURing(int socket) {
+    struct io_uring_sqe *sqe;
+    if (socket == myListeningSocket) {
+        sqe = myURing->nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = socket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = uringUserData(URING_ACCEPT, socket);
+        return;
+    }
+    if (!myClients.count(socket)) {
+        /* The UDP socket and the mailbox only need to say when to drain them. */
+        sqe = myURing->nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = socket;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = uringUserData(URING_POLL, socket);
+        return;
+    }
+
+    myURingGenerations[socket]++;
+    uint64_t key = uringKeyOf(socket);
+    struct uring_socket *uringSocket = &myURingSockets[key];
+    memset(uringSocket, 0, sizeof(*uringSocket));
+    uringSocket->socket = socket;
+    uringSocket->attached = true;
+
+    receiveThroughURing(key);
+    /* A client handed over from another shard may have output waiting. */
+    sendThroughURing(socket);
+}
+
+void Server::unwatchThroughURing(int socket) {
+    uint64_t key = uringKeyOf(socket);
+    map<uint64_t, struct uring_socket>::iterator uringSocketIter = myURingSockets.find(key);
+    if (uringSocketIter == myURingSockets.end()) {
+        return;
+    }
+
+    struct uring_socket *uringSocket = &uringSocketIter->second;
+    if (uringSocket->receiving) {
+        cancelThroughURing(URING_RECEIVE, key);
+    }
+    /* A client being thrown out may never read what is in flight, and the
+       ring keeps the socket open until the send gives up. */
+    map<int, struct client_data>::iterator clientDataIter = myClients.find(socket);
+    if (uringSocket->sending && clientDataIter != myClients.end() && clientDataIter->second.closing) {
+        cancelThroughURing(URING_SEND, key);
+    }
+    uringSocket->attached = false;
+    uringSocket->leaving = false;
+    /* The kernel looks the descriptor up at submission, so anything queued 
+       for it has to go in before the caller closes it. */
+    myURing->submitAndWait(0);
+    settleURingSocket(key);
+}
+
+void Server::receiveThroughURing(uint64_t key) {
+    struct io_uring_sqe *sqe = myURing->nextSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uringSocketOf(key);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uringUserData(URING_RECEIVE, key);
+    myURingSockets[key].receiving = true;
+}
+
+void Server::receivedThroughURing(uint64_t key, struct io_uring_cqe *cqe) {
+    int socket = uringSocketOf(key);
+    unsigned char *readBytes = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        readBytes = myURing->buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    map<uint64_t, struct uring_socket>::iterator uringSocketIter = myURingSockets.find(key);
+    if (uringSocketIter != myURingSockets.end() && uringSocketIter->second.attached) {
+        if (cqe->res > 0) {
+            myClients.find(socket)->second.buffer->append(readBytes, cqe->res);
+            consumeFromClient(socket, cqe->res);
+        } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            /* End of stream or a socket error. */
+            consumeFromClient(socket, 0);
+        }
+    }
+
+    if (readBytes) {
+        myURing->recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (uringSocketIter == myURingSockets.end() || (cqe->flags & IORING_CQE_F_MORE)) {
+        return;
+    }
+
+    struct uring_socket *uringSocket = &uringSocketIter->second;
+    uringSocket->receiving = false;
+    /* The kernel ends a multishot receive when it runs out of buffers. */
+    if (cqe->res == -ENOBUFS && uringSocket->attached && !uringSocket->leaving) {
+        receiveThroughURing(key);
+        return;
+    }
+    settleURingSocket(key);
+}
+
+void Server::sendThroughURing(int clientSocket) {
+    struct client_data *clientData = &myClients.find(clientSocket)->second;
+    uint64_t key = uringKeyOf(clientSocket);
+    struct uring_socket *uringSocket = &myURingSockets[key];
+    if (uringSocket->sending || uringSocket->leaving || clientData->closing ||
+        clientData->outQueue->empty()) {
+        return;
+    }
+
+    /* The packets stay referenced until the kernel is done with them, even
+       if the client goes away first. */
+    unsigned int numPackets = gatherOutput(clientData, uringSocket->iov);
+    for (unsigned int i = 0; i < numPackets; i++) {
+        uringSocket->inFlight[i] = clientData->outQueue->at(i);
+        uringSocket->inFlight[i]->retain();
+    }
+    uringSocket->numInFlight = numPackets;
+    clientData->inFlight = numPackets;
+
+    memset(&uringSocket->msg, 0, sizeof(uringSocket->msg));
+    uringSocket->msg.msg_iov = uringSocket->iov;
+    uringSocket->msg.msg_iovlen = numPackets;
+
+    struct io_uring_sqe *sqe = myURing->nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = clientSocket;
+    sqe->addr = (uint64_t) &uringSocket->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uringUserData(URING_SEND, key);
+    uringSocket->sending = true;
+    uringSocket->sendRound = myURingRound;
+}
+
+bool Server::sendPendingThroughURing(int clientSocket) {
+    /* Sends go in at the start of the next round and, unless the socket is
+       full, complete right there; one still out after that is stuck. */
+    struct uring_socket *uringSocket = &myURingSockets[uringKeyOf(clientSocket)];
+    return uringSocket->sending && myURingRound <= uringSocket->sendRound + 1;
+}
+
+void Server::sentThroughURing(uint64_t key, int result) {
+    map<uint64_t, struct uring_socket>::iterator uringSocketIter = myURingSockets.find(key);
+    if (uringSocketIter == myURingSockets.end()) {
+        return;
+    }
+
+    struct uring_socket *uringSocket = &uringSocketIter->second;
+    for (unsigned int i = 0; i < uringSocket->numInFlight; i++) {
+        uringSocket->inFlight[i]->release();
+    }
+    uringSocket->numInFlight = 0;
+    uringSocket->sending = false;
+
+    if (uringSocket->attached) {
+        int clientSocket = uringSocketOf(key);
+        struct client_data *clientData = &myClients.find(clientSocket)->second;
+        clientData->inFlight = 0;
+        if (result < 0) {
+            markForClosing(clientSocket, clientData);
+        } else {
+            consumeOutput(clientData, result);
+            sendThroughURing(clientSocket);
+        }
+    }
+    settleURingSocket(key);
+}
+
+void Server::cancelThroughURing(int operation, uint64_t key) {
+    struct io_uring_sqe *sqe = myURing->nextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uringUserData(operation, key);
+    sqe->user_data = uringUserData(URING_CANCEL, key);
+}
+
+void Server::leaveURing(int clientSocket) {
+    uint64_t key = uringKeyOf(clientSocket);
+    struct uring_socket *uringSocket = &myURingSockets[key];
+    if (uringSocket->leaving) {
+        return;
+    }
+
+    uringSocket->leaving = true;
+    if (uringSocket->receiving) {
+        cancelThroughURing(URING_RECEIVE, key);
+    } else if (!uringSocket->sending) {
+        settleURingSocket(key);
+    }
+}
+
+void Server::settleURingSocket(uint64_t key) {
+    map<uint64_t, struct uring_socket>::iterator uringSocketIter = myURingSockets.find(key);
+    struct uring_socket *uringSocket = &uringSocketIter->second;
+    if (uringSocket->receiving || uringSocket->sending) {
+        return;
+    }
+    if (!uringSocket->attached) {
+        myURingSockets.erase(uringSocketIter);
+        return;
+    }
+    if (!uringSocket->leaving) {
+        return;
+    }
+
+    /* Everything the ring read for the client has been played out here, so
+       it can go; unless those last packets brought it back. */
+    int clientSocket = uringSocketOf(key);
+    uringSocket->leaving = false;
+    struct client_data *clientData = &myClients.find(clientSocket)->second;
+    if (clientData->player != NO_PLAYER_HANDLE && !clientData->closing) {
+        int shard = shardOfLocation(PlayerSlab::lookup(clientData->player)->myLocation);
+        if (shard != myShardID) {
+            myURingSockets.erase(uringSocketIter);
+            handOff(clientSocket, shard);
+            return;
+        }
+    }
+    receiveThroughURing(key);
+    sendThroughURing(clientSocket);
+}
+
+#endif /* USE_IO_URING */
@@ -25,12 +25,107 @@ size_t calculatePaddingSize(int length) {
     return paddingSize;
 }
 
+uint64_t monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+bool syncDirectoryOf(std::string fileName) {
+    size_t slash = fileName.rfind('/');
+    std::string directory = slash == std::string::npos ? "." :
+        slash == 0 ? "/" : fileName.substr(0, slash);
+    int file = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (file < 0) {
+        return false;
+    }
+    bool synced = fsync(file) == 0;
+    close(file);
+    return synced;
+}
+
+/* xoshiro256**, one generator per thread so that shards never share state. */
+static __thread uint64_t randomState[4];
+static __thread bool randomSeeded = false;
+
+static uint64_t rotateLeft(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, which spreads any seed, even 0, over the whole state. */
+static uint64_t splitMix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void seedRandom(uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        randomState[i] = splitMix(&seed);
+    }
+    randomSeeded = true;
+}
+
+static uint64_t nextRandom() {
+    if (!randomSeeded) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        /* The address of the state tells threads apart. */
+        seedRandom((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec + (uintptr_t) randomState);
+    }
+    uint64_t *s = randomState;
+    uint64_t result = rotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotateLeft(s[3], 45);
+    return result;
+}
+
 int random(int low, int high) {
-    int n = (rand() % (high - low + 1)) + low;
+    /* Lemire's multiply and shift, rejecting the few draws that would make
+       some results likelier than others. */
+    uint32_t range = high - low + 1;
+    uint64_t product = (nextRandom() >> 32) * range;
+    if ((uint32_t) product < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t) product < threshold) {
+            product = (nextRandom() >> 32) * range;
+        }
+    }
+    int n = low + (int) (product >> 32);
     debug("generated random number %d in range (%d, %d)", n, low, high);
     return n;
 }
 
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void makeCrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+}
+
+uint32_t calc_crc32(unsigned char *data, size_t length) {
+    /* pthread_once also makes the finished table visible to every caller. */
+    pthread_once(&crcTableOnce, makeCrcTable);
+
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < length; i++) {
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
 uint32_t calc_p2p_id(unsigned char *name) {
     unsigned int hashval;
     for (hashval = 0; *name != 0; name++) {
@@ -42,3 +137,11 @@ uint32_t calc_p2p_id(unsigned char *name) {
 void printUserData(struct p2p_user_data user) {
     debug("user data:%s hp:%d exp:%d, (%u, %u)", user.name, user.hp, user.exp, user.x, user.y);
 }
+
+void printPacketBytes(unsigned char *packet, size_t length, uint8_t msgType) {
+    printf("msg ver:%d len:%lu type:%d raw_pkt(net_byte_order)=[", packet[0], length, msgType);
+    for (size_t i = 0; i < length; i++) {
+        printf("%02x ", packet[i]);
+    }
+    printf("]\n");
+}
@@ -0,0 +1,62 @@
+#include "tww.h"
+
+using namespace std;
+
+/* Times a full who-sees-whom pass: every player's vision queried through
+   Dungeon::playersWithin, as the server does for each move.
+
+   usage: vision_bench [players [passes]]
+
+   Players are spread one to a square, in rows, from the top left corner,
+   so 10000 of them fill the default 100x100 world. */
+
+static double millisSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int numPlayers = argc > 1 ? atoi(argv[1]) : 10000;
+    unsigned int numPasses = argc > 2 ? atoi(argv[2]) : 20;
+    if (numPlayers == 0 || numPlayers > (unsigned int) DUNGEON_SIZE_X * DUNGEON_SIZE_Y || numPasses == 0) {
+        fprintf(stderr, "usage: %s [players [passes]]\n", argv[0]);
+        return 1;
+    }
+
+    Dungeon dungeon(DUNGEON_SIZE_X, DUNGEON_SIZE_Y);
+    dungeon.setBoundary(0, 0, DUNGEON_SIZE_X - 1, DUNGEON_SIZE_Y - 1);
+    char name[MAX_LOGIN_LENGTH + 1];
+    for (unsigned int i = 0; i < numPlayers; i++) {
+        /* Indexes stay below the number of squares, which no world takes
+           past 10^8, so the remainder only shows the compiler that the name
+           fits. */
+        snprintf(name, sizeof(name), "p%u", i % 100000000u);
+        struct location loc = { (int) (i % DUNGEON_SIZE_X), (int) (i / DUNGEON_SIZE_X) };
+        dungeon.addPlayer(new Player(name, 100, 0, loc), i);
+    }
+
+    vector<int> found;
+    struct bounds vision;
+    unsigned long pairs = 0;
+    double best = 0, total = 0, elapsed;
+    struct timespec start;
+    for (unsigned int pass = 0; pass < numPasses; pass++) {
+        pairs = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned int i = 0; i < numPlayers; i++) {
+            vision = dungeon.visionOf(dungeon.playerAt(i)->myLocation);
+            dungeon.playersWithin(&vision, &vision, found);
+            pairs += found.size();
+        }
+        elapsed = millisSince(&start);
+        total += elapsed;
+        if (pass == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("%u players, %lu visible pairs per pass, %u passes: best %.2f ms, mean %.2f ms\n",
+        numPlayers, pairs, numPasses, best, total / numPasses);
+    return 0;
+}